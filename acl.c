@@ -0,0 +1,235 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "acl.h"
+
+// the active acl is swapped in whole on reload, the accept path only
+// holds the lock long enough to take a reference
+static pthread_mutex_t aclMutex = PTHREAD_MUTEX_INITIALIZER;
+static Acl* aclCurrent = NULL;
+
+static void AclRule_freeList(void* rulev)
+{
+    AclRule* rule = rulev;
+    while (rule) {
+        AclRule* next = rule->next;
+        free(rule);
+        rule = next;
+    }
+}
+
+static Acl* Acl_new()
+{
+    Acl* acl = calloc(1, sizeof(Acl));
+    if (!acl) { return NULL; }
+
+    acl->radix = Radix_new();
+    if (!acl->radix) {
+        free(acl);
+        return NULL;
+    }
+
+    acl->refs = 1;
+    return acl;
+}
+
+static void Acl_unref(Acl* acl)
+{
+    if (!acl) { return; }
+
+    pthread_mutex_lock(&aclMutex);
+    bool last = --acl->refs == 0;
+    pthread_mutex_unlock(&aclMutex);
+
+    if (last) {
+        Radix_free(&acl->radix, AclRule_freeList);
+        free(acl);
+    }
+}
+
+static bool Acl_add(Acl* acl, const char* cidr, bool allow, const Bouncer* bouncer)
+{
+    unsigned char key[RADIX_KEY_SIZE];
+    unsigned int bits;
+    if (!radixKeyFromCIDR(cidr, key, &bits)) {
+        fprintf(stderr, "Invalid acl mask: %s\n", cidr);
+        return false;
+    }
+
+    AclRule* rule = calloc(1, sizeof(AclRule));
+    if (!rule) {
+        perror("calloc");
+        return false;
+    }
+
+    void** slot = Radix_insert(acl->radix, key, bits);
+    if (!slot) {
+        perror("Radix_insert");
+        free(rule);
+        return false;
+    }
+
+    rule->allow = allow;
+    rule->bouncer = bouncer;
+    rule->next = *slot;
+    *slot = rule;
+    return true;
+}
+
+static bool Acl_addList(Acl* acl, AclEntry* entry, const Bouncer* bouncer)
+{
+    for (; entry; entry = entry->next) {
+        if (!Acl_add(acl, entry->cidr, entry->allow, bouncer)) { return false; }
+    }
+    return true;
+}
+
+// file lines are allow=<cidr>[,<cidr>] [listenip:port]
+static bool Acl_loadFile(Acl* acl, Config* config, const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open acl file: %s\n", strerror(errno));
+        return false;
+    }
+
+    bool okay = true;
+    char line[BUFSIZ];
+    while (okay && fgets(line, sizeof(line), fp)) {
+        stripCRLF(line);
+        if (*line == '\0' || *line == '#') { continue; }
+
+        const Bouncer* bouncer = NULL;
+        char* scope = strchr(line, ' ');
+        if (scope) {
+            *scope++ = '\0';
+            char* colon = strrchr(scope, ':');
+            long port;
+            if (colon) { *colon = '\0'; }
+            if (!colon || !strToLong(colon + 1, &port) ||
+                !(bouncer = Bouncer_find(config, scope, port))) {
+                okay = false;
+                break;
+            }
+        }
+
+        AclEntry* entries = NULL;
+        if (!strncasecmp(line, "allow=", 6)) {
+            okay = AclEntry_parseList(&entries, line + 6, true);
+        }
+        else if (!strncasecmp(line, "deny=", 5)) {
+            okay = AclEntry_parseList(&entries, line + 5, false);
+        }
+        else {
+            okay = false;
+        }
+
+        okay = okay && Acl_addList(acl, entries, bouncer);
+        AclEntry_freeList(&entries);
+    }
+
+    if (!okay) {
+        fprintf(stderr, "Error on this line in acl file: %s\n", line);
+    }
+
+    fclose(fp);
+    return okay;
+}
+
+// builds a new acl from the config and acl file and makes it active,
+// the current acl is left in place if anything fails
+bool Acl_load(Config* config)
+{
+    Acl* acl = Acl_new();
+    if (!acl) {
+        perror("Acl_new");
+        return false;
+    }
+
+    bool okay = Acl_addList(acl, config->acl, NULL);
+
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer && okay; bouncer = bouncer->next) {
+        okay = Acl_addList(acl, bouncer->acl, bouncer);
+    }
+
+    if (okay && config->aclFile) {
+        okay = Acl_loadFile(acl, config, config->aclFile);
+    }
+
+    if (!okay) {
+        Acl_unref(acl);
+        return false;
+    }
+
+    if (acl->radix->count == 0) {
+        Acl_unref(acl);
+        acl = NULL;
+    }
+
+    pthread_mutex_lock(&aclMutex);
+    Acl* old = aclCurrent;
+    aclCurrent = acl;
+    pthread_mutex_unlock(&aclMutex);
+
+    Acl_unref(old);
+    return true;
+}
+
+static bool AclRule_applies(void* rulev, void* bouncerv)
+{
+    AclRule* rule;
+    for (rule = rulev; rule; rule = rule->next) {
+        if (!rule->bouncer || rule->bouncer == bouncerv) { return true; }
+    }
+    return false;
+}
+
+// longest matching prefix decides, a bouncer's own rule beats a global
+// rule on the same prefix, anything unmatched is allowed
+bool Acl_allowed(const struct sockaddr_any* addr, const Bouncer* bouncer)
+{
+    pthread_mutex_lock(&aclMutex);
+    Acl* acl = aclCurrent;
+    if (acl) { acl->refs++; }
+    pthread_mutex_unlock(&aclMutex);
+
+    if (!acl) { return true; }
+
+    bool allowed = true;
+    unsigned char key[RADIX_KEY_SIZE];
+    if (radixKeyFromSockaddr(addr, key)) {
+        AclRule* rule = Radix_match(acl->radix, key, AclRule_applies, (void*) bouncer);
+        const AclRule* match = NULL;
+        for (; rule; rule = rule->next) {
+            if (rule->bouncer == bouncer) {
+                match = rule;
+                break;
+            }
+            if (!rule->bouncer && !match) { match = rule; }
+        }
+        if (match) { allowed = match->allow; }
+    }
+
+    Acl_unref(acl);
+    return allowed;
+}
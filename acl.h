@@ -0,0 +1,40 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_ACL_H
+#define EBBNC_ACL_H
+
+#include <stdbool.h>
+#include "config.h"
+#include "radix.h"
+#include "misc.h"
+
+typedef struct AclRule {
+    bool            allow;
+    const Bouncer*  bouncer;
+    struct AclRule* next;
+} AclRule;
+
+typedef struct {
+    Radix*          radix;
+    unsigned int    refs;
+} Acl;
+
+bool Acl_load(Config* config);
+bool Acl_allowed(const struct sockaddr_any* addr, const Bouncer* bouncer);
+
+#endif
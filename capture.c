@@ -0,0 +1,168 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "misc.h"
+
+static int captureFd = -1;
+static bool capturePayload = false;
+static unsigned int captureSessions = 0;
+
+// opened before any fork, every process appends to the same file
+bool Capture_start(Config* config)
+{
+    captureFd = open(config->capture, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (captureFd < 0) {
+        perror(config->capture);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(captureFd, &st) < 0) {
+        perror("fstat");
+        return false;
+    }
+
+    // an older capture may have been readable by others
+    if ((st.st_mode & 077) && fchmod(captureFd, 0600) < 0) {
+        perror("fchmod");
+        return false;
+    }
+
+    if (st.st_size == 0) {
+        CaptureHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = CAPTURE_VERSION;
+        if (write(captureFd, &header, sizeof(header)) != sizeof(header)) {
+            perror("write");
+            return false;
+        }
+    }
+
+    capturePayload = config->capturePayload;
+    return true;
+}
+
+bool Capture_enabled()
+{
+    return captureFd >= 0;
+}
+
+Capture* Capture_new()
+{
+    Capture* capture = malloc(sizeof(Capture));
+    if (!capture) { return NULL; }
+
+    unsigned int count = __atomic_add_fetch(&captureSessions, 1, __ATOMIC_RELAXED);
+    capture->session = (uint64_t) getpid() << 32 | count;
+    capture->verbLen = 0;
+    capture->secret = false;
+    capture->used = 0;
+    return capture;
+}
+
+static void Capture_flush(Capture* capture)
+{
+    if (capture->used == 0) { return; }
+    IGNORE_RESULT(write(captureFd, capture->buffer, capture->used));
+    capture->used = 0;
+}
+
+// copies what the client sent, starring out passwords. lines can be
+// split across chunks, so where the current one has got to is kept.
+static void Capture_redact(Capture* capture, char* out, const char* data, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        char c = data[i];
+        if (c == '\n') {
+            capture->verbLen = 0;
+            capture->secret = false;
+        }
+        else if (capture->secret && c != '\r') {
+            c = '*';
+        }
+        else if (capture->verbLen < CAPTURE_VERB_LEN) {
+            capture->verb[capture->verbLen++] = c;
+            capture->secret = capture->verbLen == CAPTURE_VERB_LEN &&
+                              (!strncasecmp(capture->verb, "PASS ", CAPTURE_VERB_LEN) ||
+                               !strncasecmp(capture->verb, "ACCT ", CAPTURE_VERB_LEN));
+        }
+        out[i] = c;
+    }
+}
+
+void Capture_add(Capture* capture, enum CaptureType type, unsigned int dir,
+                 const void* data, size_t len)
+{
+    CaptureRecord record;
+    record.session = capture->session;
+    record.us = monotonicUs();
+    record.len = len;
+    record.payloadLen = capturePayload && len <= UINT16_MAX ? len : 0;
+    record.type = type;
+    record.dir = dir;
+
+    size_t size = sizeof(record) + record.payloadLen;
+    if (capture->used + size > sizeof(capture->buffer)) { Capture_flush(capture); }
+
+    bool redact = dir == CAPTURE_CLIENT && record.payloadLen > 0;
+
+    // too big to buffer, it goes out in one write so it stays whole
+    if (size > sizeof(capture->buffer)) {
+        char* copy = NULL;
+        if (redact) {
+            copy = malloc(record.payloadLen);
+            if (!copy) { return; }
+            Capture_redact(capture, copy, data, record.payloadLen);
+        }
+
+        struct iovec iov[2];
+        iov[0].iov_base = &record;
+        iov[0].iov_len = sizeof(record);
+        iov[1].iov_base = copy ? copy : (void*) data;
+        iov[1].iov_len = record.payloadLen;
+        IGNORE_RESULT(writev(captureFd, iov, 2));
+        free(copy);
+        return;
+    }
+
+    memcpy(capture->buffer + capture->used, &record, sizeof(record));
+    char* payload = capture->buffer + capture->used + sizeof(record);
+    if (redact) { Capture_redact(capture, payload, data, record.payloadLen); }
+    else if (record.payloadLen > 0) { memcpy(payload, data, record.payloadLen); }
+    capture->used += size;
+}
+
+void Capture_free(Capture** capturep)
+{
+    if (*capturep) {
+        Capture_flush(*capturep);
+        free(*capturep);
+        *capturep = NULL;
+    }
+}
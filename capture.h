@@ -0,0 +1,80 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_CAPTURE_H
+#define EBBNC_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+
+// sessions can be captured for ebbnc-replay, a record per relayed chunk
+// with its time and size and optionally its bytes. each session buffers
+// its records and appends them to the one trace file whenever its buffer
+// fills and when it ends, so the records of a session are in order but
+// those of different sessions interleave, ebbnc-replay sorts them out.
+// the file is private to the bouncer's user and the arguments of PASS and
+// ACCT are starred out, keeping their length.
+
+#define CAPTURE_MAGIC       "EBBNCCAP"
+#define CAPTURE_VERSION     1
+#define CAPTURE_BUFFER      8192
+#define CAPTURE_VERB_LEN    5       // "PASS "
+
+enum CaptureType {
+    CAPTURE_OPEN,           // relay started
+    CAPTURE_DATA,
+    CAPTURE_CLOSE           // dir is the side that closed, 0 for neither
+};
+
+#define CAPTURE_CLIENT      1   // from the client to the server
+#define CAPTURE_SERVER      2   // from the server to the client
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        reserved;
+} CaptureHeader;
+
+// followed by payloadLen bytes, either 0 or len
+typedef struct {
+    uint64_t        session;
+    uint64_t        us;
+    uint32_t        len;
+    uint16_t        payloadLen;
+    uint8_t         type;
+    uint8_t         dir;
+} CaptureRecord;
+
+typedef struct {
+    uint64_t        session;
+    char            verb[CAPTURE_VERB_LEN];     // start of the client's current line
+    unsigned int    verbLen;
+    bool            secret;                     // the rest of the line is starred
+    size_t          used;
+    char            buffer[CAPTURE_BUFFER];
+} Capture;
+
+bool Capture_start(Config* config);
+bool Capture_enabled();
+Capture* Capture_new();
+void Capture_add(Capture* capture, enum CaptureType type, unsigned int dir,
+                 const void* data, size_t len);
+void Capture_free(Capture** capturep);
+
+#endif
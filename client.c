@@ -19,23 +19,133 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
 #include "client.h"
 #include "ident.h"
 #include "misc.h"
+#include "slab.h"
+#include "route.h"
+#include "tunnel.h"
+#include "resolve.h"
+#include "sockmap.h"
+#include "pool.h"
+#include "coro.h"
+
+static __thread Slab* clientSlab = NULL;
+static pthread_key_t slabKey;
+static pthread_once_t slabOnce = PTHREAD_ONCE_INIT;
+static Pool* clientPool = NULL;
+static Timer poolTimer;
+static unsigned int liveSessions = 0;
+static pthread_mutex_t liveMutex = PTHREAD_MUTEX_INITIALIZER;
+static Client* liveClients = NULL;
+
+static long Client_deadline(Timer* timer)
+{
+    Client* client = (Client*)((char*) timer - offsetof(Client, deadline));
+    if (client->deadlineReason) {
+        __atomic_store_n(&client->expired, client->deadlineReason, __ATOMIC_RELEASE);
+    }
+    shutdown(client->deadlineFd, client->deadlineHow);
+    return 0;
+}
+
+static void Client_sample(Client* client)
+{
+    UpstreamQuality quality;
+    if (Upstream_sample(client->upstream, client->rSock, &client->sample, &quality)) {
+        Stats_quality(client->upstreamStats, &quality);
+    }
+}
+
+// idle and write stalls share one timer that is never re-armed by the
+// relay itself, it checks the times the relay leaves and goes back to sleep
+static long Client_relayTimeout(Timer* timer)
+{
+    Client* client = (Client*)((char*) timer - offsetof(Client, relayTimer));
+    long now = Timer_nowMs();
+    long next = 0;
+
+    if (client->config->writeTimeout > 0) {
+        long timeout = client->config->writeTimeout * 1000L;
+        long writeMs = __atomic_load_n(&client->writeMs, __ATOMIC_ACQUIRE);
+        if (writeMs != 0 && now - writeMs >= timeout) {
+            __atomic_store_n(&client->expired, client->writeFd == client->cSock ?
+                             "Client write timeout" : "Server write timeout", __ATOMIC_RELEASE);
+            shutdown(client->writeFd, SHUT_RDWR);
+            return 0;
+        }
+
+        next = writeMs != 0 ? timeout - (now - writeMs) : timeout / 4;
+    }
+
+    // the relay doesn't see what the kernel relays, the sockets do
+    if (__atomic_load_n(&client->kernelRelay, __ATOMIC_ACQUIRE)) {
+        uint64_t seen = Sockmap_received(client->cSock) + Sockmap_received(client->rSock);
+        if (seen != client->kernelSeen) {
+            client->kernelSeen = seen;
+            __atomic_store_n(&client->activeMs, now, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (client->config->idleTimeout > 0) {
+        long timeout = client->config->idleTimeout * 1000L;
+        long activeMs = __atomic_load_n(&client->activeMs, __ATOMIC_RELAXED);
+        if (now - activeMs >= timeout) {
+            __atomic_store_n(&client->expired, "Idle timeout", __ATOMIC_RELEASE);
+            shutdown(client->cSock, SHUT_RD);
+            return 0;
+        }
+
+        long left = timeout - (now - activeMs);
+        if (next == 0 || left < next) { next = left; }
+    }
+
+    if (client->sampling) {
+        if (now - client->sampleMs >= UPSTREAM_SAMPLE_MS) {
+            Client_sample(client);
+            client->sampleMs = now;
+        }
+
+        long left = UPSTREAM_SAMPLE_MS - (now - client->sampleMs);
+        if (next == 0 || left < next) { next = left; }
+    }
+
+    return next;
+}
+
+// threads that launch sessions come and go, tunnel link readers among
+// them, each slab is let go with its thread
+static void Client_slabKey()
+{
+    pthread_key_create(&slabKey, Slab_release);
+}
 
 Client* Client_new()
 {
-    Client* client = calloc(1, sizeof(Client));
+    if (!clientSlab) {
+        pthread_once(&slabOnce, Client_slabKey);
+        clientSlab = Slab_new(sizeof(Client));
+        if (!clientSlab) { return NULL; }
+        pthread_setspecific(slabKey, clientSlab);
+    }
+
+    Client* client = Slab_alloc(clientSlab);
     if (!client) { return NULL; }
 
     client->cSock = -1;
     client->rSock = -1;
+    Timer_init(&client->deadline, Client_deadline);
+    Timer_init(&client->relayTimer, Client_relayTimeout);
 
     return client;
 }
@@ -44,46 +154,172 @@ void Client_free(Client** clientp)
 {
     if (*clientp) {
         Client* client = *clientp;
+        Timer_cancel(&client->deadline);
+        Timer_cancel(&client->relayTimer);
+#ifdef EBBNC_TLS
+        Tls_free(&client->cSsl);
+        Tls_free(&client->rSsl);
+#endif
         if (client->cSock >= 0) { close(client->cSock); }
         if (client->rSock >= 0) { close(client->rSock); }
-        free(client);
+        Slab_free(client);
         *clientp = NULL;
     }
 }
 
+static ssize_t Client_read(int sock, struct ssl_st* ssl, void* buf, size_t len)
+{
+#ifdef EBBNC_TLS
+    if (ssl) { return Tls_read(ssl, buf, len); }
+#else
+    (void) ssl;
+#endif
+    return Coro_read(sock, buf, len);
+}
+
+static ssize_t Client_write(int sock, struct ssl_st* ssl, const void* buf, size_t len)
+{
+#ifdef EBBNC_TLS
+    if (ssl) { return Tls_write(ssl, buf, len); }
+#else
+    (void) ssl;
+#endif
+    return Coro_write(sock, buf, len);
+}
+
+static bool Client_pending(struct ssl_st* ssl)
+{
+#ifdef EBBNC_TLS
+    return ssl && Tls_pending(ssl);
+#else
+    (void) ssl;
+    return false;
+#endif
+}
+
+// a 220- welcome still open must be closed first, or the client reads
+// the 421 as a malformed line of the greeting
 void Client_errorReply(Client* client, const char* msg)
 {
-    char* buf = strPrintf("421 %s\r\n", msg);
-    if (!buf) {
-        perror("strPrintf");
-        return;
+    int len = snprintf(client->line, sizeof(client->line),
+                       client->bannerOpen ? "220 %s\r\n421 %s\r\n" : "421 %s\r\n", msg, msg);
+    if (len >= (int) sizeof(client->line)) {
+        len = sizeof(client->line) - 1;
+        client->line[len - 2] = '\r';
+        client->line[len - 1] = '\n';
     }
 
-    IGNORE_RESULT(write(client->cSock, buf, strlen(buf)));
-    free(buf);
+    IGNORE_RESULT(Client_write(client->cSock, client->cSsl, client->line, len));
 }
 
-void Client_errnoReply(Client* client, const char* funclient, int errno_)
+static void Client_errnoMessage(char* msg, size_t len, const char* funclient, int errno_)
 {
     char errnoMsg[256];
     if (strerror_r(errno_, errnoMsg, sizeof(errnoMsg)) < 0) {
         strncpy(errnoMsg, "Unknown error", sizeof(errnoMsg));
     }
 
-    char* msg = strPrintf("%s: %s", funclient, errnoMsg);
-    if (!msg) {
-        perror("sprintf");
-        return;
-    }
+    snprintf(msg, len, "%s: %s", funclient, errnoMsg);
+}
 
+void Client_errnoReply(Client* client, const char* funclient, int errno_)
+{
+    Flight_add(&client->flight, FLIGHT_ERRNO, 0, errno_);
+    char msg[CLIENT_LINE_SIZE];
+    Client_errnoMessage(msg, sizeof(msg), funclient, errno_);
     Client_errorReply(client, msg);
-    free(msg);
 }
 
-bool Client_sendIdnt(Client* client)
+// shuts down fd when the deadline passes, the reason is what the
+// client is told, without one the session carries on
+static void Client_arm(Client* client, int fd, int how, const char* reason, long ms)
+{
+    if (ms <= 0) { return; }
+
+    client->deadlineFd = fd;
+    client->deadlineHow = how;
+    client->deadlineReason = reason;
+    Timer_arm(&client->deadline, ms);
+}
+
+static void Client_disarm(Client* client)
+{
+    Timer_cancel(&client->deadline);
+}
+
+static const char* Client_expired(Client* client)
+{
+    return __atomic_load_n(&client->expired, __ATOMIC_ACQUIRE);
+}
+
+static void Client_armRelay(Client* client)
+{
+    long ms = 0;
+    if (client->config->writeTimeout > 0) { ms = client->config->writeTimeout * 250L; }
+    if (client->config->idleTimeout > 0 &&
+        (ms == 0 || client->config->idleTimeout * 1000L < ms)) {
+        ms = client->config->idleTimeout * 1000L;
+    }
+
+    if (client->sampling && (ms == 0 || UPSTREAM_SAMPLE_MS < ms)) { ms = UPSTREAM_SAMPLE_MS; }
+
+    if (ms > 0) { Timer_arm(&client->relayTimer, ms); }
+}
+
+static void Client_identHook(int identSock, void* clientv)
+{
+    Client* client = clientv;
+    if (identSock < 0) {
+        Client_disarm(client);
+    }
+    else {
+        Client_arm(client, identSock, SHUT_RDWR, NULL, client->config->identTimeout * 1000L);
+    }
+}
+
+// returns now so the next phase can start from it
+static long Client_phase(Client* client, unsigned int phase, long startUs)
+{
+    long now = monotonicUs();
+    client->phaseUs[phase] = now - startUs;
+    Flight_add(&client->flight, FLIGHT_PHASE, phase, now - startUs);
+    StatsHistogram_add(&client->stats->phaseUs[phase], now - startUs);
+    return now;
+}
+
+static void Client_slowLog(Client* client, const char* outcome)
 {
-    if (!client->config->idnt) { return true; }
+    long totalUs = monotonicUs() - client->acceptUs;
+    if (!client->config->slowLog || totalUs < client->config->slowThreshold * 1000L) {
+        return;
+    }
+
+    char ip[INET6_ADDRSTRLEN];
+    if (!ipFromSockaddr(&client->cAddr, ip)) { strcpy(ip, "?"); }
 
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+
+    char line[512];
+    size_t len = snprintf(line, sizeof(line), "%s %s %s:%li %s total=%.1fms", timestamp,
+                          ip, client->bouncer->listenIP, client->bouncer->listenPort,
+                          outcome, totalUs / 1000.0);
+
+    unsigned int i;
+    for (i = 0; i < STATS_PHASES - 1 && len < sizeof(line); ++i) {
+        len += snprintf(line + len, sizeof(line) - len, " %s=%.1fms",
+                        Stats_phaseName(i), client->phaseUs[i] / 1000.0);
+    }
+
+    if (len >= sizeof(line)) { len = sizeof(line) - 1; }
+    line[len++] = '\n';
+    Stats_slowLog(line, len);
+}
+
+int Client_formatIdnt(Client* client)
+{
     char user[IDENT_LEN];
 
     {
@@ -91,98 +327,569 @@ bool Client_sendIdnt(Client* client)
         socklen_t slen = sizeof(localAddr);
         if (getsockname(client->cSock, &localAddr.sa, &slen) < 0) {
             perror("getsockname");
-            return false;
+            return -1;
         }
 
-        if (!identLookup(client->cSock, client->config->identTimeout, user)) {
-            strcpy(user, "*");
+        long start = monotonicUs();
+        if (!identCached(&client->cAddr, user)) {
+            enum IdentResult result = identLookup(client->cSock, user, Client_identHook, client);
+            if (result != IDENT_OK) { strcpy(user, "*"); }
+            identRemember(&client->cAddr, result, user, client->config->identCache,
+                          client->config->identSkip);
         }
+        Client_phase(client, STATS_PHASE_IDENT, start);
     }
-puts(user);
+
     char ip[INET6_ADDRSTRLEN];
-    if (!ipFromSockaddr(&client->cAddr, ip)) { return false; }
+    if (!ipFromSockaddr(&client->cAddr, ip)) { return -1; }
 
     char hostname[NI_MAXHOST];
+    long start = monotonicUs();
     if (!client->config->dnsLookup ||
-        getnameinfo(&client->cAddr.sa, sizeof(client->cAddr),
-                    hostname, sizeof(hostname), NULL, 0, 0) != 0) {
+        !Resolve_name(&client->cAddr, hostname, sizeof(hostname))) {
 
         strncpy(hostname, ip, sizeof(ip));
     }
+    if (client->config->dnsLookup) { Client_phase(client, STATS_PHASE_DNS, start); }
+
+    int len = snprintf(client->line, sizeof(client->line), "IDNT %s@%s:%s\n",
+                       user, ip, hostname);
+    if (len >= (int) sizeof(client->line)) { return -1; }
+
+    return len;
+}
+
+bool Client_sendIdnt(Client* client)
+{
+    // a transparent server already sees the client's address
+    int len = 0;
+    if (client->config->idnt && !client->bouncer->transparent) {
+        len = Client_formatIdnt(client);
+        if (len < 0) { return false; }
+    }
+
+    client->idntSentUs = monotonicUs();
+    if (len == 0) { return true; }
 
-    char* buf = strPrintf("IDNT %s@%s:%s\n", user, ip, hostname);
-    if (!buf) {
-        perror("strPrintf");
+    return Coro_write(client->rSock, client->line, len) == len;
+}
+
+bool Client_connectTunnel(Client* client)
+{
+    long start = monotonicUs();
+    client->rSock = Tunnel_open(client->bouncer, &client->cAddr);
+    Client_phase(client, STATS_PHASE_CONNECT, start);
+    if (client->rSock < 0) {
+        Client_errnoReply(client, "tunnel", errno);
         return false;
     }
 
-    ssize_t len = strlen(buf);
-    bool ret = write(client->rSock, buf, len) == len;
-    free(buf);
-    return ret;
+    return true;
 }
 
-bool Client_connect(Client* client)
+// binds the server socket to the client's own address so the server
+// sees who it really is, needs CAP_NET_ADMIN and the server's replies
+// routed back through this host
+static bool Client_bindTransparent(Client* client, char* msg, size_t len)
+{
+    struct sockaddr_any addr = client->cAddr;
+    if (addr.san_family == AF_INET6 && client->rAddr.san_family == AF_INET &&
+        IN6_IS_ADDR_V4MAPPED(&addr.s6.sin6_addr)) {
+        struct in_addr in;
+        memcpy(&in, &addr.s6.sin6_addr.s6_addr[12], sizeof(in));
+        memset(&addr, 0, sizeof(addr));
+        addr.s4.sin_family = AF_INET;
+        addr.s4.sin_addr = in;
+    }
+
+    if (addr.san_family != client->rAddr.san_family) {
+        snprintf(msg, len, "transparent: client and server address families differ");
+        return false;
+    }
+
+    // any free port, the client's own may already be taken towards this server
+    if (addr.san_family == AF_INET) { addr.s4.sin_port = 0; }
+    else { addr.s6.sin6_port = 0; }
+
+    int optval = 1;
+    int ret = addr.san_family == AF_INET ?
+              setsockopt(client->rSock, SOL_IP, IP_TRANSPARENT, &optval, sizeof(optval)) :
+              setsockopt(client->rSock, SOL_IPV6, IPV6_TRANSPARENT, &optval, sizeof(optval));
+    if (ret < 0) {
+        Client_errnoMessage(msg, len, "transparent", errno);
+        return false;
+    }
+    setsockopt(client->rSock, SOL_IP, IP_FREEBIND, &optval, sizeof(optval));
+
+    if (bind(client->rSock, &addr.sa, sockaddrLen(&addr)) < 0) {
+        Client_errnoMessage(msg, len, "bind", errno);
+        return false;
+    }
+
+    return true;
+}
+
+// one attempt at one upstream, why it failed is left in msg as the next
+// upstream may yet save the session
+static bool Client_connectUpstream(Client* client, Upstream* upstream, long deadlineMs,
+                                   char* msg, size_t len)
 {
     const char* errmsg = NULL;
-    if (!hostPortToSockaddr(client->bouncer->remoteHost, client->bouncer->remotePort, &client->rAddr, &errmsg)) {
+    long start = monotonicUs();
+    bool resolved = Resolve_address(upstream->host, upstream->port, &client->rAddr, &errmsg);
+    Client_phase(client, STATS_PHASE_RESOLVE, start);
+    if (!resolved) {
         if (!errmsg) {
-          Client_errnoReply(client, "hostPortToSockaddr", errno);
-          return false;
+            Client_errnoMessage(msg, len, "resolve", errno);
         }
-
-        char* msg = strPrintf("hostPortToSockaddr: %s", errmsg);
-        if (!msg) {
-            perror("sprintf");
-            return false;
+        else {
+            snprintf(msg, len, "resolve: %s", errmsg);
         }
-
-        Client_errorReply(client, msg);
-        free(msg);
         return false;
     }
 
     client->rSock = socket(client->rAddr.san_family, SOCK_STREAM, 0);
     if (client->rSock < 0) {
-        Client_errnoReply(client, "socket", errno);
+        Client_errnoMessage(msg, len, "socket", errno);
         return false;
     }
 
-    if (client->config->writeTimeout > 0) {
-      setWriteTimeout(client->rSock, client->config->writeTimeout);
-    }
-
     {
         int optval = 1;
         setsockopt(client->rSock, IPPROTO_TCP, TCP_NODELAY, (char*)&optval, sizeof(optval));
     }
 
-    if (client->bouncer->localIP) {
+    if (client->bouncer->transparent) {
+        if (!Client_bindTransparent(client, msg, len)) { return false; }
+    }
+    else if (client->bouncer->localIP) {
         struct sockaddr_any lAddr;
         if (!ipPortToSockaddr(client->bouncer->localIP, 0, &lAddr)) {
-            Client_errorReply(client, "invalid localip");
+            snprintf(msg, len, "invalid localip");
             return false;
         }
 
         if (bind(client->rSock, &lAddr.sa, sockaddrLen(&lAddr)) < 0) {
-            Client_errnoReply(client, "bind", errno);
+            Client_errnoMessage(msg, len, "bind", errno);
             return false;
         }
     }
 
-    if (connect(client->rSock, &client->rAddr.sa, sockaddrLen(&client->rAddr)) < 0) {
-        Client_errnoReply(client, "connect", errno);
+    if (deadlineMs > 0) {
+        long remainingMs = deadlineMs - Timer_nowMs();
+        Client_arm(client, client->rSock, SHUT_RDWR, "Connect timeout",
+                   remainingMs > 0 ? remainingMs : 1);
+    }
+    start = monotonicUs();
+    int ret = Coro_connect(client->rSock, &client->rAddr.sa, sockaddrLen(&client->rAddr));
+    int errno_ = errno;
+    long connectUs = Client_phase(client, STATS_PHASE_CONNECT, start) - start;
+    Client_disarm(client);
+
+    if (ret < 0) {
+        Flight_add(&client->flight, FLIGHT_ERRNO, 0, errno_);
+        Upstream_failure(upstream);
+        if (Client_expired(client)) {
+            snprintf(msg, len, "%s", Client_expired(client));
+        }
+        else {
+            Client_errnoMessage(msg, len, "connect", errno_);
+        }
         return false;
     }
 
+    Upstream_success(upstream, connectUs);
     return true;
 }
 
+// the routed upstream, then the alternate if there is one, skipping any
+// whose breaker is open and all within the one connect timeout, the
+// alternate goes first while the routed one is degraded
+bool Client_connectRemote(Client* client)
+{
+    Upstream* upstreams[2] = { client->upstream, client->bouncer->alternate };
+    if (upstreams[1] && Upstream_degraded(upstreams[0], client->bouncer->minQuality) &&
+        Upstream_score(upstreams[1]) > Upstream_score(upstreams[0])) {
+        upstreams[0] = client->bouncer->alternate;
+        upstreams[1] = client->upstream;
+    }
+
+    long deadlineMs = client->config->connectTimeout > 0 ?
+                      Timer_nowMs() + client->config->connectTimeout * 1000L : 0;
+
+    char msg[CLIENT_LINE_SIZE];
+    snprintf(msg, sizeof(msg), "Server unavailable, try again later");
+
+    unsigned int i;
+    for (i = 0; i < 2; ++i) {
+        Upstream* upstream = upstreams[i];
+        if (!upstream || (i > 0 && upstream == upstreams[0])) { continue; }
+        if (Client_expired(client) || (deadlineMs > 0 && Timer_nowMs() >= deadlineMs)) { break; }
+        if (!Upstream_allow(upstream)) { continue; }
+
+        if (Client_connectUpstream(client, upstream, deadlineMs, msg, sizeof(msg))) {
+            client->upstream = upstream;
+            return true;
+        }
+
+        if (client->rSock >= 0) {
+            close(client->rSock);
+            client->rSock = -1;
+        }
+    }
+
+    Client_errorReply(client, msg);
+    return false;
+}
+
+// write stalls are caught by the relay timer, which only looks at
+// writeMs so there is nothing to arm or cancel per write
+static ssize_t Client_relayWrite(Client* client, int sock, struct ssl_st* ssl,
+                                 const void* buf, size_t len)
+{
+    client->writeFd = sock;
+    __atomic_store_n(&client->writeMs, Timer_nowMs(), __ATOMIC_RELEASE);
+    ssize_t ret = Client_write(sock, ssl, buf, len);
+    int errno_ = errno;
+    __atomic_store_n(&client->writeMs, 0, __ATOMIC_RELEASE);
+
+    Flight_add(&client->flight, FLIGHT_WRITE, sock == client->cSock ? FLIGHT_CLIENT :
+               FLIGHT_SERVER, ret);
+    errno = errno_;
+    return ret;
+}
+
+#ifdef EBBNC_TLS
+
+static bool Client_watchCommands(const Client* client)
+{
+    return client->bouncer->tlsMode == TLS_TERMINATE ||
+           (client->bouncer->tlsMode == TLS_REORIGINATE && !client->cSsl);
+}
+
+// the command in upper case with its line end and extra spacing dropped,
+// clients differ in all three
+static size_t Client_normalise(const char* line, size_t len, char* out)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        char c = line[i];
+        if (c == '\r' || c == '\n') { continue; }
+        if (c == ' ' || c == '\t') {
+            if (n > 0 && out[n - 1] != ' ') { out[n++] = ' '; }
+            continue;
+        }
+        out[n++] = toupper((unsigned char) c);
+    }
+
+    if (n > 0 && out[n - 1] == ' ') { --n; }
+    out[n] = '\0';
+    return n;
+}
+
+// the argument if the command is verb, otherwise NULL
+static const char* Client_argument(const char* cmd, size_t len, const char* verb)
+{
+    size_t verbLen = strlen(verb);
+    if (len < verbLen || memcmp(cmd, verb, verbLen) || (len > verbLen && cmd[verbLen] != ' ')) {
+        return NULL;
+    }
+    return len > verbLen ? cmd + verbLen + 1 : cmd + len;
+}
+
+// 1 to pass the line on, 0 if it was dealt with here, -1 on failure.
+// once tls ends here the server never saw AUTH, so PBSZ and PROT are
+// answered for it, and with data connections relayed as is only PROT C
+// can be honoured
+static int Client_command(Client* client, const char* line, size_t len)
+{
+    char cmd[CLIENT_COMMAND_SIZE + 1];
+    size_t n = Client_normalise(line, len, cmd);
+    const char* arg = Client_argument(cmd, n, "AUTH");
+
+    if (!client->cSsl) {
+        if (!arg || (strcmp(arg, "TLS") && strcmp(arg, "SSL"))) { return 1; }
+        client->authHeld = true;
+        return 0;
+    }
+
+    const char* reply;
+    if (arg) {
+        reply = "503 TLS is already active.\r\n";
+    } else if ((arg = Client_argument(cmd, n, "PBSZ"))) {
+        reply = *arg ? "200 PBSZ=0\r\n" : "501 PBSZ needs an argument.\r\n";
+    } else if ((arg = Client_argument(cmd, n, "PROT"))) {
+        reply = !*arg ? "501 PROT needs an argument.\r\n" :
+                !strcmp(arg, "C") ? "200 Protection level set to C.\r\n" :
+                "536 Only PROT C is supported, data connections are not encrypted.\r\n";
+    } else {
+        return 1;
+    }
+
+    if (Client_relayWrite(client, client->cSock, client->cSsl, reply, strlen(reply)) < 0) {
+        if (!Client_expired(client)) { Client_errnoReply(client, "write", errno); }
+        return -1;
+    }
+    return 0;
+}
+
+// keeps whole lines to pass on at the start of buf, which has room for a
+// held partial line in front of what was read. a client mustn't send
+// anything after AUTH until the reply, so whatever follows it is dropped
+// rather than risk it crossing into the tls session
+static ssize_t Client_commands(Client* client, char* buf, size_t len)
+{
+    if (client->authHeld) { return 0; }
+
+    memmove(buf + client->commandLen, buf, len);
+    memcpy(buf, client->command, client->commandLen);
+    len += client->commandLen;
+    client->commandLen = 0;
+
+    size_t out = 0;
+    size_t pos = 0;
+    while (pos < len && !client->authHeld) {
+        const char* nl = memchr(buf + pos, '\n', len - pos);
+        size_t lineLen = nl ? (size_t) (nl - buf) + 1 - pos : len - pos;
+
+        bool pass = true;
+        if (client->commandLong || lineLen > sizeof(client->command)) {
+            // too long to be any command looked at here
+            client->commandLong = !nl;
+        } else if (!nl) {
+            memcpy(client->command, buf + pos, lineLen);
+            client->commandLen = lineLen;
+            pass = false;
+        } else {
+            int ret = Client_command(client, buf + pos, lineLen);
+            if (ret < 0) { return -1; }
+            pass = ret > 0;
+        }
+
+        if (pass) {
+            memmove(buf + out, buf + pos, lineLen);
+            out += lineLen;
+        }
+        pos += lineLen;
+    }
+
+    return out;
+}
+
+// reads until the last line of the reply, the server sends nothing more
+// until it has the client hello so this can't read into the handshake
+static int Client_readReply(Client* client)
+{
+    size_t len = 0;
+    while (len < sizeof(client->line) - 1) {
+        ssize_t ret = read(client->rSock, client->line + len, sizeof(client->line) - 1 - len);
+        if (ret <= 0) { return -1; }
+        len += ret;
+        client->line[len] = '\0';
+
+        if (client->line[len - 1] != '\n') { continue; }
+
+        char* last = client->line + len - 1;
+        while (last > client->line && last[-1] != '\n') { --last; }
+        if (strlen(last) > 4 && last[3] == ' ') { return len; }
+    }
+
+    return -1;
+}
+
+// 1 once the server is speaking tls, 0 if it refused and the session stays
+// plain, -1 on failure
+static int Client_reoriginate(Client* client)
+{
+    static const char auth[] = "AUTH TLS\r\n";
+    if (write(client->rSock, auth, sizeof(auth) - 1) != sizeof(auth) - 1) {
+        if (!Client_expired(client)) { Client_errnoReply(client, "write", errno); }
+        return -1;
+    }
+
+    int len = Client_readReply(client);
+    if (len < 0) {
+        if (!Client_expired(client)) { Client_errorReply(client, "Invalid AUTH reply from server"); }
+        return -1;
+    }
+
+    // the server's refusal goes back as is
+    if (strncmp(client->line, "234", 3)) {
+        return write(client->cSock, client->line, len) == len ? 0 : -1;
+    }
+
+    client->rSsl = Tls_connect(client->rSock, client->upstream);
+    if (!client->rSsl) {
+        if (!Client_expired(client)) { Client_errorReply(client, "TLS handshake with server failed"); }
+        return -1;
+    }
+
+    return 1;
+}
+
+// the handshakes block, a peer that stalls in one is cut off by the deadline
+static bool Client_startTls(Client* client)
+{
+    long timeoutMs = client->config->tlsTimeout * 1000L;
+    if (client->bouncer->tlsMode == TLS_REORIGINATE) {
+        Client_arm(client, client->rSock, SHUT_RDWR, "TLS handshake with server timed out",
+                   timeoutMs);
+        int ret = Client_reoriginate(client);
+        Client_disarm(client);
+        if (ret <= 0) { return ret == 0; }
+    }
+
+    static const char reply[] = "234 AUTH TLS successful\r\n";
+    if (write(client->cSock, reply, sizeof(reply) - 1) != sizeof(reply) - 1) {
+        return false;
+    }
+
+    Client_arm(client, client->cSock, SHUT_RDWR, "TLS handshake timed out", timeoutMs);
+    client->cSsl = Tls_accept(client->cSock);
+    Client_disarm(client);
+    return client->cSsl != NULL;
+}
+
+#endif
+
+// a lone NOOP with nothing outstanding is answered here, bar one per
+// interval that goes through so the server still sees the session alive
+static bool Client_absorbNoop(Client* client, const char* buf, size_t len)
+{
+    if (client->bouncer->noopInterval <= 0 || !client->setupDone || len == 0 ||
+        buf[len - 1] != '\n' || !FtpScan_idle(&client->scan)) {
+        return false;
+    }
+
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) { --len; }
+    if (len != 4 || strncasecmp(buf, "NOOP", 4)) { return false; }
+
+    return Timer_nowMs() - client->forwardedMs < client->bouncer->noopInterval * 1000L;
+}
+
+bool Client_connect(Client* client)
+{
+    bool okay = client->bouncer->tunnelMode == TUNNEL_EDGE ?
+                Client_connectTunnel(client) : Client_connectRemote(client);
+
+    if (!okay) { STATS_ADD(client->stats->connectFailures, 1); }
+    return okay;
+}
+
+// talkers are only updated every so often, it takes a lock
+static void Client_count(Client* client, uint64_t* counter, size_t len)
+{
+    STATS_ADD(*counter, len);
+    STATS_ADD(client->worker->bytes, len);
+
+    client->unreported += len;
+    if (client->unreported >= STATS_REPORT_BYTES) {
+        Stats_talker(&client->cAddr, client->unreported);
+        client->unreported = 0;
+    }
+}
+
+// once the session is set up and nothing needs to see its bytes, the
+// kernel can relay it, the loop then only wakes for what it passes up,
+// the client's socket goes in last as servers only talk when spoken to
+static void Client_startKernelRelay(Client* client)
+{
+    if (!client->bouncer->kernelRelay || client->bouncer->tunnelMode != TUNNEL_NONE ||
+        client->bouncer->tlsMode != TLS_NONE || client->scanning || client->capture) {
+        return;
+    }
+
+    client->kernelReceived[0] = Sockmap_received(client->cSock);
+    client->kernelReceived[1] = Sockmap_received(client->rSock);
+    client->kernelQueued[0] = Sockmap_queued(client->cSock);
+    client->kernelQueued[1] = Sockmap_queued(client->rSock);
+    client->kernelSeen = client->kernelReceived[0] + client->kernelReceived[1];
+    __atomic_store_n(&client->kernelRelay, Sockmap_add(client->cSock, client->rSock),
+                     __ATOMIC_RELEASE);
+    Flight_add(&client->flight, FLIGHT_KERNEL, 0, client->kernelRelay);
+}
+
+// what the kernel has taken in but not yet queued on the other socket
+// is lost on close, so wait for it for as long as it keeps moving
+static void Client_stopKernelRelay(Client* client)
+{
+    if (!client->kernelRelay) { return; }
+
+    long limitMs = client->config->writeTimeout > 0 ? client->config->writeTimeout * 1000L :
+                   CLIENT_DRAIN_MS;
+    long movedMs = Timer_nowMs();
+    long napMs = 1;
+    uint64_t last = 0;
+    uint64_t in;
+    uint64_t out;
+    while (true) {
+        in = Sockmap_received(client->cSock) - client->kernelReceived[0];
+        out = Sockmap_received(client->rSock) - client->kernelReceived[1];
+        uint64_t toClient = Sockmap_queued(client->cSock) - client->kernelQueued[0];
+        uint64_t toServer = Sockmap_queued(client->rSock) - client->kernelQueued[1];
+        long nowMs = Timer_nowMs();
+        if ((toClient >= out && toServer >= in) || nowMs - movedMs >= limitMs) { break; }
+
+        if (toClient + toServer != last) {
+            last = toClient + toServer;
+            movedMs = nowMs;
+            napMs = 1;
+        }
+
+        // a full send queue holds the redirect back, so sleep until it has
+        // room, with room it is the kernel's backlog and that is quick
+        struct pollfd fds[2];
+        nfds_t nfds = 0;
+        if (toClient < out) { fds[nfds++] = (struct pollfd) { client->cSock, POLLOUT, 0 }; }
+        if (toServer < in) { fds[nfds++] = (struct pollfd) { client->rSock, POLLOUT, 0 }; }
+
+        long remainingMs = limitMs - (nowMs - movedMs);
+        int ret = Coro_poll(fds, nfds, remainingMs);
+        if (ret < 0 && errno != EINTR) { break; }
+        if (ret > 0) {
+            for (nfds_t i = 0; i < nfds; ++i) {
+                if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) { ret = -1; }
+            }
+            if (ret < 0) { break; }
+
+            Coro_sleep(napMs < remainingMs ? napMs : remainingMs);
+            if (napMs < CLIENT_DRAIN_BACKOFF_MS) { napMs *= 2; }
+        }
+    }
+
+    Client_count(client, &client->stats->bytesIn, in - client->kernelPassed[0]);
+    Client_count(client, &client->stats->bytesOut, out - client->kernelPassed[1]);
+    __atomic_store_n(&client->kernelRelay, false, __ATOMIC_RELEASE);
+}
+
+// a session that keeps finding data ready gives the others a turn once it
+// has used its budget, and runs behind control sessions from then on
+static void Client_yield(Client* client)
+{
+    client->bulkMs = client->activeMs;
+    if (!client->bulk) {
+        client->bulk = true;
+        Coro_setBulk(true);
+    }
+    Coro_yield();
+}
+
+static void Client_control(Client* client)
+{
+    if (client->bulk && client->activeMs - client->bulkMs >= CLIENT_BULK_MS) {
+        client->bulk = false;
+        Coro_setBulk(false);
+    }
+}
+
 void Client_relay(Client* client)
 {
-    int timeout = client->config->idleTimeout == 0 ? -1 : client->config->idleTimeout * 1000;
-    char buf[BUFSIZ];
+    char buf[BUFSIZ + CLIENT_COMMAND_SIZE];
     struct pollfd fds[2];
+    bool kernelTried = false;
+    bool draining = false;
+    size_t burst = 0;
+    unsigned int loops = 0;
 
     fds[0].fd = client->cSock;
     fds[0].events = POLLIN;
@@ -192,30 +899,119 @@ void Client_relay(Client* client)
     fds[1].events = POLLIN;
     fds[1].revents = 0;
 
+    Client_arm(client, client->rSock, SHUT_RD, "Server did not respond",
+               client->config->firstByteTimeout * 1000L);
+
+    client->activeMs = Timer_nowMs();
+    // sessions that still reach a degraded upstream are all sampled so
+    // it can be seen to recover
+    if (client->bouncer->tunnelMode != TUNNEL_EDGE && client->config->qualitySample > 0 &&
+        (Upstream_pickSample(client->upstream, client->config->qualitySample) ||
+         Upstream_score(client->upstream) < (unsigned int) client->bouncer->minQuality)) {
+        client->upstreamStats = Stats_upstream(client->upstream);
+        client->sampleMs = client->activeMs;
+        client->sampling = true;
+    }
+    Client_armRelay(client);
+
+    // noop absorption and a pipelined AUTH need to know when no reply is
+    // outstanding
+    if (client->config->commandStats || client->bouncer->noopInterval > 0 ||
+        client->bouncer->tlsMode != TLS_NONE) {
+        FtpScan_init(&client->scan, client->config->commandStats ?
+                     Stats_commands(client->bouncer, client->upstream) : NULL,
+                     client->bouncer->tlsMode != TLS_NONE);
+        client->scanning = true;
+    }
+    client->forwardedMs = client->activeMs;
+
+    unsigned int closedBy = 0;
+    if (Capture_enabled()) {
+        client->capture = Capture_new();
+        if (client->capture) { Capture_add(client->capture, CAPTURE_OPEN, 0, NULL, 0); }
+    }
+
     while (true) {
-        int ret = poll(fds, 2, timeout);
-        if (ret == 0) {
-            Client_errorReply(client, "Idle timeout");
-            break;
+#ifdef EBBNC_TLS
+        // AUTH goes ahead once the server's greeting and its answers to what
+        // came before have been relayed, nothing of the server's may be
+        // left to mistake for the AUTH reply or to cross into the tls session
+        if (client->authHeld && (client->scan.disabled ||
+                                 (client->scan.greeted && FtpScan_idle(&client->scan)))) {
+            client->authHeld = false;
+            if (!Client_startTls(client)) { break; }
         }
+#endif
 
+        // a wakeup lasts while full reads say there is more to come
+        if (!draining) {
+            burst = 0;
+            loops = 0;
+            Client_control(client);
+        }
+        else if (burst >= CLIENT_BURST_BYTES || ++loops >= CLIENT_BURST_LOOPS) {
+            Client_yield(client);
+            burst = 0;
+            loops = 0;
+        }
+        draining = false;
+
+        // tls may hold decrypted data the socket no longer shows as readable
+        bool cPending = Client_pending(client->cSsl);
+        bool rPending = Client_pending(client->rSsl);
+
+        int ret = Coro_poll(fds, 2, cPending || rPending ? 0 : -1);
         if (ret < 0) {
             Client_errnoReply(client, "poll", errno);
             break;
         }
 
-        if (fds[0].revents & POLLIN) {
-            ssize_t len = read(client->cSock, buf, sizeof(buf));
+        __atomic_store_n(&client->activeMs, Timer_nowMs(), __ATOMIC_RELAXED);
+        Flight_add(&client->flight, FLIGHT_POLL,
+                   ((fds[0].revents & POLLIN) || cPending ? FLIGHT_CLIENT : 0) |
+                   ((fds[1].revents & POLLIN) || rPending ? FLIGHT_SERVER : 0), ret);
+
+        if ((fds[0].revents & POLLIN) || cPending) {
+            ssize_t len = Client_read(client->cSock, client->cSsl, buf, BUFSIZ);
+            Flight_add(&client->flight, FLIGHT_READ, FLIGHT_CLIENT, len);
+            if (len < 0 && errno == EAGAIN) { continue; }
+            if (len < 0) { Flight_add(&client->flight, FLIGHT_ERRNO, 0, errno); }
+            if (len == 0) { closedBy = CAPTURE_CLIENT; }
             if (len <= 0) { break; }
+            burst += len;
+            draining |= len == BUFSIZ || Client_pending(client->cSsl);
 
-            ssize_t ret = write(client->rSock, buf, len);
-            if (ret < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    Client_errorReply(client, "Server write timeout");
-                }
-                else {
-                    Client_errnoReply(client, "write", errno);
+#ifdef EBBNC_TLS
+            if (Client_watchCommands(client)) {
+                len = Client_commands(client, buf, len);
+                if (len < 0) { break; }
+                if (len == 0) { continue; }
+            }
+#endif
+
+            // absorbed noops never reach the server, so replay mustn't send them
+            if (client->scanning && Client_absorbNoop(client, buf, len)) {
+                STATS_ADD(client->stats->noopsAbsorbed, 1);
+                Flight_add(&client->flight, FLIGHT_NOOP, 0, 0);
+                if (Client_relayWrite(client, client->cSock, client->cSsl, CLIENT_NOOP_REPLY,
+                                      strlen(CLIENT_NOOP_REPLY)) < 0) {
+                    if (!Client_expired(client)) { Client_errnoReply(client, "write", errno); }
+                    break;
                 }
+                continue;
+            }
+
+            if (client->capture) {
+                Capture_add(client->capture, CAPTURE_DATA, CAPTURE_CLIENT, buf, len);
+            }
+
+            Client_count(client, &client->stats->bytesIn, len);
+            if (client->scanning) { FtpScan_client(&client->scan, buf, len); }
+            if (client->kernelRelay) { client->kernelPassed[0] += len; }
+
+            ssize_t ret = Client_relayWrite(client, client->rSock, client->rSsl, buf, len);
+            if (ret < 0) {
+                if (!Client_expired(client)) { Client_errnoReply(client, "write", errno); }
                 break;
             }
 
@@ -223,74 +1019,204 @@ void Client_relay(Client* client)
                 Client_errorReply(client, "Short write");
                 break;
             }
+            client->forwardedMs = Timer_nowMs();
         }
 
-        if (fds[1].revents & POLLIN) {
-            ssize_t len = read(client->rSock, buf, sizeof(buf));
+        if ((fds[1].revents & POLLIN) || rPending) {
+            ssize_t len = Client_read(client->rSock, client->rSsl, buf, sizeof(buf));
+            Flight_add(&client->flight, FLIGHT_READ, FLIGHT_SERVER, len);
+            if (len < 0 && errno == EAGAIN) { continue; }
             if (len == 0) {
-                Client_errorReply(client, "Connection closed");
+                closedBy = CAPTURE_SERVER;
+                Client_stopKernelRelay(client);
+                // the core bouncer has already told the client
+                if (!Client_expired(client) && client->bouncer->tunnelMode != TUNNEL_EDGE) {
+                    Client_errorReply(client, "Connection closed");
+                }
                 break;
             }
 
             if (len < 0) {
-                Client_errnoReply(client, "read", errno);
+                if (!Client_expired(client)) { Client_errnoReply(client, "read", errno); }
                 break;
             }
+            burst += len;
+            draining |= len == (ssize_t) sizeof(buf) || Client_pending(client->rSsl);
+
+            if (client->capture) {
+                Capture_add(client->capture, CAPTURE_DATA, CAPTURE_SERVER, buf, len);
+            }
+
+            if (!client->setupDone) {
+                Client_disarm(client);
+                Client_phase(client, STATS_PHASE_FIRST_BYTE, client->idntSentUs);
+                Client_phase(client, STATS_PHASE_SETUP, client->acceptUs);
+                Client_slowLog(client, "ok");
+                client->setupDone = true;
+                client->bannerOpen = false;
+            }
 
-            ssize_t ret = write(client->cSock, buf, len);
+            Client_count(client, &client->stats->bytesOut, len);
+            if (client->scanning) { FtpScan_server(&client->scan, buf, len); }
+            if (client->kernelRelay) { client->kernelPassed[1] += len; }
+
+            ssize_t ret = Client_relayWrite(client, client->cSock, client->cSsl, buf, len);
             if (ret < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    Client_errorReply(client, "Client write timeout");
-                }
-                else {
-                    Client_errnoReply(client, "write", errno);
-                }
+                if (!Client_expired(client)) { Client_errnoReply(client, "write", errno); }
+                break;
+            }
+
+            if (!kernelTried) {
+                Client_startKernelRelay(client);
+                kernelTried = true;
             }
         }
     }
+
+    Client_stopKernelRelay(client);
+    // pool threads go on to other sessions
+    if (client->bulk) { Coro_setBulk(false); }
+
+    const char* expired = Client_expired(client);
+    if (expired) { Client_errorReply(client, expired); }
+
+    if (client->capture) {
+        Capture_add(client->capture, CAPTURE_CLOSE, closedBy, NULL, 0);
+        Capture_free(&client->capture);
+    }
+
+    // short sessions only get this one
+    if (client->sampling) {
+        Timer_cancel(&client->relayTimer);
+        Client_sample(client);
+    }
+
+    Stats_talker(&client->cAddr, client->unreported);
 }
 
 bool Client_welcome(Client* client)
 {
-    if (!client->config->welcomeMsg) { return true; }
-
-    char* buf = strPrintf("220-%s\r\n", client->config->welcomeMsg);
-    if (!buf) {
-        perror("strPrintf");
-        return false;
+    const char* msg = client->config->welcomeMsg;
+    if (!msg) {
+        if (!client->config->earlyWelcome) { return true; }
+        msg = CLIENT_EARLY_WELCOME;
     }
 
-    ssize_t len = strlen(buf);
-    ssize_t ret = write(client->cSock, buf, len);
-    free(buf);
+    int len = snprintf(client->line, sizeof(client->line), "220-%s\r\n", msg);
+    if (len >= (int) sizeof(client->line)) { return false; }
+
+    long start = monotonicUs();
+    bool okay = Coro_write(client->cSock, client->line, len) == len;
+    client->bannerOpen = okay;
+    Client_phase(client, STATS_PHASE_WELCOME, start);
+    return okay;
+}
+
+static void Client_list(Client* client)
+{
+    pthread_mutex_lock(&liveMutex);
+    client->prevLive = NULL;
+    client->nextLive = liveClients;
+    if (liveClients) { liveClients->prevLive = client; }
+    liveClients = client;
+    pthread_mutex_unlock(&liveMutex);
+}
 
-    return ret == len;
+static void Client_unlist(Client* client)
+{
+    pthread_mutex_lock(&liveMutex);
+    if (client->prevLive) { client->prevLive->nextLive = client->nextLive; }
+    else { liveClients = client->nextLive; }
+    if (client->nextLive) { client->nextLive->prevLive = client->prevLive; }
+    pthread_mutex_unlock(&liveMutex);
 }
 
 void* Client_threadMain(void* clientv)
 {
     Client* client = clientv;
+    client->upstream = Route_select(client->bouncer, &client->cAddr);
 
-    if (client->config->writeTimeout > 0) {
-      setWriteTimeout(client->cSock, client->config->writeTimeout);
-    }
+    client->stats = Stats_bouncer(client->bouncer);
+    client->worker = Stats_worker(Timer_wheelIndex(&client->deadline));
+    STATS_ADD(client->stats->sessions, 1);
+    STATS_ADD(client->stats->sessionsTotal, 1);
+    STATS_ADD(client->worker->sessions, 1);
+    STATS_ADD(statsProcess->sessions, 1);
+    __atomic_add_fetch(&liveSessions, 1, __ATOMIC_RELAXED);
+    Client_list(client);
+    Client_phase(client, STATS_PHASE_START, client->acceptUs);
 
-    if (Client_connect(client) &&
-        Client_sendIdnt(client) &&
-        Client_welcome(client)) {
+    if (client->config->earlyWelcome) {
+        // the upstream's 220 completes our multiline 220- reply
+        if (Client_welcome(client) &&
+            Client_connect(client) &&
+            Client_sendIdnt(client)) {
+
+            Client_relay(client);
+        }
+    }
+    else if (Client_connect(client) &&
+             Client_sendIdnt(client) &&
+             Client_welcome(client)) {
 
         Client_relay(client);
     }
 
+    if (!client->setupDone) { Client_slowLog(client, "failed"); }
+
+    STATS_SUB(client->stats->sessions, 1);
+    STATS_SUB(client->worker->sessions, 1);
+    STATS_SUB(statsProcess->sessions, 1);
+    __atomic_sub_fetch(&liveSessions, 1, __ATOMIC_RELAXED);
+    Client_unlist(client);
+
     Client_free(&client);
     return NULL;
 }
 
+static long Client_publishPool(Timer* timer)
+{
+    Stats_pool(Pool_threads(clientPool), Pool_idle(clientPool), Pool_saturated(clientPool));
+    return CLIENT_POOL_PUBLISH_MS;
+
+    (void) timer;
+}
+
+// sessions running in this process
+unsigned int Client_sessions()
+{
+    return __atomic_load_n(&liveSessions, __ATOMIC_RELAXED);
+}
+
+bool Client_startPool(Config* config)
+{
+    if (config->poolMax == 0) { return true; }
+
+    // openssl wants more stack than a plain relay, and any thread may
+    // end up running a tls session
+    size_t stackSize = CLIENT_STACKSIZE;
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        if (bouncer->tlsMode != TLS_NONE) { stackSize = CLIENT_TLS_STACKSIZE; }
+    }
+
+    clientPool = Pool_new(config->poolMin, config->poolMax, config->poolIdle * 1000L, stackSize);
+    if (!clientPool) {
+        perror("Pool_new");
+        return false;
+    }
+
+    Timer_init(&poolTimer, Client_publishPool);
+    Timer_arm(&poolTimer, CLIENT_POOL_PUBLISH_MS);
+    return true;
+}
+
 void Client_launch(Server* server, int sock, const struct sockaddr_any* addr)
 {
     Client* client = Client_new();
     if (!client) {
         perror("Client_new");
+        close(sock);
         return;
     }
 
@@ -298,11 +1224,147 @@ void Client_launch(Server* server, int sock, const struct sockaddr_any* addr)
     client->bouncer = server->bouncer;
     client->cSock = sock;
     client->server = server;
+    client->acceptUs = monotonicUs();
     memcpy(&client->cAddr, addr, sizeof(client->cAddr));
 
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setstacksize(&attr, CLIENT_STACKSIZE);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_create(&client->threadId, &attr, Client_threadMain, client);
+    // tls and tunnel sessions block in openssl and on the link, they keep
+    // their threads
+    bool okay;
+    if (Coro_started() && server->bouncer->tlsMode == TLS_NONE &&
+        server->bouncer->tunnelMode == TUNNEL_NONE) {
+        okay = Coro_spawn(Client_threadMain, client);
+    }
+    else if (clientPool) {
+        okay = Pool_submit(clientPool, Client_threadMain, client);
+    }
+    else {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, server->bouncer->tlsMode != TLS_NONE ?
+                                  CLIENT_TLS_STACKSIZE : CLIENT_STACKSIZE);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int ret = pthread_create(&client->threadId, &attr, Client_threadMain, client);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) { errno = ret; }
+        okay = ret == 0;
+    }
+
+    if (!okay) {
+        perror("Client_launch");
+        Client_free(&client);
+    }
+}
+
+// appends the flight recorders of the live sessions, or with dumpstuck
+// of those that have done nothing for that long, to dumpfile
+// what a dump needs of a session, copied under the list lock so the
+// formatting and the file write happen without it
+typedef struct {
+    struct sockaddr_any cAddr;
+    Bouncer*            bouncer;
+    Upstream*           upstream;
+    long                acceptUs;
+    const char*         expired;
+    Flight              flight;
+} ClientDump;
+
+#define CLIENT_DUMP_SLACK   64      // sessions that may start while allocating
+
+static unsigned int Client_snapshot(Config* config, ClientDump* dumps, unsigned int size,
+                                    long nowUs, unsigned int* skipped)
+{
+    unsigned int count = 0;
+    *skipped = 0;
+    pthread_mutex_lock(&liveMutex);
+
+    Client* client;
+    for (client = liveClients; client; client = client->nextLive) {
+        long lastUs = Flight_lastUs(&client->flight);
+        if (config->dumpStuck > 0 && nowUs - lastUs < config->dumpStuck * 1000000L) {
+            continue;
+        }
+
+        if (count == size) {
+            ++*skipped;
+            continue;
+        }
+
+        ClientDump* dump = &dumps[count++];
+        dump->cAddr = client->cAddr;
+        dump->bouncer = client->bouncer;
+        dump->upstream = client->upstream;
+        dump->acceptUs = client->acceptUs;
+        dump->expired = Client_expired(client);
+        memcpy(&dump->flight, &client->flight, sizeof(dump->flight));
+    }
+
+    pthread_mutex_unlock(&liveMutex);
+    return count;
+}
+
+// the whole dump goes out in one append, so with prefork each worker's
+// dump stays in one piece in the shared file
+void Client_dump(Config* config)
+{
+    if (!config->dumpFile) {
+        fprintf(stderr, "No dumpfile set, not dumping sessions.\n");
+        return;
+    }
+
+    unsigned int size = Client_sessions() + CLIENT_DUMP_SLACK;
+    ClientDump* dumps = malloc(size * sizeof(ClientDump));
+    if (!dumps) {
+        perror("malloc");
+        return;
+    }
+
+    long nowUs = monotonicUs();
+    unsigned int skipped;
+    unsigned int count = Client_snapshot(config, dumps, size, nowUs, &skipped);
+
+    char* text = NULL;
+    size_t len = 0;
+    FILE* fp = open_memstream(&text, &len);
+    if (!fp) {
+        perror("open_memstream");
+        free(dumps);
+        return;
+    }
+
+    time_t now = time(NULL);
+    struct tm tm;
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+    fprintf(fp, "%s PID #%i, %u sessions\n", timestamp, (int) getpid(), Client_sessions());
+
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        ClientDump* dump = &dumps[i];
+        long lastUs = Flight_lastUs(&dump->flight);
+        char ip[INET6_ADDRSTRLEN];
+        if (!ipFromSockaddr(&dump->cAddr, ip)) { strcpy(ip, "?"); }
+
+        fprintf(fp, "session %s:%i on %s:%li -> %s:%li, up %.1fs, idle %.1fs%s%s\n", ip,
+                portFromSockaddr(&dump->cAddr), dump->bouncer->listenIP,
+                dump->bouncer->listenPort, dump->upstream ? dump->upstream->host : "?",
+                dump->upstream ? dump->upstream->port : 0L,
+                (nowUs - dump->acceptUs) / 1000000.0, (nowUs - lastUs) / 1000000.0,
+                dump->expired ? ", " : "", dump->expired ? dump->expired : "");
+        Flight_dump(fp, &dump->flight, nowUs);
+    }
+
+    if (skipped > 0) { fprintf(fp, "%u sessions started during the dump, left out\n", skipped); }
+    fprintf(fp, "%u sessions dumped\n\n", count);
+    fclose(fp);
+    free(dumps);
+
+    int fd = open(config->dumpFile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(config->dumpFile);
+    }
+    else {
+        if (write(fd, text, len) != (ssize_t) len) { perror("write"); }
+        close(fd);
+    }
+    free(text);
 }
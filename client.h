@@ -23,10 +23,28 @@
 #include "config.h"
 #include "server.h"
 #include "misc.h"
+#include "upstream.h"
+#include "tls.h"
+#include "timer.h"
+#include "stats.h"
+#include "ftpscan.h"
+#include "flight.h"
+#include "capture.h"
 
 #define CLIENT_STACKSIZE 65536
+#define CLIENT_TLS_STACKSIZE 262144
+#define CLIENT_LINE_SIZE 1024
+#define CLIENT_COMMAND_SIZE 64
+#define CLIENT_DRAIN_MS 30000
+#define CLIENT_DRAIN_BACKOFF_MS 64      // longest nap while the kernel's backlog drains
+#define CLIENT_POOL_PUBLISH_MS 1000
+#define CLIENT_EARLY_WELCOME "Connecting to server .."
+#define CLIENT_NOOP_REPLY "200 NOOP command successful.\r\n"
+#define CLIENT_BURST_BYTES 262144       // relayed in one wakeup before yielding
+#define CLIENT_BURST_LOOPS 64
+#define CLIENT_BULK_MS 1000             // within budget this long to be control again
 
-typedef struct {
+typedef struct Client {
     pthread_t           threadId;
     int                 cSock;
     struct sockaddr_any cAddr;
@@ -34,9 +52,69 @@ typedef struct {
     struct sockaddr_any rAddr;
     Config*             config;
     Bouncer*            bouncer;
+    Upstream*           upstream;
     Server*             server;
+    struct ssl_st*      cSsl;
+    struct ssl_st*      rSsl;
+
+    // deadlines, see timer.h
+    Timer               deadline;
+    int                 deadlineFd;
+    int                 deadlineHow;
+    const char*         deadlineReason;
+    Timer               relayTimer;
+    long                activeMs;
+    long                writeMs;
+    int                 writeFd;
+    const char*         expired;
+
+    StatsBouncer*       stats;
+    StatsWorker*        worker;
+    uint64_t            unreported;
+    long                acceptUs;
+    long                idntSentUs;
+    long                phaseUs[STATS_PHASES];
+    bool                setupDone;
+    bool                bannerOpen;         // sent a 220- the server hasn't followed
+    bool                scanning;
+    FtpScan             scan;
+    long                forwardedMs;        // last passed on to the server
+    bool                bulk;               // scheduled behind control sessions
+    long                bulkMs;             // last ran out of budget
+
+    // tls sessions have the client's commands looked at a line at a time,
+    // a partial line waits here for the rest
+    char                command[CLIENT_COMMAND_SIZE];
+    size_t              commandLen;
+    bool                commandLong;        // passing on a line too long to hold
+    bool                authHeld;           // AUTH waits on earlier replies
+
+    // a sampled session feeds its upstream's quality from the relay timer
+    bool                sampling;
+    long                sampleMs;
+    UpstreamSample      sample;
+    StatsUpstream*      upstreamStats;
+
+    // what each socket had received and queued when the kernel took
+    // over, what the relay passed on itself since, and what the relay
+    // timer last saw, see sockmap.h
+    bool                kernelRelay;
+    uint64_t            kernelReceived[2];
+    uint64_t            kernelQueued[2];
+    uint64_t            kernelPassed[2];
+    uint64_t            kernelSeen;
+    char                line[CLIENT_LINE_SIZE];
+
+    // live sessions are listed for dumping their flight recorders
+    struct Client*      prevLive;
+    struct Client*      nextLive;
+    Flight              flight;
+    Capture*            capture;
 } Client;
 
+bool Client_startPool(Config* config);
+unsigned int Client_sessions();
 void Client_launch(Server* server, int sock, const struct sockaddr_any* addr);
+void Client_dump(Config* config);
 
 #endif
@@ -26,6 +26,60 @@
 #include "conf.h"
 #include "hex.h"
 #include "xtea.h"
+#include "parallel.h"
+#include "radix.h"
+#include "tunnel.h"
+#include "tls.h"
+#include "resolve.h"
+#include "upstream.h"
+#include "pool.h"
+#include "stats.h"
+
+void AclEntry_freeList(AclEntry** entryp)
+{
+    while (*entryp) {
+        AclEntry* next = (*entryp)->next;
+        free((*entryp)->cidr);
+        free(*entryp);
+        *entryp = next;
+    }
+}
+
+// parses a comma separated list of cidr masks onto the list
+bool AclEntry_parseList(AclEntry** entryp, const char* value, bool allow)
+{
+    while (*value) {
+        const char* end = strchr(value, ',');
+        size_t len = end ? (size_t)(end - value) : strlen(value);
+
+        AclEntry* entry = calloc(1, sizeof(AclEntry));
+        if (!entry) { return false; }
+
+        entry->cidr = strndup(value, len);
+        if (!entry->cidr) {
+            free(entry);
+            return false;
+        }
+
+        unsigned char key[RADIX_KEY_SIZE];
+        unsigned int bits;
+        if (!radixKeyFromCIDR(entry->cidr, key, &bits)) {
+            free(entry->cidr);
+            free(entry);
+            errno = 0;
+            return false;
+        }
+
+        entry->allow = allow;
+        entry->next = *entryp;
+        *entryp = entry;
+
+        value += len;
+        if (*value == ',') { value++; }
+    }
+
+    return true;
+}
 
 Bouncer* Bouncer_new()
 {
@@ -34,6 +88,8 @@ Bouncer* Bouncer_new()
 
     bouncer->listenPort = -1;
     bouncer->remotePort = -1;
+    bouncer->tunnelMode = TUNNEL_NONE;
+    bouncer->tunnelLinks = 2;
 
     return bouncer;
 }
@@ -44,6 +100,10 @@ void Bouncer_free(Bouncer** bouncerp)
         Bouncer* bouncer = *bouncerp;
         free(bouncer->listenIP);
         free(bouncer->remoteHost);
+        free(bouncer->localIP);
+        free(bouncer->routeFile);
+        free(bouncer->tunnelKey);
+        AclEntry_freeList(&bouncer->acl);
         free(bouncer);
         *bouncerp = NULL;
     }
@@ -63,6 +123,166 @@ void Bouncer_freeList(Bouncer** bouncerp)
     }
 }
 
+Bouncer* Bouncer_find(Config* config, const char* listenIP, long listenPort)
+{
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        if (bouncer->listenPort == listenPort &&
+            !strcasecmp(bouncer->listenIP, listenIP)) {
+            return bouncer;
+        }
+    }
+    return NULL;
+}
+
+// options given as key=value after the bouncer addresses
+bool Bouncer_parseOption(Bouncer* bouncer, const char* key, const char* value)
+{
+    if (!strcasecmp(key, "allow")) {
+        return AclEntry_parseList(&bouncer->acl, value, true);
+    }
+
+    if (!strcasecmp(key, "deny")) {
+        return AclEntry_parseList(&bouncer->acl, value, false);
+    }
+
+    if (!strcasecmp(key, "routes") && *value && !bouncer->routeFile) {
+        bouncer->routeFile = strdup(value);
+        return bouncer->routeFile != NULL;
+    }
+
+    if (!strcasecmp(key, "alternate") && !bouncer->alternate) {
+        errno = 0;
+        bouncer->alternate = Upstream_parse(value);
+        return bouncer->alternate != NULL;
+    }
+
+    if (!strcasecmp(key, "minquality")) {
+        if (strToInt(value, &bouncer->minQuality) &&
+            bouncer->minQuality >= 0 && bouncer->minQuality <= UPSTREAM_MAX_SCORE) {
+            return true;
+        }
+    }
+
+    if (!strcasecmp(key, "tunnel")) {
+        if (!strcasecmp(value, "edge")) {
+            bouncer->tunnelMode = TUNNEL_EDGE;
+            return true;
+        }
+        if (!strcasecmp(value, "core")) {
+            bouncer->tunnelMode = TUNNEL_CORE;
+            return true;
+        }
+    }
+
+    if (!strcasecmp(key, "tunnellinks")) {
+        if (strToInt(value, &bouncer->tunnelLinks) &&
+            bouncer->tunnelLinks > 0 && bouncer->tunnelLinks <= TUNNEL_MAX_LINKS) {
+            return true;
+        }
+    }
+
+    if (!strcasecmp(key, "tunnelkey") && *value && !bouncer->tunnelKey) {
+        bouncer->tunnelKey = strdup(value);
+        return bouncer->tunnelKey != NULL;
+    }
+
+    if (!strcasecmp(key, "relay")) {
+        if (!strcasecmp(value, "kernel")) {
+            bouncer->kernelRelay = true;
+            return true;
+        }
+        if (!strcasecmp(value, "user")) {
+            bouncer->kernelRelay = false;
+            return true;
+        }
+    }
+
+    if (!strcasecmp(key, "noop")) {
+        if (strToInt(value, &bouncer->noopInterval) && bouncer->noopInterval >= 0) {
+            return true;
+        }
+    }
+
+    if (!strcasecmp(key, "transparent")) {
+        if (!strcasecmp(value, "true")) {
+            bouncer->transparent = true;
+            return true;
+        }
+        if (!strcasecmp(value, "false")) {
+            bouncer->transparent = false;
+            return true;
+        }
+    }
+
+#ifdef EBBNC_TLS
+    if (!strcasecmp(key, "tls")) {
+        if (!strcasecmp(value, "terminate")) {
+            bouncer->tlsMode = TLS_TERMINATE;
+            return true;
+        }
+        if (!strcasecmp(value, "reoriginate")) {
+            bouncer->tlsMode = TLS_REORIGINATE;
+            return true;
+        }
+    }
+#endif
+
+    errno = 0;
+    return false;
+}
+
+char* Bouncer_saveOptions(char* buffer, Bouncer* bouncer)
+{
+    AclEntry* entry;
+    for (entry = bouncer->acl; entry && buffer; entry = entry->next) {
+        buffer = strCatPrintf(buffer, " %s=%s", entry->allow ? "allow" : "deny",
+                              entry->cidr);
+    }
+
+    if (buffer && bouncer->routeFile) {
+        buffer = strCatPrintf(buffer, " routes=%s", bouncer->routeFile);
+    }
+
+    if (buffer && bouncer->alternate) {
+        buffer = strCatPrintf(buffer, " alternate=%s:%li", bouncer->alternate->host,
+                              bouncer->alternate->port);
+    }
+
+    if (buffer && bouncer->minQuality > 0) {
+        buffer = strCatPrintf(buffer, " minquality=%i", bouncer->minQuality);
+    }
+
+    if (buffer && bouncer->tunnelMode != TUNNEL_NONE) {
+        buffer = strCatPrintf(buffer, " tunnel=%s tunnellinks=%i",
+                              bouncer->tunnelMode == TUNNEL_EDGE ? "edge" : "core",
+                              bouncer->tunnelLinks);
+    }
+
+    if (buffer && bouncer->tunnelKey) {
+        buffer = strCatPrintf(buffer, " tunnelkey=%s", bouncer->tunnelKey);
+    }
+
+    if (buffer && bouncer->kernelRelay) {
+        buffer = strCatPrintf(buffer, " relay=kernel");
+    }
+
+    if (buffer && bouncer->noopInterval > 0) {
+        buffer = strCatPrintf(buffer, " noop=%i", bouncer->noopInterval);
+    }
+
+    if (buffer && bouncer->transparent) {
+        buffer = strCatPrintf(buffer, " transparent=true");
+    }
+
+    if (buffer && bouncer->tlsMode != TLS_NONE) {
+        buffer = strCatPrintf(buffer, " tls=%s",
+                              bouncer->tlsMode == TLS_TERMINATE ? "terminate" : "reoriginate");
+    }
+
+    return buffer;
+}
+
 Bouncer* Bouncer_parse(const char* s)
 {
     Bouncer* bouncer = Bouncer_new();
@@ -93,14 +313,27 @@ Bouncer* Bouncer_parse(const char* s)
     if (sscanf(p, "%li", &bouncer->remotePort) != 1) { goto parseerror; }
 
     p = strtok(NULL, " ");
-    if (p && *p != '\0') {
-        bouncer->localIP = strdup(p);
-        if (!bouncer->localIP) { goto strduperror; }
+    while (p) {
+        char* eq = strchr(p, '=');
+        if (eq) {
+            *eq = '\0';
+            if (!Bouncer_parseOption(bouncer, p, eq + 1)) {
+                if (errno == ENOMEM) { goto strduperror; }
+                goto parseerror;
+            }
+        }
+        else if (!bouncer->localIP) {
+            bouncer->localIP = strdup(p);
+            if (!bouncer->localIP) { goto strduperror; }
+        }
+        else {
+            goto parseerror;
+        }
 
         p = strtok(NULL, " ");
-        if (p && p != '\0') { goto parseerror; }
     }
-    else {
+
+    if (!bouncer->localIP) {
         bouncer->localIP = strdup(bouncer->listenIP);
         if (!bouncer->localIP) { goto strduperror; }
     }
@@ -128,9 +361,20 @@ Config* Config_new()
 
     config->idnt = true;
     config->identTimeout = 10;
+    config->identCache = 60;
+    config->identSkip = 600;
     config->idleTimeout = 0;
     config->writeTimeout = 30;
+    config->connectTimeout = 30;
+    config->firstByteTimeout = 30;
+    config->tlsTimeout = 30;
     config->dnsLookup = true;
+    config->resolveTimeout = 30;
+    config->slowThreshold = 1000;
+    config->poolMin = 16;
+    config->poolMax = 1024;
+    config->poolIdle = 60;
+    config->qualitySample = 16;
 
     return config;
 }
@@ -139,6 +383,16 @@ void Config_free(Config** configp)
 {
     if (*configp) {
         Config* config = *configp;
+        Bouncer_freeList(&config->bouncers);
+        AclEntry_freeList(&config->acl);
+        free(config->aclFile);
+        free(config->tlsCert);
+        free(config->tlsKey);
+        free(config->statsName);
+        free(config->slowLog);
+        free(config->dumpFile);
+        free(config->capture);
+        free(config->resolvConf);
         free(config->pidFile);
         free(config->welcomeMsg);
         free(config);
@@ -156,6 +410,113 @@ void requiredOptionError(const char* option)
     fprintf(stderr, "Config option is required: %s\n", option);
 }
 
+typedef struct {
+    char*   host;
+    bool    valid;
+} HostCheck;
+
+void HostCheck_run(void* checkv)
+{
+    HostCheck* check = checkv;
+    struct sockaddr_any addr;
+    check->valid = Resolve_address(check->host, 0, &addr, NULL);
+}
+
+void HostCheck_free(void* checkv)
+{
+    HostCheck* check = checkv;
+    free(check->host);
+    free(check);
+}
+
+// resolves every distinct remote host concurrently, so startup time is
+// bounded by the slowest lookup rather than the sum of them all
+bool Config_resolveHosts(Config* config)
+{
+    long start = monotonicMs();
+    if (!Resolve_init(config->resolvConf)) { return false; }
+
+    size_t count = 0;
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        count++;
+    }
+
+    HostCheck** checks = calloc(count, sizeof(HostCheck*));
+    bool* done = calloc(count, sizeof(bool));
+    if (!checks || !done) {
+        fprintf(stderr, "Unable to load config: %s\n", strerror(errno));
+        free(checks);
+        free(done);
+        return false;
+    }
+
+    size_t unique = 0;
+    bool okay = true;
+    for (bouncer = config->bouncers; bouncer && okay; bouncer = bouncer->next) {
+        size_t i;
+        for (i = 0; i < unique; ++i) {
+            if (!strcasecmp(checks[i]->host, bouncer->remoteHost)) { break; }
+        }
+        if (i < unique) { continue; }
+
+        checks[unique] = calloc(1, sizeof(HostCheck));
+        if (checks[unique]) {
+            checks[unique]->host = strdup(bouncer->remoteHost);
+        }
+
+        if (!checks[unique] || !checks[unique]->host) {
+            if (checks[unique]) { free(checks[unique]); }
+            fprintf(stderr, "Unable to load config: %s\n", strerror(errno));
+            okay = false;
+            break;
+        }
+
+        unique++;
+    }
+
+    if (okay) {
+        bool finished = runParallel((void**) checks, unique, HostCheck_run,
+                                    HostCheck_free, config->resolveTimeout, done);
+        size_t i;
+        for (i = 0; i < unique; ++i) {
+            if (!done[i]) {
+                fprintf(stderr, "Timed out resolving remote hosts.\n");
+                okay = false;
+                break;
+            }
+        }
+
+        if (finished) {
+            for (i = 0; i < unique; ++i) {
+                if (!checks[i]->valid) {
+                    invalidValueError("remotehost");
+                    fprintf(stderr, "Unable to resolve: %s\n", checks[i]->host);
+                    okay = false;
+                }
+            }
+        }
+        else {
+            // checks now belong to the resolver threads
+            unique = 0;
+        }
+
+        if (okay) {
+            printf("Resolved %lu remote hosts in %li ms ..\n",
+                   (unsigned long) unique, monotonicMs() - start);
+        }
+    }
+
+    size_t i;
+    for (i = 0; i < unique; ++i) {
+        HostCheck_free(checks[i]);
+    }
+
+    free(checks);
+    free(done);
+    return okay;
+}
+
 bool Config_sanityCheck(Config* config)
 {
     bool insane = false;
@@ -182,11 +543,6 @@ bool Config_sanityCheck(Config* config)
                 insane = true;
             }
 
-            if (!isValidHost(bouncer->remoteHost)) {
-                invalidValueError("remotehost");
-                insane = true;
-            }
-
             if (!isValidPort(bouncer->remotePort)) {
                 invalidValueError("remoteport");
                 insane = true;
@@ -196,8 +552,19 @@ bool Config_sanityCheck(Config* config)
                 invalidValueError("localip");
                 insane = true;
             }
+
+            // a core takes the client address from whoever opens the link
+            if (bouncer->tunnelMode == TUNNEL_CORE && bouncer->transparent &&
+                !bouncer->tunnelKey) {
+                fprintf(stderr, "Config option transparent needs tunnelkey on a tunnel core.\n");
+                insane = true;
+            }
             bouncer = bouncer->next;
         }
+
+        if (!insane && !Config_resolveHosts(config)) {
+            insane = true;
+        }
     }
 
 
@@ -247,6 +614,68 @@ Config* Config_loadBuffer(const char* buffer)
                 config->bouncers = bouncer;
             }
         }
+        else if (!strncasecmp(line, "allow=", 6) && len > 6) {
+            if (!AclEntry_parseList(&config->acl, line + 6, true)) {
+                if (errno == ENOMEM) { goto strduperror; }
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "deny=", 5) && len > 5) {
+            if (!AclEntry_parseList(&config->acl, line + 5, false)) {
+                if (errno == ENOMEM) { goto strduperror; }
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "aclfile=", 8) && len > 8) {
+            config->aclFile = strdup(line + 8);
+            if (!config->aclFile) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "tlscert=", 8) && len > 8) {
+            config->tlsCert = strdup(line + 8);
+            if (!config->tlsCert) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "tlskey=", 7) && len > 7) {
+            config->tlsKey = strdup(line + 7);
+            if (!config->tlsKey) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "statsname=", 10) && len > 10) {
+            config->statsName = strdup(line + 10);
+            if (!config->statsName) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "slowlog=", 8) && len > 8) {
+            config->slowLog = strdup(line + 8);
+            if (!config->slowLog) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "dumpfile=", 9) && len > 9) {
+            config->dumpFile = strdup(line + 9);
+            if (!config->dumpFile) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "dumpstuck=", 10) && len > 10) {
+            if (strToInt(line + 10, &config->dumpStuck) != 1 || config->dumpStuck < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "capture=", 8) && len > 8) {
+            config->capture = strdup(line + 8);
+            if (!config->capture) { goto strduperror; }
+        }
+        else if (!strncasecmp(line, "capturepayload=", 15)) {
+            char* value = line + 15;
+            if (!strcasecmp(value, "true")) {
+                config->capturePayload = true;
+            }
+            else if (!strcasecmp(value, "false")) {
+                config->capturePayload = false;
+            }
+            else {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "slowthreshold=", 14) && len > 14) {
+            if (strToInt(line + 14, &config->slowThreshold) != 1 || config->slowThreshold < 0) {
+                error = true;
+            }
+        }
         else if (!strncasecmp(line, "idnt=", 5)) {
             char* value = line + 5;
             if (!strcasecmp(value, "true")) {
@@ -264,6 +693,50 @@ Config* Config_loadBuffer(const char* buffer)
                 error = true;
             }
         }
+        else if (!strncasecmp(line, "identcache=", 11) && len > 11) {
+            if (strToInt(line + 11, &config->identCache) != 1 || config->identCache < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "identskip=", 10) && len > 10) {
+            if (strToInt(line + 10, &config->identSkip) != 1 || config->identSkip < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "poolmin=", 8) && len > 8) {
+            if (strToInt(line + 8, &config->poolMin) != 1 || config->poolMin < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "poolmax=", 8) && len > 8) {
+            if (strToInt(line + 8, &config->poolMax) != 1 || config->poolMax < 0 ||
+                config->poolMax > POOL_MAX_THREADS) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "poolidle=", 9) && len > 9) {
+            if (strToInt(line + 9, &config->poolIdle) != 1 || config->poolIdle < 1) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "processes=", 10) && len > 10) {
+            if (strToInt(line + 10, &config->processes) != 1 || config->processes < 0 ||
+                config->processes > STATS_MAX_PROCESSES) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "engine=", 7) && len > 7) {
+            char* value = line + 7;
+            if (!strcasecmp(value, "coro")) {
+                config->coroEngine = true;
+            }
+            else if (!strcasecmp(value, "thread")) {
+                config->coroEngine = false;
+            }
+            else {
+                error = true;
+            }
+        }
         else if (!strncasecmp(line, "idletimeout=", 12) && len > 12) {
             if (strToInt(line + 12, &config->idleTimeout) != 1 || config->idleTimeout < 0) {
                 error = true;
@@ -274,6 +747,30 @@ Config* Config_loadBuffer(const char* buffer)
                 error = true;
             }
         }
+        else if (!strncasecmp(line, "connecttimeout=", 15) && len > 15) {
+            if (strToInt(line + 15, &config->connectTimeout) != 1 || config->connectTimeout < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "firstbytetimeout=", 17) && len > 17) {
+            if (strToInt(line + 17, &config->firstByteTimeout) != 1 || config->firstByteTimeout < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "tlstimeout=", 11) && len > 11) {
+            if (strToInt(line + 11, &config->tlsTimeout) != 1 || config->tlsTimeout < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "resolvetimeout=", 15) && len > 15) {
+            if (strToInt(line + 15, &config->resolveTimeout) != 1 || config->resolveTimeout < 0) {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "resolvconf=", 11) && len > 11) {
+            config->resolvConf = strdup(line + 11);
+            if (!config->resolvConf) { goto strduperror; }
+        }
         else if (!strncasecmp(line, "dnslookup=", 10) && len > 10) {
             char* value = line + 10;
             if (!strcasecmp(value, "true")) {
@@ -286,6 +783,35 @@ Config* Config_loadBuffer(const char* buffer)
                 error = true;
             }
         }
+        else if (!strncasecmp(line, "earlywelcome=", 13) && len > 13) {
+            char* value = line + 13;
+            if (!strcasecmp(value, "true")) {
+                config->earlyWelcome = true;
+            }
+            else if (!strcasecmp(value, "false")) {
+                config->earlyWelcome = false;
+            }
+            else {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "commandstats=", 13) && len > 13) {
+            char* value = line + 13;
+            if (!strcasecmp(value, "true")) {
+                config->commandStats = true;
+            }
+            else if (!strcasecmp(value, "false")) {
+                config->commandStats = false;
+            }
+            else {
+                error = true;
+            }
+        }
+        else if (!strncasecmp(line, "qualitysample=", 14) && len > 14) {
+            if (strToInt(line + 14, &config->qualitySample) != 1 || config->qualitySample < 0) {
+                error = true;
+            }
+        }
         else if (!strncasecmp(line, "pidfile=", 8) && len > 8) {
             config->pidFile = strdup(line + 8);
             if (!config->pidFile) { goto strduperror; }
@@ -433,15 +959,53 @@ char* Config_saveBuffer(Config* config)
     buffer = strCatPrintf(buffer, "identtimeout=%i\n", config->identTimeout);
     if (!buffer) { return NULL; }
 
+    buffer = strCatPrintf(buffer, "identcache=%i\n", config->identCache);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "identskip=%i\n", config->identSkip);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "poolmin=%i\n", config->poolMin);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "poolmax=%i\n", config->poolMax);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "poolidle=%i\n", config->poolIdle);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "processes=%i\n", config->processes);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "engine=%s\n", config->coroEngine ? "coro" : "thread");
+    if (!buffer) { return NULL; }
+
     buffer = strCatPrintf(buffer, "idletimeout=%i\n", config->idleTimeout);
     if (!buffer) { return NULL; }
 
     buffer = strCatPrintf(buffer, "writetimeout=%i\n", config->writeTimeout);
     if (!buffer) { return NULL; }
 
+    buffer = strCatPrintf(buffer, "connecttimeout=%i\n", config->connectTimeout);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "firstbytetimeout=%i\n", config->firstByteTimeout);
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "tlstimeout=%i\n", config->tlsTimeout);
+    if (!buffer) { return NULL; }
+
     buffer = strCatPrintf(buffer, "dnslookup=%s\n", config->dnsLookup ? "true" : "false");
     if (!buffer) { return NULL; }
 
+    buffer = strCatPrintf(buffer, "resolvetimeout=%i\n", config->resolveTimeout);
+    if (!buffer) { return NULL; }
+
+    if (config->resolvConf) {
+        buffer = strCatPrintf(buffer, "resolvconf=%s\n", config->resolvConf);
+        if (!buffer) { return NULL; }
+    }
+
     if (config->pidFile) {
         buffer = strCatPrintf(buffer, "pidfile=%s\n", config->pidFile);
         if (!buffer) { return NULL; }
@@ -452,13 +1016,78 @@ char* Config_saveBuffer(Config* config)
         if (!buffer) { return NULL; }
     }
 
+    buffer = strCatPrintf(buffer, "earlywelcome=%s\n", config->earlyWelcome ? "true" : "false");
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "commandstats=%s\n", config->commandStats ? "true" : "false");
+    if (!buffer) { return NULL; }
+
+    buffer = strCatPrintf(buffer, "qualitysample=%i\n", config->qualitySample);
+    if (!buffer) { return NULL; }
+
+    if (config->aclFile) {
+        buffer = strCatPrintf(buffer, "aclfile=%s\n", config->aclFile);
+        if (!buffer) { return NULL; }
+    }
+
+    if (config->statsName) {
+        buffer = strCatPrintf(buffer, "statsname=%s\n", config->statsName);
+        if (!buffer) { return NULL; }
+    }
+
+    if (config->slowLog) {
+        buffer = strCatPrintf(buffer, "slowlog=%s\nslowthreshold=%i\n",
+                              config->slowLog, config->slowThreshold);
+        if (!buffer) { return NULL; }
+    }
+
+    if (config->dumpFile) {
+        buffer = strCatPrintf(buffer, "dumpfile=%s\ndumpstuck=%i\n",
+                              config->dumpFile, config->dumpStuck);
+        if (!buffer) { return NULL; }
+    }
+
+    if (config->capture) {
+        buffer = strCatPrintf(buffer, "capture=%s\ncapturepayload=%s\n", config->capture,
+                              config->capturePayload ? "true" : "false");
+        if (!buffer) { return NULL; }
+    }
+
+    if (config->tlsCert) {
+        buffer = strCatPrintf(buffer, "tlscert=%s\n", config->tlsCert);
+        if (!buffer) { return NULL; }
+    }
+
+    if (config->tlsKey) {
+        buffer = strCatPrintf(buffer, "tlskey=%s\n", config->tlsKey);
+        if (!buffer) { return NULL; }
+    }
+
+    AclEntry* entry;
+    for (entry = config->acl; entry; entry = entry->next) {
+        buffer = strCatPrintf(buffer, "%s=%s\n", entry->allow ? "allow" : "deny",
+                              entry->cidr);
+        if (!buffer) { return NULL; }
+    }
+
     Bouncer* bouncer = config->bouncers;
     while (bouncer) {
-        buffer = strCatPrintf(buffer, "bouncer=%s:%i %s:%i %s\n",
+        buffer = strCatPrintf(buffer, "bouncer=%s:%li %s:%li",
                               bouncer->listenIP, bouncer->listenPort,
-                              bouncer->remoteHost, bouncer->remotePort,
-                              bouncer->localIP);
+                              bouncer->remoteHost, bouncer->remotePort);
+        if (!buffer) { return NULL; }
+
+        if (bouncer->localIP) {
+            buffer = strCatPrintf(buffer, " %s", bouncer->localIP);
+            if (!buffer) { return NULL; }
+        }
+
+        buffer = Bouncer_saveOptions(buffer, bouncer);
+        if (!buffer) { return NULL; }
+
+        buffer = strCatPrintf(buffer, "\n");
         if (!buffer) { return NULL; }
+
         bouncer = bouncer->next;
     }
 
@@ -20,30 +20,83 @@
 
 #include <stdbool.h>
 
+typedef struct AclEntry {
+    char*               cidr;
+    bool                allow;
+    struct AclEntry*    next;
+} AclEntry;
+
 typedef struct Bouncer {
     char*           listenIP;
     long            listenPort;
     char*           remoteHost;
     long            remotePort;
     char*           localIP;
-    struct Bouncer* next;
+    AclEntry*       acl;
+    char*           routeFile;
+    int             tunnelMode;
+    int             tunnelLinks;
+    char*           tunnelKey;
+    int             tlsMode;
+    bool            kernelRelay;
+    bool            transparent;
+    int             noopInterval;
+    int             minQuality;
+    int             statsIndex;
+
+    struct RouteTable*  routes;
+    struct Tunnel*      tunnel;
+    struct Upstream*    upstream;
+    struct Upstream*    alternate;
+    struct Bouncer*     next;
 } Bouncer;
 
 typedef struct {
     Bouncer*    bouncers;
+    AclEntry*   acl;
+    char*       aclFile;
     bool        idnt;
     int         identTimeout;
+    int         identCache;
+    int         identSkip;
     int         idleTimeout;
     int         writeTimeout;
+    int         connectTimeout;
+    int         firstByteTimeout;
+    int         tlsTimeout;
     bool        dnsLookup;
+    int         resolveTimeout;
+    char*       resolvConf;
     char*       pidFile;
     char*       welcomeMsg;
+    bool        earlyWelcome;
+    bool        commandStats;
+    int         qualitySample;
+    char*       tlsCert;
+    char*       tlsKey;
+    char*       statsName;
+    char*       slowLog;
+    int         slowThreshold;
+    char*       dumpFile;
+    int         dumpStuck;
+    char*       capture;
+    bool        capturePayload;
+    int         poolMin;
+    int         poolMax;
+    int         poolIdle;
+    bool        coroEngine;
+    int         processes;
 } Config;
 
+void AclEntry_freeList(AclEntry** entryp);
+bool AclEntry_parseList(AclEntry** entryp, const char* value, bool allow);
+
 Bouncer* Bouncer_new();
 void Bouncer_free(Bouncer** bouncerp);
 void Bouncer_freeList(Bouncer** bouncerp);
 
+Bouncer* Bouncer_find(Config* config, const char* listenIP, long listenPort);
+
 Config* Config_new();
 Config* Config_loadBuffer(const char* buffer);
 Config* Config_loadFile(const char* path);
@@ -0,0 +1,476 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "coro.h"
+#include "misc.h"
+
+static CoroEngine engines[CORO_MAX_ENGINES];
+static unsigned int engineCount = 0;
+static unsigned int nextEngine = 0;
+static __thread CoroEngine* engine = NULL;
+
+static pthread_mutex_t stackMutex = PTHREAD_MUTEX_INITIALIZER;
+static void* stackCache[CORO_STACK_CACHE];
+static unsigned int stackCount = 0;
+
+static size_t Coro_pageSize()
+{
+    static size_t pageSize = 0;
+    if (pageSize == 0) { pageSize = sysconf(_SC_PAGESIZE); }
+    return pageSize;
+}
+
+// the lowest page is left unmapped so an overflow faults
+static void* Coro_allocStack()
+{
+    pthread_mutex_lock(&stackMutex);
+    void* stack = stackCount > 0 ? stackCache[--stackCount] : NULL;
+    pthread_mutex_unlock(&stackMutex);
+    if (stack) { return stack; }
+
+    size_t size = CORO_STACK_SIZE + Coro_pageSize();
+    stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+                 -1, 0);
+    if (stack == MAP_FAILED) { return NULL; }
+
+    if (mprotect(stack, Coro_pageSize(), PROT_NONE) < 0) {
+        munmap(stack, size);
+        return NULL;
+    }
+
+    return stack;
+}
+
+static void Coro_freeStack(void* stack)
+{
+    pthread_mutex_lock(&stackMutex);
+    bool cached = stackCount < CORO_STACK_CACHE;
+    if (cached) { stackCache[stackCount++] = stack; }
+    pthread_mutex_unlock(&stackMutex);
+
+    if (!cached) { munmap(stack, CORO_STACK_SIZE + Coro_pageSize()); }
+}
+
+static void* Coro_stack(Coro* coro)
+{
+    return (char*) coro + sizeof(Coro) - CORO_STACK_SIZE - Coro_pageSize();
+}
+
+static void Coro_main()
+{
+    Coro* coro = engine->current;
+    coro->func(coro->arg);
+    coro->done = true;
+    swapcontext(&coro->context, &engine->context);
+}
+
+static void Coro_push(Coro** head, Coro** tail, Coro* coro)
+{
+    coro->next = NULL;
+    if (*tail) { (*tail)->next = coro; }
+    else { *head = coro; }
+    *tail = coro;
+}
+
+static Coro* Coro_pop(Coro** head, Coro** tail)
+{
+    Coro* coro = *head;
+    *head = coro->next;
+    if (!*head) { *tail = NULL; }
+    return coro;
+}
+
+// bulk coroutines take their turns with the ones out of budget
+static void Coro_run(Coro* coro)
+{
+    if (coro->bulk) { Coro_push(&engine->yieldHead, &engine->yieldTail, coro); }
+    else { Coro_push(&engine->runHead, &engine->runTail, coro); }
+}
+
+// one pass over the queue as it is now, what gets queued in it waits
+static void Coro_runQueue(Coro** head, Coro** tail)
+{
+    Coro* last = *tail;
+    while (*head) {
+        Coro* coro = Coro_pop(head, tail);
+
+        engine->current = coro;
+        swapcontext(&engine->context, &coro->context);
+        engine->current = NULL;
+
+        if (coro->done) { Coro_freeStack(Coro_stack(coro)); }
+        if (coro == last) { break; }
+    }
+}
+
+static void Coro_wake(Coro* coro, bool timedOut)
+{
+    if (!coro->waiting) { return; }
+    coro->waiting = false;
+    coro->timedOut = timedOut;
+
+    if (coro->sleeping) {
+        Coro** p = &engine->sleepers;
+        while (*p != coro) { p = &(*p)->nextSleeper; }
+        *p = coro->nextSleeper;
+        coro->sleeping = false;
+    }
+
+    Coro_run(coro);
+}
+
+// -1 to wait for ever, the earliest sleeper otherwise
+static int Coro_nextTimeout()
+{
+    if (engine->runHead || engine->yieldHead) { return 0; }
+    if (!engine->sleepers) { return -1; }
+
+    long now = monotonicMs();
+    long next = LONG_MAX;
+    Coro* coro;
+    for (coro = engine->sleepers; coro; coro = coro->nextSleeper) {
+        if (coro->wakeMs < next) { next = coro->wakeMs; }
+    }
+    return next > now ? next - now : 0;
+}
+
+static void Coro_expire()
+{
+    long now = monotonicMs();
+    Coro* coro = engine->sleepers;
+    while (coro) {
+        Coro* next = coro->nextSleeper;
+        if (coro->wakeMs <= now) { Coro_wake(coro, true); }
+        coro = next;
+    }
+}
+
+static void Coro_takeInbox()
+{
+    uint64_t count;
+    IGNORE_RESULT(read(engine->eventFd, &count, sizeof(count)));
+
+    pthread_mutex_lock(&engine->mutex);
+    Coro* coro = engine->inbox;
+    engine->inbox = NULL;
+    pthread_mutex_unlock(&engine->mutex);
+
+    // pushed newest first, run in the order they came
+    Coro* reversed = NULL;
+    while (coro) {
+        Coro* next = coro->next;
+        coro->next = reversed;
+        reversed = coro;
+        coro = next;
+    }
+
+    while (reversed) {
+        Coro* next = reversed->next;
+        Coro_run(reversed);
+        reversed = next;
+    }
+}
+
+static void* Coro_engineMain(void* enginev)
+{
+    engine = enginev;
+    struct epoll_event events[CORO_EVENTS];
+
+    while (true) {
+        Coro_runQueue(&engine->runHead, &engine->runTail);
+        Coro_runQueue(&engine->yieldHead, &engine->yieldTail);
+
+        int n = epoll_wait(engine->epollFd, events, CORO_EVENTS, Coro_nextTimeout());
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            usleep(10000); // prevent busy looping
+        }
+
+        int i;
+        for (i = 0; i < n; ++i) {
+            if (events[i].data.ptr) { Coro_wake(events[i].data.ptr, false); }
+            else { Coro_takeInbox(); }
+        }
+
+        Coro_expire();
+    }
+
+    return NULL;
+}
+
+bool Coro_startAll()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int count = cpus < 1 ? 1 : cpus > CORO_MAX_ENGINES ? CORO_MAX_ENGINES : cpus;
+
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        CoroEngine* e = &engines[i];
+        memset(e, 0, sizeof(*e));
+        pthread_mutex_init(&e->mutex, NULL);
+
+        e->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (e->epollFd < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+
+        e->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (e->eventFd < 0) {
+            perror("eventfd");
+            return false;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(e->epollFd, EPOLL_CTL_ADD, e->eventFd, &event) < 0) {
+            perror("epoll_ctl");
+            return false;
+        }
+
+        pthread_t thread;
+        int ret = pthread_create(&thread, NULL, Coro_engineMain, e);
+        if (ret != 0) {
+            errno = ret;
+            perror("pthread_create");
+            return false;
+        }
+        pthread_detach(thread);
+        engineCount++;
+    }
+
+    return true;
+}
+
+bool Coro_started()
+{
+    return engineCount > 0;
+}
+
+// getcontext returns only once here, but it is kept apart so nothing
+// else looks clobbered to the compiler
+static __attribute__((noinline)) void Coro_prepare(Coro* coro, void* stack)
+{
+    getcontext(&coro->context);
+    coro->context.uc_stack.ss_sp = (char*) stack + Coro_pageSize();
+    coro->context.uc_stack.ss_size = ((char*) coro - (char*) stack - Coro_pageSize()) & ~15UL;
+    coro->context.uc_link = NULL;
+    makecontext(&coro->context, Coro_main, 0);
+}
+
+bool Coro_spawn(CoroFunc func, void* arg)
+{
+    void* stack = Coro_allocStack();
+    if (!stack) { return false; }
+
+    Coro* coro = (Coro*) ((char*) stack + Coro_pageSize() + CORO_STACK_SIZE - sizeof(Coro));
+    memset(coro, 0, sizeof(*coro));
+    coro->func = func;
+    coro->arg = arg;
+
+    Coro_prepare(coro, stack);
+
+    CoroEngine* e = &engines[__atomic_fetch_add(&nextEngine, 1, __ATOMIC_RELAXED) % engineCount];
+
+    pthread_mutex_lock(&e->mutex);
+    coro->next = e->inbox;
+    e->inbox = coro;
+    pthread_mutex_unlock(&e->mutex);
+
+    uint64_t one = 1;
+    IGNORE_RESULT(write(e->eventFd, &one, sizeof(one)));
+    return true;
+}
+
+bool Coro_active()
+{
+    return engine && engine->current;
+}
+
+// parks the coroutine until one of the fds may be ready or timeoutMs
+// passes, 0 if it timed out. an fd stays registered after the wait, so
+// wakeups can be stale and callers recheck.
+static int Coro_wait(struct pollfd* fds, nfds_t nfds, long timeoutMs)
+{
+    Coro* coro = engine->current;
+
+    nfds_t i;
+    for (i = 0; i < nfds; ++i) {
+        if (fds[i].fd < 0) { continue; }
+
+        struct epoll_event event;
+        event.events = EPOLLONESHOT | EPOLLRDHUP | (fds[i].events & POLLIN ? EPOLLIN : 0) |
+                       (fds[i].events & POLLOUT ? EPOLLOUT : 0);
+        event.data.ptr = coro;
+        if (epoll_ctl(engine->epollFd, EPOLL_CTL_MOD, fds[i].fd, &event) < 0 &&
+            (errno != ENOENT ||
+             epoll_ctl(engine->epollFd, EPOLL_CTL_ADD, fds[i].fd, &event) < 0)) {
+            return -1;
+        }
+    }
+
+    if (timeoutMs >= 0) {
+        coro->wakeMs = monotonicMs() + timeoutMs;
+        coro->nextSleeper = engine->sleepers;
+        engine->sleepers = coro;
+        coro->sleeping = true;
+    }
+
+    coro->spent = 0;
+    coro->waiting = true;
+    coro->timedOut = false;
+    swapcontext(&coro->context, &engine->context);
+    return coro->timedOut ? 0 : 1;
+}
+
+// to the back of the yield queue, what was overspent comes off the next turn
+void Coro_yield()
+{
+    if (!Coro_active()) {
+        sched_yield();
+        return;
+    }
+
+    Coro* coro = engine->current;
+    coro->spent = coro->spent > CORO_BUDGET ? coro->spent - CORO_BUDGET : 0;
+    Coro_push(&engine->yieldHead, &engine->yieldTail, coro);
+    swapcontext(&coro->context, &engine->context);
+}
+
+// a bulk coroutine is woken into the yield queue behind control ones, a
+// bulk thread is left to the kernel as batch work, which doesn't preempt
+void Coro_setBulk(bool bulk)
+{
+    if (Coro_active()) {
+        engine->current->bulk = bulk;
+        return;
+    }
+
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), bulk ? SCHED_BATCH : SCHED_OTHER, &param);
+}
+
+// calls that never have to wait still give the others a turn
+static void Coro_charge(size_t bytes)
+{
+    Coro* coro = engine->current;
+    coro->spent += bytes + CORO_CALL_COST;
+    if (coro->spent >= CORO_BUDGET) { Coro_yield(); }
+}
+
+int Coro_poll(struct pollfd* fds, nfds_t nfds, int timeoutMs)
+{
+    if (!Coro_active()) { return poll(fds, nfds, timeoutMs); }
+
+    long deadlineMs = monotonicMs() + timeoutMs;
+    while (true) {
+        int ret = poll(fds, nfds, 0);
+        if (ret > 0) { Coro_charge(0); }
+        if (ret != 0 || timeoutMs == 0) { return ret; }
+
+        long remainingMs = -1;
+        if (timeoutMs > 0) {
+            remainingMs = deadlineMs - monotonicMs();
+            if (remainingMs <= 0) { return 0; }
+        }
+
+        if (Coro_wait(fds, nfds, remainingMs) < 0) { return -1; }
+    }
+}
+
+void Coro_sleep(long ms)
+{
+    if (!Coro_active()) {
+        usleep(ms * 1000);
+        return;
+    }
+
+    Coro_wait(NULL, 0, ms);
+}
+
+static bool Coro_again(int fd, short events)
+{
+    if (errno == EINTR) { return true; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) { return false; }
+
+    struct pollfd pfd = { fd, events, 0 };
+    return Coro_wait(&pfd, 1, -1) >= 0;
+}
+
+// sockets only, coroutines don't change the blocking mode of what they read
+ssize_t Coro_read(int fd, void* buf, size_t len)
+{
+    if (!Coro_active()) { return read(fd, buf, len); }
+
+    ssize_t ret;
+    while ((ret = recv(fd, buf, len, MSG_DONTWAIT)) < 0 && Coro_again(fd, POLLIN)) { }
+    if (ret >= 0) { Coro_charge(ret); }
+    return ret;
+}
+
+// writes it all as a blocking write would, unless an error cuts it short
+ssize_t Coro_write(int fd, const void* buf, size_t len)
+{
+    if (!Coro_active()) { return write(fd, buf, len); }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = send(fd, (const char*) buf + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (Coro_again(fd, POLLOUT)) { continue; }
+            return done > 0 ? (ssize_t) done : -1;
+        }
+        done += ret;
+    }
+    Coro_charge(done);
+    return done;
+}
+
+int Coro_connect(int fd, const struct sockaddr* addr, socklen_t len)
+{
+    if (!Coro_active()) { return connect(fd, addr, len); }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, addr, len) == 0) { return 0; }
+    if (errno != EINPROGRESS) { return -1; }
+
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    while (Coro_poll(&pfd, 1, -1) < 0 && errno == EINTR) { }
+
+    int error = 0;
+    socklen_t errorLen = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) < 0) { return -1; }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
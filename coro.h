@@ -0,0 +1,93 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_CORO_H
+#define EBBNC_CORO_H
+
+#include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// sessions as coroutines on a few engine threads, one per cpu, each with
+// its own epoll. the session code stays sequential, its blocking calls go
+// through the wrappers below, which inside a coroutine try the call and
+// on EAGAIN park the coroutine on the fd until epoll says it is ready.
+// outside a coroutine they are the plain system calls. stacks are small,
+// guarded and reused. a coroutine whose fds stay ready spends a budget
+// on each call and, once it is used up, goes to the back of a second run
+// queue. that is deficit round robin with the budget as quantum: what a
+// coroutine overspends comes off its next turn, and coroutines woken by
+// epoll run ahead of the ones that yielded, so a session answering a
+// command never waits behind more than one turn of bulk transfers. a
+// session marked bulk is woken into the second queue as well, so control
+// sessions always run first.
+
+#define CORO_STACK_SIZE     65536
+#define CORO_STACK_CACHE    1024
+#define CORO_MAX_ENGINES    64
+#define CORO_EVENTS         256
+#define CORO_BUDGET         262144      // bytes between yields
+#define CORO_CALL_COST      4096        // what a ready call costs on top
+
+typedef void* (*CoroFunc)(void*);
+
+// lives at the top of its own stack
+typedef struct Coro {
+    struct Coro*        next;           // run queue or inbox
+    struct Coro*        nextSleeper;
+    ucontext_t          context;
+    CoroFunc            func;
+    void*               arg;
+    long                wakeMs;         // timed wait, 0 for none
+    long                spent;          // budget used since it last parked
+    bool                bulk;           // woken behind control coroutines
+    bool                waiting;
+    bool                sleeping;
+    bool                timedOut;
+    bool                done;
+} Coro;
+
+typedef struct CoroEngine {
+    pthread_mutex_t     mutex;          // guards inbox
+    Coro*               inbox;
+    int                 epollFd;
+    int                 eventFd;
+    ucontext_t          context;
+    Coro*               current;
+    Coro*               runHead;
+    Coro*               runTail;
+    Coro*               yieldHead;      // bulk or out of budget, after runHead
+    Coro*               yieldTail;
+    Coro*               sleepers;
+} CoroEngine;
+
+bool Coro_startAll();
+bool Coro_started();
+bool Coro_spawn(CoroFunc func, void* arg);
+bool Coro_active();
+int Coro_poll(struct pollfd* fds, nfds_t nfds, int timeoutMs);
+void Coro_sleep(long ms);
+void Coro_yield();
+void Coro_setBulk(bool bulk);
+ssize_t Coro_read(int fd, void* buf, size_t len);
+ssize_t Coro_write(int fd, const void* buf, size_t len);
+int Coro_connect(int fd, const struct sockaddr* addr, socklen_t len);
+
+#endif
@@ -0,0 +1,91 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <string.h>
+#include <limits.h>
+#include "flight.h"
+#include "stats.h"
+#include "misc.h"
+
+static const char* typeNames[] = {
+    "phase", "poll", "read", "write", "errno", "kernel", "noop"
+};
+
+void Flight_add(Flight* flight, enum FlightType type, unsigned int arg, long value)
+{
+    unsigned int next = flight->next;
+    FlightEvent* event = &flight->events[next % FLIGHT_EVENTS];
+    event->us = monotonicUs();
+    event->value = value > INT32_MAX ? INT32_MAX : value < INT32_MIN ? INT32_MIN : value;
+    event->type = type;
+    event->arg = arg;
+    __atomic_store_n(&flight->next, next + 1, __ATOMIC_RELEASE);
+}
+
+// when the session last did anything, 0 if never
+long Flight_lastUs(const Flight* flight)
+{
+    unsigned int next = __atomic_load_n(&flight->next, __ATOMIC_ACQUIRE);
+    return next == 0 ? 0 : flight->events[(next - 1) % FLIGHT_EVENTS].us;
+}
+
+static const char* Flight_side(unsigned int arg)
+{
+    switch (arg) {
+        case FLIGHT_CLIENT : return "client";
+        case FLIGHT_SERVER : return "server";
+        case FLIGHT_CLIENT | FLIGHT_SERVER : return "both";
+        default : return "none";
+    }
+}
+
+// oldest first, times are ms before nowUs
+void Flight_dump(FILE* fp, const Flight* flight, long nowUs)
+{
+    unsigned int next = __atomic_load_n(&flight->next, __ATOMIC_ACQUIRE);
+    unsigned int i = next > FLIGHT_EVENTS ? next - FLIGHT_EVENTS : 0;
+
+    for (; i < next; ++i) {
+        const FlightEvent* event = &flight->events[i % FLIGHT_EVENTS];
+        fprintf(fp, "  %10.3fms %-6s ", (event->us - nowUs) / 1000.0,
+                event->type < sizeof(typeNames) / sizeof(typeNames[0]) ?
+                typeNames[event->type] : "?");
+
+        switch (event->type) {
+            case FLIGHT_PHASE :
+                fprintf(fp, "%s %.1fms\n", Stats_phaseName(event->arg), event->value / 1000.0);
+                break;
+            case FLIGHT_POLL :
+                fprintf(fp, "%s ret=%i\n", Flight_side(event->arg), event->value);
+                break;
+            case FLIGHT_READ :
+            case FLIGHT_WRITE :
+                fprintf(fp, "%s %i\n", Flight_side(event->arg), event->value);
+                break;
+            case FLIGHT_ERRNO :
+                fprintf(fp, "%s\n", strerror(event->value));
+                break;
+            case FLIGHT_KERNEL :
+                fprintf(fp, "%s\n", event->value ? "started" : "unavailable");
+                break;
+            default :
+                fprintf(fp, "\n");
+                break;
+        }
+    }
+}
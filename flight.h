@@ -0,0 +1,60 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_FLIGHT_H
+#define EBBNC_FLIGHT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// a flight recorder of the last few things a session did, kept in a
+// fixed ring inside the session so recording never allocates. the ring
+// is dumped on demand while its session is still writing to it, so an
+// entry being overwritten at that moment may come out torn.
+
+#define FLIGHT_EVENTS   64
+
+enum FlightType {
+    FLIGHT_PHASE,       // arg is the setup phase, value its time in us
+    FLIGHT_POLL,        // arg has FLIGHT_CLIENT/FLIGHT_SERVER readable, value poll's return
+    FLIGHT_READ,        // arg is the side, value what read returned
+    FLIGHT_WRITE,       // arg is the side, value what write returned
+    FLIGHT_ERRNO,       // value is errno
+    FLIGHT_KERNEL,      // value is whether the kernel took over the relay
+    FLIGHT_NOOP         // a NOOP answered at the bouncer
+};
+
+#define FLIGHT_CLIENT   1
+#define FLIGHT_SERVER   2
+
+typedef struct {
+    long            us;
+    int32_t         value;
+    uint8_t         type;
+    uint8_t         arg;
+} FlightEvent;
+
+typedef struct {
+    FlightEvent     events[FLIGHT_EVENTS];
+    unsigned int    next;
+} Flight;
+
+void Flight_add(Flight* flight, enum FlightType type, unsigned int arg, long value);
+long Flight_lastUs(const Flight* flight);
+void Flight_dump(FILE* fp, const Flight* flight, long nowUs);
+
+#endif
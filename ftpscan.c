@@ -0,0 +1,119 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <string.h>
+#include "ftpscan.h"
+#include "misc.h"
+
+void FtpScan_init(FtpScan* scan, StatsCommands* stats, bool terminated)
+{
+    memset(scan, 0, sizeof(*scan));
+    scan->stats = stats;
+    scan->terminated = terminated;
+}
+
+// hands the head of each line to onLine once it has enough of it
+static void FtpScan_lines(FtpScan* scan, FtpScanLine* line, const char* buf, size_t len,
+                          void (*onLine)(FtpScan* scan, const char* head, unsigned int len))
+{
+    const char* p = buf;
+    const char* end = buf + len;
+
+    while (p < end && !scan->disabled) {
+        if (!line->headDone) {
+            while (p < end && line->headLen < FTPSCAN_HEAD && *p != '\n') {
+                line->head[line->headLen++] = *p++;
+            }
+            if (p == end && line->headLen < FTPSCAN_HEAD) { break; }
+
+            line->headDone = true;
+            onLine(scan, line->head, line->headLen);
+        }
+
+        const char* nl = memchr(p, '\n', end - p);
+        if (!nl) { break; }
+
+        p = nl + 1;
+        line->headDone = false;
+        line->headLen = 0;
+    }
+}
+
+static void FtpScan_onCommand(FtpScan* scan, const char* head, unsigned int len)
+{
+    unsigned int verbLen = 0;
+    while (verbLen < len && head[verbLen] != ' ' && head[verbLen] != '\r') { ++verbLen; }
+
+    // replies can't be matched up once commands are lost
+    if (scan->count == FTPSCAN_FIFO) {
+        scan->disabled = true;
+        return;
+    }
+
+    unsigned int i = (scan->first + scan->count++) % FTPSCAN_FIFO;
+    scan->commands[i] = Stats_commandIndex(head, verbLen);
+    scan->sentUs[i] = monotonicUs();
+}
+
+static void FtpScan_onReply(FtpScan* scan, const char* head, unsigned int len)
+{
+    if (len < 4 || head[3] != ' ' || head[0] < '2' || head[0] > '5' ||
+        head[1] < '0' || head[1] > '9' || head[2] < '0' || head[2] > '9') {
+        return;
+    }
+
+    // the greeting and anything unsolicited have no command waiting, a
+    // client pipelining behind an early welcome can have commands out
+    // before the greeting arrives
+    if (!scan->greeted) {
+        scan->greeted = true;
+        return;
+    }
+    if (scan->count == 0) { return; }
+
+    unsigned int command = scan->commands[scan->first];
+    long sentUs = scan->sentUs[scan->first];
+    scan->first = (scan->first + 1) % FTPSCAN_FIFO;
+    scan->count--;
+
+    if (scan->stats) {
+        StatsHistogram_add(&scan->stats->latencyUs[command], monotonicUs() - sentUs);
+    }
+
+    if (command == STATS_COMMAND_AUTH && !memcmp(head, "234", 3) && !scan->terminated) {
+        scan->disabled = true;
+    }
+}
+
+void FtpScan_client(FtpScan* scan, const char* buf, size_t len)
+{
+    FtpScan_lines(scan, &scan->client, buf, len, FtpScan_onCommand);
+}
+
+void FtpScan_server(FtpScan* scan, const char* buf, size_t len)
+{
+    FtpScan_lines(scan, &scan->server, buf, len, FtpScan_onReply);
+}
+
+// every command answered and the client between lines, so anything
+// said to it now can't land in the middle of a reply
+bool FtpScan_idle(const FtpScan* scan)
+{
+    return !scan->disabled && scan->count == 0 && scan->client.headLen == 0 &&
+           !scan->client.headDone;
+}
@@ -0,0 +1,58 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_FTPSCAN_H
+#define EBBNC_FTPSCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "stats.h"
+
+// watches the control connection as it is relayed and times each command
+// from the client until the server's final (2xx-5xx) reply. only the first
+// few bytes of each line are looked at, memchr skips the rest, so the
+// relay doesn't pay per byte. pass through tls stops it at AUTH.
+
+#define FTPSCAN_HEAD    8
+#define FTPSCAN_FIFO    32
+
+typedef struct {
+    char            head[FTPSCAN_HEAD];
+    unsigned int    headLen;
+    bool            headDone;
+} FtpScanLine;
+
+typedef struct {
+    FtpScanLine     client;
+    FtpScanLine     server;
+    uint8_t         commands[FTPSCAN_FIFO];
+    long            sentUs[FTPSCAN_FIFO];
+    unsigned int    first;
+    unsigned int    count;
+    bool            greeted;
+    bool            disabled;
+    bool            terminated;
+    StatsCommands*  stats;
+} FtpScan;
+
+void FtpScan_init(FtpScan* scan, StatsCommands* stats, bool terminated);
+void FtpScan_client(FtpScan* scan, const char* buf, size_t len);
+void FtpScan_server(FtpScan* scan, const char* buf, size_t len);
+bool FtpScan_idle(const FtpScan* scan);
+
+#endif
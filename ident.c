@@ -22,23 +22,171 @@
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
 #include "ident.h"
 #include "misc.h"
+#include "radix.h"
+#include "coro.h"
 
-#define IDENT_PORT      113
+#define IDENT_PORT              113
+#define IDENT_CACHE_SETS        1024
+#define IDENT_CACHE_WAYS        4
+#define IDENT_PREFIX_FAILURES   3
+#define IDENT_REPLY_SIZE        1024
 
-bool identLookup(int sock, time_t timeout, char* user)
+// hosts are cached by address, networks by /24 or /48 so that a source
+// behind the same firewall is skipped before it was ever tried
+typedef struct
+{
+    unsigned char   key[RADIX_KEY_SIZE];
+    unsigned char   bits;
+    unsigned char   result;
+    unsigned short  failures;
+    long            expiresUs;
+    char            user[IDENT_LEN];
+} IdentEntry;
+
+static IdentEntry identCache[IDENT_CACHE_SETS][IDENT_CACHE_WAYS];
+static pthread_mutex_t identMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int identHash(const unsigned char key[RADIX_KEY_SIZE], unsigned char bits)
+{
+    unsigned int hash = 2166136261u ^ bits;
+    unsigned int i;
+    for (i = 0; i < RADIX_KEY_SIZE; ++i) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash % IDENT_CACHE_SETS;
+}
+
+static unsigned char identPrefix(const unsigned char key[RADIX_KEY_SIZE],
+                                 unsigned char prefix[RADIX_KEY_SIZE])
+{
+    static const unsigned char v4Mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    memset(prefix, 0, RADIX_KEY_SIZE);
+    if (!memcmp(key, v4Mapped, sizeof(v4Mapped))) {
+        memcpy(prefix, key, 15);
+        return 96 + 24;
+    }
+
+    memcpy(prefix, key, 6);
+    return 48;
+}
+
+static IdentEntry* identFind(const unsigned char key[RADIX_KEY_SIZE], unsigned char bits, long now)
+{
+    IdentEntry* set = identCache[identHash(key, bits)];
+    unsigned int i;
+    for (i = 0; i < IDENT_CACHE_WAYS; ++i) {
+        if (set[i].bits == bits && set[i].expiresUs > now &&
+            !memcmp(set[i].key, key, RADIX_KEY_SIZE)) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+// reuses the entry for key, or else evicts the one closest to expiry
+static IdentEntry* identInsert(const unsigned char key[RADIX_KEY_SIZE], unsigned char bits, long now)
+{
+    IdentEntry* entry = identFind(key, bits, now);
+    if (entry) { return entry; }
+
+    IdentEntry* set = identCache[identHash(key, bits)];
+    entry = &set[0];
+    unsigned int i;
+    for (i = 1; i < IDENT_CACHE_WAYS; ++i) {
+        if (set[i].expiresUs < entry->expiresUs) { entry = &set[i]; }
+    }
+
+    memcpy(entry->key, key, RADIX_KEY_SIZE);
+    entry->bits = bits;
+    entry->failures = 0;
+    entry->user[0] = '\0';
+    return entry;
+}
+
+bool identCached(const struct sockaddr_any* addr, char* user)
+{
+    unsigned char key[RADIX_KEY_SIZE];
+    if (!radixKeyFromSockaddr(addr, key)) { return false; }
+
+    unsigned char prefix[RADIX_KEY_SIZE];
+    unsigned char bits = identPrefix(key, prefix);
+    long now = monotonicUs();
+    bool cached = true;
+
+    pthread_mutex_lock(&identMutex);
+    IdentEntry* entry = identFind(key, RADIX_KEY_BITS, now);
+    if (entry) {
+        strcpy(user, entry->result == IDENT_OK ? entry->user : "*");
+    }
+    else {
+        entry = identFind(prefix, bits, now);
+        if (entry && entry->failures >= IDENT_PREFIX_FAILURES) {
+            strcpy(user, "*");
+        }
+        else {
+            cached = false;
+        }
+    }
+    pthread_mutex_unlock(&identMutex);
+
+    return cached;
+}
+
+void identRemember(const struct sockaddr_any* addr, enum IdentResult result,
+                   const char* user, int okTtl, int failTtl)
+{
+    if (result == IDENT_ERROR) { return; }
+
+    unsigned char key[RADIX_KEY_SIZE];
+    if (!radixKeyFromSockaddr(addr, key)) { return; }
+
+    unsigned char prefix[RADIX_KEY_SIZE];
+    unsigned char bits = identPrefix(key, prefix);
+    bool failed = result == IDENT_REFUSED || result == IDENT_NOREPLY;
+    int ttl = failed ? failTtl : okTtl;
+    long now = monotonicUs();
+
+    pthread_mutex_lock(&identMutex);
+    if (ttl > 0) {
+        IdentEntry* entry = identInsert(key, RADIX_KEY_BITS, now);
+        entry->result = result;
+        entry->expiresUs = now + ttl * 1000000L;
+        if (result == IDENT_OK) {
+            strncpy(entry->user, user, sizeof(entry->user) - 1);
+            entry->user[sizeof(entry->user) - 1] = '\0';
+        }
+    }
+
+    // only silence costs a whole timeout, a refusal is a round trip
+    if (result == IDENT_NOREPLY && failTtl > 0) {
+        IdentEntry* entry = identInsert(prefix, bits, now);
+        if (entry->failures < IDENT_PREFIX_FAILURES) { ++entry->failures; }
+        entry->expiresUs = now + failTtl * 1000000L;
+    }
+    else if (result == IDENT_OK) {
+        IdentEntry* entry = identFind(prefix, bits, now);
+        if (entry) { entry->failures = 0; }
+    }
+    pthread_mutex_unlock(&identMutex);
+}
+
+enum IdentResult identLookup(int sock, char* user, IdentHook hook, void* arg)
 {
     struct sockaddr_any peerAddr;
     socklen_t peerLen = sizeof(peerAddr);
     if (getpeername(sock, (struct sockaddr*) &peerAddr, &peerLen) < 0) {
-        return false;
+        return IDENT_ERROR;
     }
 
     struct sockaddr_any localAddr;
     socklen_t localLen = sizeof(localAddr);
     if (getsockname(sock, (struct sockaddr*) &localAddr, &localLen) < 0) {
-        return false;
+        return IDENT_ERROR;
     }
 
     struct sockaddr_any addr;
@@ -51,38 +199,50 @@ bool identLookup(int sock, time_t timeout, char* user)
             addr.s6.sin6_port = htons(IDENT_PORT);
             break;
         default :
-            return false;
+            return IDENT_ERROR;
     }
 
     int identSock = socket(addr.san_family, SOCK_STREAM, 0);
-    if (identSock < 0) { return false; }
+    if (identSock < 0) { return IDENT_ERROR; }
 
-    setReadTimeout(identSock, timeout);
-    setWriteTimeout(identSock, timeout);
+    hook(identSock, arg);
 
-    if (connect(identSock, &addr.sa, sockaddrLen(&addr)) < 0) {
-      close(identSock);
-      return false;
-    }
-
-    FILE* fp = fdopen(identSock, "r+");
-    if (!fp) {
+    if (Coro_connect(identSock, &addr.sa, sockaddrLen(&addr)) < 0) {
+        int connectErrno = errno;
+        hook(-1, arg);
         close(identSock);
-        return false;
+        return connectErrno == ECONNREFUSED ? IDENT_REFUSED : IDENT_NOREPLY;
     }
 
     int localPort = portFromSockaddr(&localAddr);
     int remotePort = portFromSockaddr(&peerAddr);
 
-    if (fprintf(fp, "%i,%i\r\n", remotePort, localPort) < 0) {
-        fclose(fp);
-        return false;
+    char reply[IDENT_REPLY_SIZE];
+    int len = snprintf(reply, sizeof(reply), "%i,%i\r\n", remotePort, localPort);
+    if (Coro_write(identSock, reply, len) != len) {
+        hook(-1, arg);
+        close(identSock);
+        return IDENT_NOREPLY;
     }
 
+    // one line, the server closes after it
+    size_t replyLen = 0;
+    while (replyLen < sizeof(reply) - 1 && !memchr(reply, '\n', replyLen)) {
+        ssize_t ret = Coro_read(identSock, reply + replyLen, sizeof(reply) - 1 - replyLen);
+        if (ret <= 0) { break; }
+        replyLen += ret;
+    }
+    reply[replyLen] = '\0';
+    hook(-1, arg);
+    close(identSock);
+
     int replyLocalPort;
     int replyRemotePort;
-    int ret = fscanf(fp, "%i, %i : USERID :%*[^:]:%255s\r\n", &replyRemotePort,
+    int ret = sscanf(reply, "%i, %i : USERID :%*[^:]:%255s", &replyRemotePort,
                      &replyLocalPort, user);
-    fclose(fp);
-    return ret == 3 && replyLocalPort == localPort && replyRemotePort == remotePort;
+    if (ret == EOF) { return IDENT_NOREPLY; }
+    if (ret != 3 || replyLocalPort != localPort || replyRemotePort != remotePort) {
+        return IDENT_INVALID;
+    }
+    return IDENT_OK;
 }
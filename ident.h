@@ -24,6 +24,23 @@
 
 #define IDENT_LEN 256
 
-bool identLookup(int sock, time_t timeout, char* user);
+// hook gets the ident socket once it exists and -1 just before it is
+// closed, so the caller can put a deadline on it
+typedef void (*IdentHook)(int identSock, void* arg);
+
+enum IdentResult
+{
+    IDENT_OK,
+    IDENT_REFUSED,      // port 113 closed
+    IDENT_NOREPLY,      // dropped, timed out or hung up
+    IDENT_INVALID,      // answered, but not with a userid for us
+    IDENT_ERROR         // failed locally, says nothing about the client
+};
+
+enum IdentResult identLookup(int sock, char* user, IdentHook hook, void* arg);
+
+bool identCached(const struct sockaddr_any* addr, char* user);
+void identRemember(const struct sockaddr_any* addr, enum IdentResult result,
+                   const char* user, int okTtl, int failTtl);
 
 #endif
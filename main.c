@@ -28,6 +28,18 @@
 #include "misc.h"
 #include "conf.h"
 #include "info.h"
+#include "acl.h"
+#include "route.h"
+#include "signals.h"
+#include "tunnel.h"
+#include "tls.h"
+#include "timer.h"
+#include "stats.h"
+#include "sockmap.h"
+#include "client.h"
+#include "coro.h"
+#include "prefork.h"
+#include "capture.h"
 
 bool InitialiseSignals()
 {
@@ -41,7 +53,7 @@ bool InitialiseSignals()
         return false;
     }
 
-    return true;
+    return Signals_block();
 }
 
 int main(int argc, char** argv)
@@ -74,6 +86,7 @@ int main(int argc, char** argv)
     InitialiseSignals();
 
     printf("Loading config file ..\n");
+    long start = monotonicMs();
 
 #ifndef CONF_EMBEDDED
     Config* config = Config_loadFile(argv[1]);
@@ -82,6 +95,54 @@ int main(int argc, char** argv)
 #endif
     if (!config) { return 1; }
 
+    printf("Loaded config in %li ms ..\n", monotonicMs() - start);
+
+    printf("Loading access lists ..\n");
+    if (!Acl_load(config)) {
+        Config_free(&config);
+        return 1;
+    }
+
+    printf("Loading routes ..\n");
+    if (!Route_load(config)) {
+        Config_free(&config);
+        return 1;
+    }
+
+    printf("Creating stats segment ..\n");
+    if (!Stats_init(config, Timer_wheels())) {
+        Config_free(&config);
+        return 1;
+    }
+
+    if (config->capture) {
+        printf("Opening capture file ..\n");
+        if (!Capture_start(config)) {
+            Config_free(&config);
+            return 1;
+        }
+    }
+
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer && !bouncer->kernelRelay; bouncer = bouncer->next);
+    if (bouncer) {
+        printf("Loading kernel relay ..\n");
+        if (!Sockmap_init()) {
+            // sessions find no map and stay in user space
+            fprintf(stderr, "Kernel relay unavailable, relaying in user space: %s\n",
+                    strerror(errno));
+        }
+    }
+
+#ifdef EBBNC_TLS
+    // before the fork so every process shares the ticket key
+    printf("Initialising TLS ..\n");
+    if (!Tls_init(config)) {
+        Config_free(&config);
+        return 1;
+    }
+#endif
+
     if (config->pidFile) {
         printf("Checking if bouncer already running ..\n");
         int ret = isAlreadyRunning(config->pidFile);
@@ -99,12 +160,15 @@ int main(int argc, char** argv)
     }
 
     printf("Initialising listening sockets ..\n");
+    start = monotonicMs();
     Server* servers = Server_listenAll(config);
     if (!servers) {
         Config_free(&config);
         return 1;
     }
 
+    printf("Initialised listening sockets in %li ms ..\n", monotonicMs() - start);
+
     printf("Forking into background ..\n");
     pid_t pid = daemonise();
     if (pid < 0) {
@@ -129,10 +193,32 @@ int main(int argc, char** argv)
         _exit(0);
     }
 
+    Stats_setOwner();
+
+    // returns in each worker, the master stays in it supervising them
+    if (config->processes == 0) {
+        Stats_setProcess(0);
+    }
+    else if (!Prefork_run(config, servers)) {
+        Server_freeList(&servers);
+        Config_free(&config);
+        return 1;
+    }
+
+    if (!Timer_startAll() || !Signals_start(config) || !Client_startPool(config) ||
+        (config->coroEngine && !Coro_startAll()) || !Tunnel_startAll(config)) {
+        Server_freeList(&servers);
+        Config_free(&config);
+        return 1;
+    }
+
     printf("Waiting for connections ..\n");
+    Prefork_ready();
     Server_loop(servers);
 
+    // only a prefork worker stops accepting, it goes once its sessions end
     Server_freeList(&servers);
+    Prefork_drain();
     Config_free(&config);
 
     return 0;
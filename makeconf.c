@@ -104,6 +104,7 @@ int main(int argc, char** argv)
         STAGE_DNS_LOOKUP,
         STAGE_PID_FILE,
         STAGE_WELCOME_MSG,
+        STAGE_EARLY_WELCOME,
         STAGE_PASSWORD
 
     } stage = STAGE_BOUNCER_LISTEN;
@@ -298,6 +299,19 @@ int main(int argc, char** argv)
                 }
                 break;
             }
+            case STAGE_EARLY_WELCOME : {
+                char* value = promptInput("Early welcome", "false");
+                if (!strcasecmp(value, "true")) {
+                    config->earlyWelcome = true;
+                }
+                else if (!strcasecmp(value, "false")) {
+                    config->earlyWelcome = false;
+                }
+                else {
+                    error = ERROR_VALUE;
+                }
+                break;
+            }
             case STAGE_PASSWORD : {
                 char* value = getpass("Password: ");
                 if (strlen(value) >= MINIMUM_PASSLEN) {
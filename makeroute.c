@@ -0,0 +1,302 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "route.h"
+#include "radix.h"
+#include "misc.h"
+#include "info.h"
+
+typedef unsigned __int128 uint128;
+
+typedef struct {
+    uint128     lo;
+    uint128     hi;
+    uint32_t    upstream;
+} Prefix;
+
+typedef struct {
+    Prefix*     prefixes;
+    size_t      prefixCount;
+    char**      upstreams;
+    uint32_t    upstreamCount;
+    RouteRange* ranges;
+    size_t      rangeCount;
+} Routes;
+
+static uint128 keyToInt(const unsigned char* key)
+{
+    uint128 value = 0;
+    unsigned int i;
+    for (i = 0; i < RADIX_KEY_SIZE; ++i) {
+        value = (value << 8) | key[i];
+    }
+    return value;
+}
+
+static void intToKey(uint128 value, unsigned char* key)
+{
+    int i;
+    for (i = RADIX_KEY_SIZE - 1; i >= 0; --i) {
+        key[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static int Prefix_compare(const void* av, const void* bv)
+{
+    const Prefix* a = av;
+    const Prefix* b = bv;
+    if (a->lo != b->lo) { return a->lo < b->lo ? -1 : 1; }
+    if (a->hi != b->hi) { return a->hi > b->hi ? -1 : 1; }
+    return 0;
+}
+
+static bool Routes_upstream(Routes* routes, const char* hostPort, uint32_t* index)
+{
+    uint32_t i;
+    for (i = 0; i < routes->upstreamCount; ++i) {
+        if (!strcasecmp(routes->upstreams[i], hostPort)) {
+            *index = i;
+            return true;
+        }
+    }
+
+    char** upstreams = realloc(routes->upstreams, (i + 1) * sizeof(char*));
+    if (!upstreams) { return false; }
+    routes->upstreams = upstreams;
+
+    upstreams[i] = strdup(hostPort);
+    if (!upstreams[i]) { return false; }
+
+    routes->upstreamCount++;
+    *index = i;
+    return true;
+}
+
+static bool Routes_load(Routes* routes, const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    size_t size = 0;
+    char line[BUFSIZ];
+    unsigned int lineNo = 0;
+    bool okay = true;
+    while (okay && fgets(line, sizeof(line), fp)) {
+        lineNo++;
+        stripCRLF(line);
+        if (*line == '\0' || *line == '#') { continue; }
+
+        char* cidr = strtok(line, " \t");
+        char* hostPort = strtok(NULL, " \t");
+        unsigned char key[RADIX_KEY_SIZE];
+        unsigned int bits;
+        if (!cidr || !hostPort || strtok(NULL, " \t") ||
+            !radixKeyFromCIDR(cidr, key, &bits)) {
+            fprintf(stderr, "Invalid route on line %u.\n", lineNo);
+            okay = false;
+            break;
+        }
+
+        if (routes->prefixCount == size) {
+            size = size ? size * 2 : 1024;
+            Prefix* prefixes = realloc(routes->prefixes, size * sizeof(Prefix));
+            if (!prefixes) {
+                perror("realloc");
+                okay = false;
+                break;
+            }
+            routes->prefixes = prefixes;
+        }
+
+        Prefix* prefix = &routes->prefixes[routes->prefixCount++];
+        prefix->lo = keyToInt(key);
+        prefix->hi = prefix->lo | (bits == 0 ? ~(uint128) 0 :
+                                   (((uint128) 1 << (RADIX_KEY_BITS - bits)) - 1));
+        if (bits == RADIX_KEY_BITS) { prefix->hi = prefix->lo; }
+
+        if (!Routes_upstream(routes, hostPort, &prefix->upstream)) {
+            perror("Routes_upstream");
+            okay = false;
+        }
+    }
+
+    fclose(fp);
+    return okay;
+}
+
+static bool Routes_emit(Routes* routes, uint128 lo, uint128 hi, uint32_t upstream)
+{
+    if (lo > hi) { return true; }
+
+    if (routes->rangeCount > 0) {
+        RouteRange* last = &routes->ranges[routes->rangeCount - 1];
+        if (last->upstream == upstream && keyToInt(last->hi) + 1 == lo) {
+            intToKey(hi, last->hi);
+            return true;
+        }
+    }
+
+    RouteRange* range = &routes->ranges[routes->rangeCount++];
+    intToKey(lo, range->lo);
+    intToKey(hi, range->hi);
+    range->upstream = upstream;
+    return true;
+}
+
+// prefixes either nest or are disjoint, so sorted by start and widest
+// first a stack of enclosing prefixes yields the longest match for each
+// stretch of the address space
+static bool Routes_flatten(Routes* routes)
+{
+    qsort(routes->prefixes, routes->prefixCount, sizeof(Prefix), Prefix_compare);
+
+    size_t i;
+    for (i = 1; i < routes->prefixCount; ++i) {
+        if (!Prefix_compare(&routes->prefixes[i - 1], &routes->prefixes[i])) {
+            fprintf(stderr, "Duplicate route prefix.\n");
+            return false;
+        }
+    }
+
+    // each prefix splits at most one enclosing range in two
+    routes->ranges = calloc(routes->prefixCount * 2 + 1, sizeof(RouteRange));
+    Prefix** stack = calloc(routes->prefixCount + 1, sizeof(Prefix*));
+    if (!routes->ranges || !stack) {
+        perror("calloc");
+        free(stack);
+        return false;
+    }
+
+    size_t depth = 0;
+    uint128 cur = 0;
+    for (i = 0; i < routes->prefixCount; ++i) {
+        Prefix* prefix = &routes->prefixes[i];
+        while (depth > 0 && stack[depth - 1]->hi < prefix->lo) {
+            Prefix* top = stack[--depth];
+            Routes_emit(routes, cur, top->hi, top->upstream);
+            cur = top->hi + 1;
+        }
+
+        if (depth > 0 && prefix->lo > 0) {
+            Routes_emit(routes, cur, prefix->lo - 1, stack[depth - 1]->upstream);
+        }
+
+        cur = prefix->lo;
+        stack[depth++] = prefix;
+    }
+
+    while (depth > 0) {
+        Prefix* top = stack[--depth];
+        Routes_emit(routes, cur, top->hi, top->upstream);
+        if (top->hi == ~(uint128) 0) { break; }
+        cur = top->hi + 1;
+    }
+
+    free(stack);
+    return true;
+}
+
+// a running bouncer has the old file mapped, so it is replaced whole by
+// renaming a new one over it rather than rewritten in place
+static bool Routes_save(Routes* routes, const char* path)
+{
+    char* temp = strPrintf("%s.tmp", path);
+    if (!temp) {
+        perror("strPrintf");
+        return false;
+    }
+
+    FILE* fp = fopen(temp, "wb");
+    if (!fp) {
+        fprintf(stderr, "Unable to create %s: %s\n", temp, strerror(errno));
+        free(temp);
+        return false;
+    }
+
+    RouteHeader header;
+    memcpy(header.magic, ROUTE_MAGIC, sizeof(header.magic));
+    header.version = ROUTE_VERSION;
+    header.rangeCount = routes->rangeCount;
+    header.upstreamCount = routes->upstreamCount;
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(routes->ranges, sizeof(RouteRange), routes->rangeCount, fp);
+
+    uint32_t offset = 0;
+    uint32_t i;
+    for (i = 0; i < routes->upstreamCount; ++i) {
+        fwrite(&offset, sizeof(offset), 1, fp);
+        offset += strlen(routes->upstreams[i]) + 1;
+    }
+
+    for (i = 0; i < routes->upstreamCount; ++i) {
+        fwrite(routes->upstreams[i], strlen(routes->upstreams[i]) + 1, 1, fp);
+    }
+
+    bool okay = fflush(fp) == 0 && !ferror(fp) && fsync(fileno(fp)) == 0;
+    okay = fclose(fp) == 0 && okay;
+
+    if (okay && rename(temp, path) < 0) {
+        fprintf(stderr, "Unable to rename %s to %s: %s\n", temp, path, strerror(errno));
+        okay = false;
+    }
+
+    if (!okay) { unlink(temp); }
+    free(temp);
+    return okay;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <route list> <route file>\n", argv[0]);
+        fprintf(stderr, "Route list lines are: <cidr> <host>:<port>\n");
+        return 1;
+    }
+
+    hline();
+    printf("%s route compiler %s by %s\n", EBBNC_PROGRAM, EBBNC_VERSION, EBBNC_AUTHOR);
+    hline();
+    atexit(hline);
+
+    Routes routes;
+    memset(&routes, 0, sizeof(routes));
+
+    printf("Loading routes from %s ..\n", argv[1]);
+    if (!Routes_load(&routes, argv[1])) { return 1; }
+
+    printf("Flattening %lu prefixes ..\n", (unsigned long) routes.prefixCount);
+    if (!Routes_flatten(&routes)) { return 1; }
+
+    printf("Saving %lu ranges to %s ..\n", (unsigned long) routes.rangeCount, argv[2]);
+    if (!Routes_save(&routes, argv[2])) {
+        fprintf(stderr, "Error while saving %s.\n", argv[2]);
+        return 1;
+    }
+
+    printf("Successfully saved route file!\n");
+    return 0;
+}
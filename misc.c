@@ -65,6 +65,9 @@ bool ipPortToSockaddr(const char* ip, int port, struct sockaddr_any* addr)
 
 bool hostPortToSockaddr(const char* host, int port, struct sockaddr_any* addr, const char** errmsg)
 {
+    // numeric hosts need no resolver and no heap allocation
+    if (ipPortToSockaddr(host, port, addr)) { return true; }
+
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = PF_UNSPEC;
@@ -89,6 +92,7 @@ bool hostPortToSockaddr(const char* host, int port, struct sockaddr_any* addr, c
     }
 
     memcpy(addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
     return true;
 }
 
@@ -310,3 +314,17 @@ socklen_t sockaddrLen(const struct sockaddr_any* addr)
            sizeof(struct sockaddr_in) :
            sizeof(struct sockaddr_in6);
 }
+
+long monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long monotonicUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -56,6 +56,8 @@ bool strToLong(const char* s, long* i);
 char* promptInput(const char* prompt, const char* defaultValue);
 void hline();
 socklen_t sockaddrLen(const struct sockaddr_any* addr);
+long monotonicMs();
+long monotonicUs();
 
 #define IGNORE_RESULT(x) ({ typeof(x) z = x; (void)sizeof(z); })
 
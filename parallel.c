@@ -0,0 +1,158 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "parallel.h"
+
+typedef struct {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    void**              items;
+    bool*               done;
+    size_t              count;
+    size_t              next;
+    size_t              completed;
+    unsigned int        refs;
+    bool                abandoned;
+    void                (*run)(void*);
+    void                (*release)(void*);
+} Parallel;
+
+static void Parallel_unref(Parallel* par)
+{
+    pthread_mutex_lock(&par->mutex);
+    bool last = --par->refs == 0;
+    pthread_mutex_unlock(&par->mutex);
+    if (!last) { return; }
+
+    if (par->abandoned && par->release) {
+        size_t i;
+        for (i = 0; i < par->count; ++i) {
+            par->release(par->items[i]);
+        }
+    }
+
+    pthread_cond_destroy(&par->cond);
+    pthread_mutex_destroy(&par->mutex);
+    free(par->items);
+    free(par->done);
+    free(par);
+}
+
+static void* Parallel_threadMain(void* parv)
+{
+    Parallel* par = parv;
+
+    pthread_mutex_lock(&par->mutex);
+    while (par->next < par->count) {
+        size_t i = par->next++;
+        pthread_mutex_unlock(&par->mutex);
+
+        par->run(par->items[i]);
+
+        pthread_mutex_lock(&par->mutex);
+        par->done[i] = true;
+        if (++par->completed == par->count) {
+            pthread_cond_signal(&par->cond);
+        }
+    }
+    pthread_mutex_unlock(&par->mutex);
+
+    Parallel_unref(par);
+    return NULL;
+}
+
+bool runParallel(void** items, size_t count, void (*run)(void*),
+                 void (*release)(void*), time_t timeout, bool* done)
+{
+    memset(done, 0, count * sizeof(bool));
+    if (count == 0) { return true; }
+
+    Parallel* par = calloc(1, sizeof(Parallel));
+    if (!par) { return false; }
+
+    par->items = malloc(count * sizeof(void*));
+    par->done = calloc(count, sizeof(bool));
+    if (!par->items || !par->done) {
+        free(par->items);
+        free(par->done);
+        free(par);
+        return false;
+    }
+
+    memcpy(par->items, items, count * sizeof(void*));
+    par->count = count;
+    par->run = run;
+    par->release = release;
+    par->refs = 1;
+    pthread_mutex_init(&par->mutex, NULL);
+    pthread_cond_init(&par->cond, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    unsigned int threads = count < PARALLEL_MAX_THREADS ? count : PARALLEL_MAX_THREADS;
+    unsigned int i;
+    for (i = 0; i < threads; ++i) {
+        pthread_t thread;
+        pthread_mutex_lock(&par->mutex);
+        par->refs++;
+        pthread_mutex_unlock(&par->mutex);
+        if (pthread_create(&thread, &attr, Parallel_threadMain, par) != 0) {
+            pthread_mutex_lock(&par->mutex);
+            par->refs--;
+            pthread_mutex_unlock(&par->mutex);
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // no threads at all, do the work ourselves
+    if (i == 0) {
+        pthread_mutex_lock(&par->mutex);
+        par->refs++;
+        pthread_mutex_unlock(&par->mutex);
+        Parallel_threadMain(par);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&par->mutex);
+    while (par->completed < par->count) {
+        if (timeout == 0) {
+            pthread_cond_wait(&par->cond, &par->mutex);
+        }
+        else if (pthread_cond_timedwait(&par->cond, &par->mutex,
+                                        &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    bool finished = par->completed == par->count;
+    memcpy(done, par->done, count * sizeof(bool));
+    par->abandoned = !finished;
+    pthread_mutex_unlock(&par->mutex);
+
+    Parallel_unref(par);
+    return finished;
+}
@@ -0,0 +1,35 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_PARALLEL_H
+#define EBBNC_PARALLEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define PARALLEL_MAX_THREADS 32
+
+// runs run() on every item using up to PARALLEL_MAX_THREADS threads and
+// waits at most timeout seconds (0 waits forever), done[i] is set for each
+// item that completed. if the deadline passes the items still belong to
+// the worker threads, which call release() on all of them once the last
+// one finishes, otherwise the items are left to the caller.
+bool runParallel(void** items, size_t count, void (*run)(void*),
+                 void (*release)(void*), time_t timeout, bool* done);
+
+#endif
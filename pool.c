@@ -0,0 +1,260 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_MASK   (POOL_MAX_THREADS - 1)
+
+typedef struct {
+    Pool*       pool;
+    PoolFunc    func;
+    void*       arg;
+} PoolStart;
+
+// bounded mpmc queue after Dmitry Vyukov, each cell's sequence says
+// whether it is free for the producer at that position or holds a job
+// for the consumer at that position
+static bool Pool_enqueue(Pool* pool, PoolFunc func, void* arg)
+{
+    size_t pos = __atomic_load_n(&pool->enqueuePos, __ATOMIC_RELAXED);
+    PoolCell* cell;
+    while (true) {
+        cell = &pool->cells[pos & POOL_MASK];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&pool->enqueuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&pool->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->func = func;
+    cell->arg = arg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool Pool_dequeue(Pool* pool, PoolFunc* func, void** arg)
+{
+    size_t pos = __atomic_load_n(&pool->dequeuePos, __ATOMIC_RELAXED);
+    PoolCell* cell;
+    while (true) {
+        cell = &pool->cells[pos & POOL_MASK];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&pool->dequeuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&pool->dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *func = cell->func;
+    *arg = cell->arg;
+    __atomic_store_n(&cell->seq, pos + POOL_MASK + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// decrements the counter unless that would take it below floor
+static bool Pool_take(unsigned int* counter, unsigned int floor)
+{
+    unsigned int value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > floor) {
+        if (__atomic_compare_exchange_n(counter, &value, value - 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// false when the thread has been idle long enough to exit
+static bool Pool_wait(Pool* pool, PoolFunc* func, void** arg)
+{
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pool->idleMs / 1000;
+        deadline.tv_nsec += (pool->idleMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        if (sem_timedwait(&pool->ready, &deadline) == 0) {
+            // the job is queued before the post
+            while (!Pool_dequeue(pool, func, arg)) { }
+            return true;
+        }
+
+        if (errno != ETIMEDOUT) { continue; }
+
+        if (!Pool_take(&pool->threads, pool->min)) { continue; }
+
+        // no idle thread left means a submitter has counted on this one
+        // and its post is on the way
+        if (!Pool_take(&pool->idle, 0)) {
+            __atomic_add_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        return false;
+    }
+}
+
+static void* Pool_threadMain(void* startv)
+{
+    PoolStart* start = startv;
+    Pool* pool = start->pool;
+    PoolFunc func = start->func;
+    void* arg = start->arg;
+    free(start);
+
+    if (!pool) { return func(arg); }
+
+    while (true) {
+        if (func) { func(arg); }
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELEASE);
+        if (!Pool_wait(pool, &func, &arg)) { break; }
+    }
+
+    return NULL;
+}
+
+static bool Pool_spawn(Pool* pool, size_t stackSize, PoolFunc func, void* arg)
+{
+    PoolStart* start = malloc(sizeof(PoolStart));
+    if (!start) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    start->pool = pool;
+    start->func = func;
+    start->arg = arg;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stackSize);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, &attr, Pool_threadMain, start);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        free(start);
+        errno = ret;
+        return false;
+    }
+
+    return true;
+}
+
+Pool* Pool_new(unsigned int min, unsigned int max, long idleMs, size_t stackSize)
+{
+    Pool* pool = aligned_alloc(64, sizeof(Pool));
+    if (!pool) { return NULL; }
+
+    memset(pool, 0, sizeof(Pool));
+    if (sem_init(&pool->ready, 0, 0) < 0) {
+        free(pool);
+        return NULL;
+    }
+
+    max = max < POOL_MAX_THREADS ? max : POOL_MAX_THREADS;
+    pool->min = min < max ? min : max;
+    pool->max = max;
+    pool->idleMs = idleMs > 0 ? idleMs : 1;
+    pool->stackSize = stackSize;
+
+    unsigned int i;
+    for (i = 0; i < POOL_MAX_THREADS; ++i) {
+        pool->cells[i].seq = i;
+    }
+
+    for (i = 0; i < pool->min; ++i) {
+        __atomic_add_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+        if (!Pool_spawn(pool, stackSize, NULL, NULL)) {
+            __atomic_sub_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    return pool;
+}
+
+// false when no thread could be had for the job, it has not run
+bool Pool_submit(Pool* pool, PoolFunc func, void* arg)
+{
+    if (Pool_take(&pool->idle, 0)) {
+        // the queue holds at most one job per idle thread, it can't fill
+        Pool_enqueue(pool, func, arg);
+        sem_post(&pool->ready);
+        return true;
+    }
+
+    unsigned int threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+    while (threads < pool->max) {
+        if (__atomic_compare_exchange_n(&pool->threads, &threads, threads + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            if (Pool_spawn(pool, pool->stackSize, func, arg)) { return true; }
+            __atomic_sub_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+
+    __atomic_add_fetch(&pool->saturated, 1, __ATOMIC_RELAXED);
+    return Pool_spawn(NULL, pool->stackSize, func, arg);
+}
+
+unsigned int Pool_threads(Pool* pool)
+{
+    return __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+}
+
+unsigned int Pool_idle(Pool* pool)
+{
+    return __atomic_load_n(&pool->idle, __ATOMIC_RELAXED);
+}
+
+unsigned long Pool_saturated(Pool* pool)
+{
+    return __atomic_load_n(&pool->saturated, __ATOMIC_RELAXED);
+}
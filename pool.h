@@ -0,0 +1,61 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_POOL_H
+#define EBBNC_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <semaphore.h>
+
+// threads started ahead of time and kept between jobs. a job is handed
+// to an idle thread through a bounded lock-free queue, a new thread is
+// started when none is idle, and once max threads are busy the job gets
+// a thread of its own that exits when the job is done. threads idle for
+// idleMs exit until min are left.
+
+#define POOL_MAX_THREADS    4096
+
+typedef void* (*PoolFunc)(void*);
+
+typedef struct {
+    size_t      seq;
+    PoolFunc    func;
+    void*       arg;
+} PoolCell;
+
+typedef struct Pool {
+    size_t          enqueuePos __attribute__((aligned(64)));
+    size_t          dequeuePos __attribute__((aligned(64)));
+    PoolCell        cells[POOL_MAX_THREADS] __attribute__((aligned(64)));
+    sem_t           ready;
+    unsigned int    threads;
+    unsigned int    idle;
+    unsigned long   saturated;
+    unsigned int    min;
+    unsigned int    max;
+    long            idleMs;
+    size_t          stackSize;
+} Pool;
+
+Pool* Pool_new(unsigned int min, unsigned int max, long idleMs, size_t stackSize);
+bool Pool_submit(Pool* pool, PoolFunc func, void* arg);
+unsigned int Pool_threads(Pool* pool);
+unsigned int Pool_idle(Pool* pool);
+unsigned long Pool_saturated(Pool* pool);
+
+#endif
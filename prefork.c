@@ -0,0 +1,206 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "prefork.h"
+#include "signals.h"
+#include "stats.h"
+#include "client.h"
+#include "misc.h"
+
+static pid_t workers[STATS_MAX_PROCESSES];
+static long spawnedMs[STATS_MAX_PROCESSES];
+static int readyFd = -1;
+
+static void Prefork_signals(sigset_t* set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGUSR1);
+}
+
+// 0 in the new worker, its pid in the master, -1 if the fork failed. when
+// wait is set the master returns once the worker is accepting.
+static pid_t Prefork_spawn(unsigned int index, bool wait)
+{
+    // the sessions of a dead worker died with it, a worker being replaced
+    // shares the slot with its successor while it drains
+    if (workers[index] == 0) { stats->processes[index].sessions = 0; }
+
+    int ready[2];
+    if (pipe(ready) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(ready[0]);
+        readyFd = ready[1];
+
+        Stats_setProcess(index);
+
+        // SIGHUP and SIGTERM stay blocked for the worker's signal thread
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        return 0;
+    }
+
+    close(ready[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(ready[0]);
+        return -1;
+    }
+
+    if (workers[index] != 0 || spawnedMs[index] != 0) {
+        STATS_ADD(stats->processes[index].restarts, 1);
+    }
+    workers[index] = pid;
+    spawnedMs[index] = monotonicMs();
+
+    if (wait) {
+        struct pollfd pfd = { ready[0], POLLIN, 0 };
+        while (poll(&pfd, 1, PREFORK_READY_MS) < 0 && errno == EINTR) { }
+    }
+    close(ready[0]);
+    return pid;
+}
+
+static void Prefork_reap()
+{
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        unsigned int i;
+        for (i = 0; i < STATS_MAX_PROCESSES; ++i) {
+            // old workers draining after a restart are no longer listed
+            if (workers[i] != pid) { continue; }
+
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "Worker %u (PID #%i) killed by signal %i.\n",
+                        i, pid, WTERMSIG(status));
+            }
+            else {
+                fprintf(stderr, "Worker %u (PID #%i) exited with status %i.\n",
+                        i, pid, WEXITSTATUS(status));
+            }
+            workers[i] = 0;
+        }
+    }
+}
+
+bool Prefork_run(Config* config, Server* servers)
+{
+    // every worker selects on every listener, the ones that lose the race
+    // to accept must not block in accept
+    Server* server;
+    for (server = servers; server; server = server->next) {
+        fcntl(server->sock, F_SETFL, fcntl(server->sock, F_GETFL) | O_NONBLOCK);
+    }
+
+    sigset_t set;
+    Prefork_signals(&set);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    unsigned int count = config->processes;
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        pid_t pid = Prefork_spawn(i, false);
+        if (pid == 0) { return true; }
+        if (pid < 0) {
+            for (i = 0; i < count; ++i) {
+                if (workers[i] > 0) { kill(workers[i], SIGTERM); }
+            }
+            return false;
+        }
+    }
+
+    while (true) {
+        struct timespec tick;
+        tick.tv_sec = PREFORK_TICK_MS / 1000;
+        tick.tv_nsec = (PREFORK_TICK_MS % 1000) * 1000000L;
+
+        int signo = sigtimedwait(&set, NULL, &tick);
+        if (signo == SIGTERM) {
+            for (i = 0; i < count; ++i) {
+                if (workers[i] > 0) { kill(workers[i], SIGTERM); }
+            }
+            Stats_close();
+            exit(0);
+        }
+
+        // each worker appends its own sessions to the dump
+        if (signo == SIGUSR1) {
+            for (i = 0; i < count; ++i) {
+                if (workers[i] > 0) { kill(workers[i], SIGUSR1); }
+            }
+        }
+
+        if (signo == SIGHUP) {
+            Signals_reload(config);
+            for (i = 0; i < count; ++i) {
+                pid_t old = workers[i];
+                pid_t pid = Prefork_spawn(i, true);
+                if (pid == 0) { return true; }
+                if (pid > 0 && old > 0) { kill(old, SIGTERM); }
+            }
+        }
+
+        Prefork_reap();
+
+        // a worker dying straight away again is not restarted in a loop
+        long now = monotonicMs();
+        for (i = 0; i < count; ++i) {
+            if (workers[i] == 0 && now - spawnedMs[i] >= PREFORK_RESPAWN_MS) {
+                if (Prefork_spawn(i, false) == 0) { return true; }
+            }
+        }
+    }
+}
+
+// tells the master a restarted worker has taken over
+void Prefork_ready()
+{
+    if (readyFd < 0) { return; }
+
+    char c = 0;
+    IGNORE_RESULT(write(readyFd, &c, 1));
+    close(readyFd);
+    readyFd = -1;
+}
+
+// after Server_loop has stopped, sessions launched just before still
+// have to show up in the count
+void Prefork_drain()
+{
+    usleep(PREFORK_GRACE_MS * 1000L);
+    while (Client_sessions() > 0) { usleep(PREFORK_TICK_MS * 1000L); }
+}
@@ -0,0 +1,39 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_PREFORK_H
+#define EBBNC_PREFORK_H
+
+#include <stdbool.h>
+#include "config.h"
+#include "server.h"
+
+// with processes=N the daemon forks N workers that share its listeners
+// and stays behind to supervise them. a worker that dies is started again,
+// SIGHUP reloads the access lists and routes and replaces the workers one
+// at a time, each old one stops accepting and exits once its sessions end.
+
+#define PREFORK_RESPAWN_MS  1000
+#define PREFORK_READY_MS    5000
+#define PREFORK_TICK_MS     200
+#define PREFORK_GRACE_MS    1000
+
+bool Prefork_run(Config* config, Server* servers);
+void Prefork_ready();
+void Prefork_drain();
+
+#endif
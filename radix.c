@@ -0,0 +1,208 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "radix.h"
+
+static inline unsigned int keyBit(const unsigned char* key, unsigned int bit)
+{
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+static void keyMask(unsigned char* key, unsigned int bits)
+{
+    unsigned int i;
+    for (i = bits; i < RADIX_KEY_BITS; ++i) {
+        if ((i & 7) == 0) {
+            memset(key + (i >> 3), 0, RADIX_KEY_SIZE - (i >> 3));
+            return;
+        }
+        key[i >> 3] &= ~(0x80 >> (i & 7));
+    }
+}
+
+// number of leading bits a and b have in common, up to max
+static unsigned int keyCommon(const unsigned char* a, const unsigned char* b,
+                              unsigned int max)
+{
+    unsigned int bits = 0;
+    unsigned int i;
+    for (i = 0; i < RADIX_KEY_SIZE && bits < max; ++i) {
+        unsigned char diff = a[i] ^ b[i];
+        if (diff) {
+            bits += __builtin_clz(diff) - (sizeof(unsigned int) - 1) * 8;
+            break;
+        }
+        bits += 8;
+    }
+    return bits < max ? bits : max;
+}
+
+static RadixNode* RadixNode_new(const unsigned char* key, unsigned int bits)
+{
+    RadixNode* node = calloc(1, sizeof(RadixNode));
+    if (!node) { return NULL; }
+
+    memcpy(node->key, key, RADIX_KEY_SIZE);
+    keyMask(node->key, bits);
+    node->bits = bits;
+    return node;
+}
+
+static void RadixNode_free(RadixNode* node, void (*release)(void*))
+{
+    if (!node) { return; }
+    RadixNode_free(node->child[0], release);
+    RadixNode_free(node->child[1], release);
+    if (node->value && release) { release(node->value); }
+    free(node);
+}
+
+Radix* Radix_new()
+{
+    return calloc(1, sizeof(Radix));
+}
+
+void Radix_free(Radix** radixp, void (*release)(void*))
+{
+    if (*radixp) {
+        Radix* radix = *radixp;
+        RadixNode_free(radix->root, release);
+        free(radix);
+        *radixp = NULL;
+    }
+}
+
+// returns the value slot for the prefix, creating it if needed
+void** Radix_insert(Radix* radix, const unsigned char key[RADIX_KEY_SIZE],
+                    unsigned int bits)
+{
+    RadixNode** link = &radix->root;
+    while (*link) {
+        RadixNode* node = *link;
+        unsigned int max = bits < node->bits ? bits : node->bits;
+        unsigned int common = keyCommon(key, node->key, max);
+
+        if (common < node->bits) {
+            RadixNode* split = RadixNode_new(key, common);
+            if (!split) { return NULL; }
+
+            split->child[keyBit(node->key, common)] = node;
+            if (common == bits) {
+                *link = split;
+                radix->count++;
+                return &split->value;
+            }
+
+            RadixNode* leaf = RadixNode_new(key, bits);
+            if (!leaf) {
+                free(split);
+                return NULL;
+            }
+
+            split->child[keyBit(key, common)] = leaf;
+            *link = split;
+            radix->count++;
+            return &leaf->value;
+        }
+
+        if (node->bits == bits) { return &node->value; }
+        link = &node->child[keyBit(key, node->bits)];
+    }
+
+    *link = RadixNode_new(key, bits);
+    if (!*link) { return NULL; }
+
+    radix->count++;
+    return &(*link)->value;
+}
+
+// longest prefix match, only considering values accept() agrees to
+void* Radix_match(const Radix* radix, const unsigned char key[RADIX_KEY_SIZE],
+                  bool (*accept)(void* value, void* arg), void* arg)
+{
+    void* best = NULL;
+    const RadixNode* node = radix->root;
+    while (node) {
+        if (keyCommon(key, node->key, node->bits) < node->bits) { break; }
+
+        if (node->value && (!accept || accept(node->value, arg))) {
+            best = node->value;
+        }
+
+        if (node->bits >= RADIX_KEY_BITS) { break; }
+        node = node->child[keyBit(key, node->bits)];
+    }
+    return best;
+}
+
+bool radixKeyFromSockaddr(const struct sockaddr_any* addr,
+                          unsigned char key[RADIX_KEY_SIZE])
+{
+    switch (addr->san_family) {
+        case AF_INET :
+            memset(key, 0, 10);
+            key[10] = 0xff;
+            key[11] = 0xff;
+            memcpy(key + 12, &addr->s4.sin_addr, 4);
+            return true;
+        case AF_INET6 :
+            memcpy(key, &addr->s6.sin6_addr, RADIX_KEY_SIZE);
+            return true;
+        default :
+            errno = EAFNOSUPPORT;
+            return false;
+    }
+}
+
+bool radixKeyFromCIDR(const char* cidr, unsigned char key[RADIX_KEY_SIZE],
+                      unsigned int* bits)
+{
+    char ip[INET6_ADDRSTRLEN];
+    const char* slash = strchr(cidr, '/');
+    size_t len = slash ? (size_t)(slash - cidr) : strlen(cidr);
+    if (len >= sizeof(ip)) { return false; }
+
+    memcpy(ip, cidr, len);
+    ip[len] = '\0';
+
+    struct sockaddr_any addr;
+    if (!ipPortToSockaddr(ip, 0, &addr)) { return false; }
+
+    unsigned int max = addr.san_family == AF_INET ? 32 : 128;
+    if (slash) {
+        int prefix;
+        if (slash[1] == '\0' || !strToInt(slash + 1, &prefix) || prefix < 0 ||
+            (unsigned int) prefix > max) {
+            return false;
+        }
+        *bits = prefix;
+    }
+    else {
+        *bits = max;
+    }
+
+    if (addr.san_family == AF_INET) { *bits += 96; }
+
+    radixKeyFromSockaddr(&addr, key);
+    keyMask(key, *bits);
+    return true;
+}
@@ -0,0 +1,55 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_RADIX_H
+#define EBBNC_RADIX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "misc.h"
+
+#define RADIX_KEY_SIZE  16
+#define RADIX_KEY_BITS  (RADIX_KEY_SIZE * 8)
+
+// path compressed binary trie over 128 bit keys, ipv4 addresses are
+// stored ipv4 mapped (::ffff:0:0/96) so both families share one trie
+
+typedef struct RadixNode {
+    unsigned char       key[RADIX_KEY_SIZE];
+    unsigned int        bits;
+    void*               value;
+    struct RadixNode*   child[2];
+} RadixNode;
+
+typedef struct {
+    RadixNode*  root;
+    size_t      count;
+} Radix;
+
+Radix* Radix_new();
+void Radix_free(Radix** radixp, void (*release)(void*));
+void** Radix_insert(Radix* radix, const unsigned char key[RADIX_KEY_SIZE],
+                    unsigned int bits);
+void* Radix_match(const Radix* radix, const unsigned char key[RADIX_KEY_SIZE],
+                  bool (*accept)(void* value, void* arg), void* arg);
+
+bool radixKeyFromSockaddr(const struct sockaddr_any* addr,
+                          unsigned char key[RADIX_KEY_SIZE]);
+bool radixKeyFromCIDR(const char* cidr, unsigned char key[RADIX_KEY_SIZE],
+                      unsigned int* bits);
+
+#endif
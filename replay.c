@@ -0,0 +1,546 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "coro.h"
+#include "stats.h"
+#include "misc.h"
+
+// plays a capture back through a bouncer, each session as a client
+// coroutine connecting to the bouncer and an origin coroutine on the
+// connection the bouncer makes to us. the client's first line names its
+// session to the origin, after that each side sends its chunks at their
+// captured times, divided by the speed, and reads whatever arrives,
+// timing how late each of the other side's chunks completes.
+
+#define REPLAY_DRAIN_MS     10000
+#define REPLAY_LINE_SIZE    2048
+#define REPLAY_READ_SIZE    16384
+#define REPLAY_FILLER_SIZE  65536
+#define REPLAY_TOKEN        "REPLAY "
+
+typedef struct {
+    CaptureRecord       record;
+    const char*         payload;
+    unsigned long       index;              // order in the file
+} ReplayRecord;
+
+typedef struct {
+    ReplayRecord*       records;
+    unsigned int        count;
+    uint64_t            openUs;
+    uint64_t            bytes[3];           // by direction
+} ReplaySession;
+
+typedef struct {
+    int                 sock;
+    const ReplaySession* session;
+    unsigned int        dir;                // what this side sends
+    long                startUs;
+    uint64_t            received;
+    uint64_t            completed;          // bytes of the other side's chunks timed
+    unsigned int        lagNext;
+    bool                closed;
+} ReplaySide;
+
+static ReplaySession* sessions = NULL;
+static unsigned int sessionCount = 0;
+static double speed = 1;
+static struct sockaddr_any bouncerAddr;
+static char filler[REPLAY_FILLER_SIZE];
+
+static unsigned int running = 0;
+static unsigned int clientsOkay = 0;
+static unsigned int clientsFailed = 0;
+static unsigned int originsOkay = 0;
+static unsigned int originsFailed = 0;
+static uint64_t bytesSent[3];
+static StatsHistogram lagUs;
+
+static int Replay_compareRecords(const void* a, const void* b)
+{
+    const ReplayRecord* ra = a;
+    const ReplayRecord* rb = b;
+    if (ra->record.session != rb->record.session) {
+        return ra->record.session < rb->record.session ? -1 : 1;
+    }
+    return ra->index < rb->index ? -1 : ra->index > rb->index ? 1 : 0;
+}
+
+static int Replay_compareSessions(const void* a, const void* b)
+{
+    const ReplaySession* sa = a;
+    const ReplaySession* sb = b;
+    return sa->openUs < sb->openUs ? -1 : sa->openUs > sb->openUs ? 1 : 0;
+}
+
+// the whole trace stays in memory, records point into it for payloads
+static bool Replay_load(const char* path, unsigned int limit)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0) {
+        perror("fstat");
+        fclose(fp);
+        return false;
+    }
+
+    char* data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (!data) {
+        perror("malloc");
+        fclose(fp);
+        return false;
+    }
+
+    size_t size = fread(data, 1, st.st_size, fp);
+    fclose(fp);
+
+    CaptureHeader header;
+    if (size < sizeof(header)) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+        header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a capture file or the wrong version\n", path);
+        return false;
+    }
+
+    unsigned long count = 0;
+    size_t offset;
+    for (offset = sizeof(header); offset + sizeof(CaptureRecord) <= size; ++count) {
+        CaptureRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record) + record.payloadLen;
+    }
+
+    ReplayRecord* records = calloc(count > 0 ? count : 1, sizeof(ReplayRecord));
+    if (!records) {
+        perror("calloc");
+        return false;
+    }
+
+    // a record cut short at the end is dropped
+    unsigned long i = 0;
+    for (offset = sizeof(header); i < count; ++i) {
+        memcpy(&records[i].record, data + offset, sizeof(CaptureRecord));
+        offset += sizeof(CaptureRecord);
+        if (offset + records[i].record.payloadLen > size) { break; }
+        records[i].payload = records[i].record.payloadLen > 0 ? data + offset : NULL;
+        records[i].index = i;
+        offset += records[i].record.payloadLen;
+    }
+    count = i;
+
+    qsort(records, count, sizeof(records[0]), Replay_compareRecords);
+
+    for (i = 0; i < count; ++i) {
+        if (i == 0 || records[i].record.session != records[i - 1].record.session) {
+            ++sessionCount;
+        }
+    }
+
+    sessions = calloc(sessionCount > 0 ? sessionCount : 1, sizeof(ReplaySession));
+    if (!sessions) {
+        perror("calloc");
+        return false;
+    }
+
+    ReplaySession* session = NULL;
+    for (i = 0; i < count; ++i) {
+        if (i == 0 || records[i].record.session != records[i - 1].record.session) {
+            session = session ? session + 1 : sessions;
+            session->records = &records[i];
+            session->openUs = records[i].record.us;
+        }
+        if (records[i].record.type == CAPTURE_DATA && records[i].record.dir <= CAPTURE_SERVER) {
+            session->bytes[records[i].record.dir] += records[i].record.len;
+        }
+        session->count++;
+    }
+
+    qsort(sessions, sessionCount, sizeof(sessions[0]), Replay_compareSessions);
+    if (limit > 0 && limit < sessionCount) { sessionCount = limit; }
+    return true;
+}
+
+static long Replay_dueUs(const ReplaySide* side, const ReplayRecord* record)
+{
+    return side->startUs + (long)((record->record.us - side->session->openUs) / speed);
+}
+
+// times each of the other side's chunks that has now arrived in full
+static void ReplaySide_lag(ReplaySide* side)
+{
+    long now = monotonicUs();
+    const ReplaySession* session = side->session;
+    while (side->lagNext < session->count) {
+        const ReplayRecord* record = &session->records[side->lagNext];
+        if (record->record.type != CAPTURE_DATA || record->record.dir == side->dir) {
+            side->lagNext++;
+            continue;
+        }
+
+        if (side->received < side->completed + record->record.len) { break; }
+
+        side->completed += record->record.len;
+        long late = now - Replay_dueUs(side, record);
+        StatsHistogram_add(&lagUs, late > 0 ? late : 0);
+        side->lagNext++;
+    }
+}
+
+// reads until untilUs, the peer closes, or with enough set until that
+// much has arrived, false on an error
+static bool ReplaySide_wait(ReplaySide* side, long untilUs, uint64_t enough)
+{
+    char buf[REPLAY_READ_SIZE];
+    while (!side->closed && (enough == 0 || side->received < enough)) {
+        long now = monotonicUs();
+        if (now >= untilUs) { break; }
+
+        struct pollfd pfd = { side->sock, POLLIN, 0 };
+        long ms = (untilUs - now + 999) / 1000;
+        if (Coro_poll(&pfd, 1, ms > INT_MAX ? INT_MAX : ms) < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        if (!pfd.revents) { continue; }
+
+        ssize_t len = Coro_read(side->sock, buf, sizeof(buf));
+        if (len < 0 && errno == EAGAIN) { continue; }
+        if (len < 0) { return false; }
+        if (len == 0) {
+            side->closed = true;
+            break;
+        }
+
+        side->received += len;
+        ReplaySide_lag(side);
+    }
+
+    return true;
+}
+
+static bool ReplaySide_send(ReplaySide* side, const ReplayRecord* record)
+{
+    size_t left = record->record.len;
+    while (left > 0) {
+        const char* buf = record->payload ? record->payload : filler;
+        size_t len = record->payload || left < sizeof(filler) ? left : sizeof(filler);
+        if (Coro_write(side->sock, buf, len) != (ssize_t) len) { return false; }
+        left -= len;
+    }
+
+    __atomic_add_fetch(&bytesSent[side->dir], record->record.len, __ATOMIC_RELAXED);
+    return true;
+}
+
+// this side's chunks on time, then the close as captured, the side that
+// closed waits for what is still owed to it first, the other for the
+// close, a session closed by neither is closed by the client
+static bool ReplaySide_run(ReplaySide* side)
+{
+    const ReplaySession* session = side->session;
+    unsigned int other = side->dir == CAPTURE_CLIENT ? CAPTURE_SERVER : CAPTURE_CLIENT;
+    long lastUs = side->startUs;
+    bool closer = side->dir == CAPTURE_CLIENT;
+
+    unsigned int i;
+    for (i = 0; i < session->count; ++i) {
+        const ReplayRecord* record = &session->records[i];
+        lastUs = Replay_dueUs(side, record);
+
+        if (record->record.type == CAPTURE_DATA && record->record.dir == side->dir) {
+            if (!ReplaySide_wait(side, lastUs, 0)) { return false; }
+            if (side->closed) { break; }
+            if (!ReplaySide_send(side, record)) { return false; }
+        }
+        else if (record->record.type == CAPTURE_CLOSE) {
+            closer = record->record.dir == side->dir ||
+                     (record->record.dir == 0 && side->dir == CAPTURE_CLIENT);
+            break;
+        }
+    }
+
+    long drainUs = lastUs + REPLAY_DRAIN_MS * 1000L;
+    if (closer) {
+        if (!ReplaySide_wait(side, lastUs, 0) ||
+            !ReplaySide_wait(side, drainUs, session->bytes[other])) {
+            return false;
+        }
+    }
+    else if (!ReplaySide_wait(side, drainUs, 0) || !side->closed) {
+        return false;
+    }
+
+    return side->received >= session->bytes[other];
+}
+
+static void Replay_finish(ReplaySide* side, bool okay)
+{
+    if (side->sock >= 0) { close(side->sock); }
+
+    if (side->dir == CAPTURE_CLIENT) {
+        __atomic_add_fetch(okay ? &clientsOkay : &clientsFailed, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+    }
+    else {
+        __atomic_add_fetch(okay ? &originsOkay : &originsFailed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* Replay_client(void* sessionv)
+{
+    ReplaySide side;
+    memset(&side, 0, sizeof(side));
+    side.session = sessionv;
+    side.dir = CAPTURE_CLIENT;
+
+    side.sock = socket(bouncerAddr.san_family, SOCK_STREAM, 0);
+    bool okay = side.sock >= 0 &&
+                Coro_connect(side.sock, &bouncerAddr.sa, sockaddrLen(&bouncerAddr)) == 0;
+
+    if (okay) {
+        char token[64];
+        int len = snprintf(token, sizeof(token), REPLAY_TOKEN "%u\r\n",
+                           (unsigned int)(side.session - sessions));
+        okay = Coro_write(side.sock, token, len) == len;
+    }
+
+    side.startUs = monotonicUs();
+    okay = okay && ReplaySide_run(&side);
+    Replay_finish(&side, okay);
+    return NULL;
+}
+
+// lines before the token are the bouncer's idnt, bytes after it are the
+// client's first chunks
+static bool Replay_readToken(ReplaySide* side)
+{
+    char line[REPLAY_LINE_SIZE];
+    size_t len = 0;
+    while (true) {
+        if (len == sizeof(line)) { return false; }
+        ssize_t ret = Coro_read(side->sock, line + len, sizeof(line) - len);
+        if (ret < 0 && errno == EAGAIN) { continue; }
+        if (ret <= 0) { return false; }
+        len += ret;
+
+        char* nl;
+        while ((nl = memchr(line, '\n', len))) {
+            size_t lineLen = nl + 1 - line;
+            if (!strncmp(line, REPLAY_TOKEN, strlen(REPLAY_TOKEN))) {
+                unsigned int index;
+                if (sscanf(line + strlen(REPLAY_TOKEN), "%u", &index) != 1 ||
+                    index >= sessionCount) {
+                    return false;
+                }
+
+                side->session = &sessions[index];
+                side->received = len - lineLen;
+                return true;
+            }
+
+            memmove(line, line + lineLen, len - lineLen);
+            len -= lineLen;
+        }
+    }
+}
+
+static void* Replay_origin(void* sockv)
+{
+    ReplaySide side;
+    memset(&side, 0, sizeof(side));
+    side.sock = (intptr_t) sockv;
+    side.dir = CAPTURE_SERVER;
+
+    bool okay = Replay_readToken(&side);
+    side.startUs = monotonicUs();
+    if (okay) { ReplaySide_lag(&side); }
+    okay = okay && ReplaySide_run(&side);
+    Replay_finish(&side, okay);
+    return NULL;
+}
+
+static void* Replay_accept(void* sockv)
+{
+    int sock = (intptr_t) sockv;
+    while (true) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) { perror("accept"); }
+            continue;
+        }
+
+        if (!Coro_spawn(Replay_origin, (void*)(intptr_t) conn)) {
+            perror("Coro_spawn");
+            close(conn);
+        }
+    }
+
+    return NULL;
+}
+
+static bool Replay_parseAddr(const char* ipPort, struct sockaddr_any* addr)
+{
+    const char* colon = strrchr(ipPort, ':');
+    if (!colon || colon == ipPort) { return false; }
+
+    long port;
+    if (!strToLong(colon + 1, &port) || !isValidPort(port)) { return false; }
+
+    char ip[INET6_ADDRSTRLEN];
+    if ((size_t)(colon - ipPort) >= sizeof(ip)) { return false; }
+    memcpy(ip, ipPort, colon - ipPort);
+    ip[colon - ipPort] = '\0';
+    return ipPortToSockaddr(ip, port, addr);
+}
+
+static int Replay_listen(const struct sockaddr_any* addr)
+{
+    int sock = socket(addr->san_family, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int optval = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (bind(sock, &addr->sa, sockaddrLen(addr)) < 0 || listen(sock, SOMAXCONN) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static void Replay_usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-s speed] [-n sessions] <capture> <bouncer ip:port> "
+            "<origin ip:port>\n", argv0);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int limit = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        switch (opt) {
+            case 's' :
+                speed = atof(optarg);
+                if (speed <= 0) {
+                    Replay_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'n' :
+                limit = atoi(optarg);
+                break;
+            default :
+                Replay_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 3) {
+        Replay_usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_any originAddr;
+    if (!Replay_parseAddr(argv[optind + 1], &bouncerAddr) ||
+        !Replay_parseAddr(argv[optind + 2], &originAddr)) {
+        fprintf(stderr, "Addresses are ip:port.\n");
+        return 1;
+    }
+
+    if (!Replay_load(argv[optind], limit)) { return 1; }
+    printf("Loaded %u sessions ..\n", sessionCount);
+
+    size_t i;
+    for (i = 0; i < sizeof(filler); ++i) {
+        filler[i] = i % 64 == 62 ? '\r' : i % 64 == 63 ? '\n' : 'x';
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!Coro_startAll()) { return 1; }
+
+    int sock = Replay_listen(&originAddr);
+    if (sock < 0) { return 1; }
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, Replay_accept, (void*)(intptr_t) sock);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return 1;
+    }
+
+    // sessions start at their captured times, divided by the speed
+    long startUs = monotonicUs();
+    unsigned int s;
+    for (s = 0; s < sessionCount; ++s) {
+        long dueUs = startUs + (long)((sessions[s].openUs - sessions[0].openUs) / speed);
+        long now = monotonicUs();
+        if (dueUs > now) { usleep(dueUs - now); }
+
+        __atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
+        if (!Coro_spawn(Replay_client, &sessions[s])) {
+            perror("Coro_spawn");
+            __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+            ++clientsFailed;
+        }
+    }
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0) { usleep(100000); }
+    // the origins see the client's close a moment later
+    usleep(100000);
+
+    long elapsedUs = monotonicUs() - startUs;
+    printf("Replayed %u sessions in %.1fs at %gx: clients %u ok %u failed, "
+           "origins %u ok %u failed\n", sessionCount, elapsedUs / 1000000.0, speed,
+           clientsOkay, clientsFailed, originsOkay, originsFailed);
+    printf("Sent %.1f KB client to server, %.1f KB server to client\n",
+           bytesSent[CAPTURE_CLIENT] / 1024.0, bytesSent[CAPTURE_SERVER] / 1024.0);
+    printf("Chunk lag ms: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f over %llu chunks\n",
+           StatsHistogram_percentile(&lagUs, 50) / 1000.0,
+           StatsHistogram_percentile(&lagUs, 90) / 1000.0,
+           StatsHistogram_percentile(&lagUs, 99) / 1000.0,
+           StatsHistogram_percentile(&lagUs, 99.9) / 1000.0,
+           (unsigned long long) lagUs.count);
+
+    return clientsFailed > 0 || originsFailed > 0 ? 2 : 0;
+}
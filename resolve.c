@@ -0,0 +1,652 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include "resolve.h"
+#include "coro.h"
+
+#define RESOLVE_PORT            53
+#define RESOLVE_MAX_SERVERS     3
+#define RESOLVE_MAX_SEARCH      6
+#define RESOLVE_PACKET_SIZE     1232
+#define RESOLVE_CACHE_SETS      256
+#define RESOLVE_CACHE_WAYS      4
+#define RESOLVE_NEGATIVE_TTL    60
+#define RESOLVE_MAX_TTL         3600
+#define RESOLVE_PENDING_MS      10
+
+#define RESOLVE_TYPE_A          1
+#define RESOLVE_TYPE_PTR        12
+#define RESOLVE_TYPE_AAAA       28
+
+typedef struct
+{
+    struct sockaddr_any addr;
+    char                name[RESOLVE_NAME_LEN];
+} ResolveHost;
+
+// one cached answer, pending while the session that claimed it is asking
+typedef struct
+{
+    char                key[RESOLVE_NAME_LEN];
+    unsigned char       type;
+    bool                pending;
+    bool                found;
+    long                expiresUs;
+    struct sockaddr_any addr;
+    char                name[RESOLVE_NAME_LEN];
+} ResolveEntry;
+
+static struct sockaddr_any servers[RESOLVE_MAX_SERVERS];
+static unsigned int serverCount = 0;
+static char search[RESOLVE_MAX_SEARCH][RESOLVE_NAME_LEN];
+static unsigned int searchCount = 0;
+static int ndots = 1;
+static int timeoutMs = 5000;
+static int attempts = 2;
+static ResolveHost* hosts = NULL;
+static size_t hostCount = 0;
+
+static ResolveEntry cache[RESOLVE_CACHE_SETS][RESOLVE_CACHE_WAYS];
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cacheCond = PTHREAD_COND_INITIALIZER;
+
+static void Resolve_addServer(const char* ip)
+{
+    if (serverCount < RESOLVE_MAX_SERVERS &&
+        ipPortToSockaddr(ip, RESOLVE_PORT, &servers[serverCount])) {
+        serverCount++;
+    }
+}
+
+static void Resolve_addSearch(char* list)
+{
+    char* save;
+    char* domain;
+    for (domain = strtok_r(list, " \t", &save); domain && searchCount < RESOLVE_MAX_SEARCH;
+         domain = strtok_r(NULL, " \t", &save)) {
+        snprintf(search[searchCount++], RESOLVE_NAME_LEN, "%s", domain);
+    }
+}
+
+static void Resolve_setOptions(char* list)
+{
+    char* save;
+    char* option;
+    for (option = strtok_r(list, " \t", &save); option; option = strtok_r(NULL, " \t", &save)) {
+        int value;
+        if (!strncmp(option, "ndots:", 6) && strToInt(option + 6, &value) && value >= 0) {
+            ndots = value;
+        }
+        else if (!strncmp(option, "timeout:", 8) && strToInt(option + 8, &value) && value > 0) {
+            timeoutMs = value * 1000;
+        }
+        else if (!strncmp(option, "attempts:", 9) && strToInt(option + 9, &value) && value > 0) {
+            attempts = value;
+        }
+    }
+}
+
+static bool Resolve_loadConf(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) { return false; }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#;\r\n")] = '\0';
+        char* value = line + strcspn(line, " \t");
+        if (*value != '\0') { *value++ = '\0'; }
+        value += strspn(value, " \t");
+
+        if (!strcmp(line, "nameserver")) {
+            value[strcspn(value, " \t")] = '\0';
+            Resolve_addServer(value);
+        }
+        else if (!strcmp(line, "search")) {
+            searchCount = 0;
+            Resolve_addSearch(value);
+        }
+        else if (!strcmp(line, "domain")) {
+            searchCount = 0;
+            value[strcspn(value, " \t")] = '\0';
+            Resolve_addSearch(value);
+        }
+        else if (!strcmp(line, "options")) {
+            Resolve_setOptions(value);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+static void Resolve_loadHosts(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) { return; }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char* save;
+        char* ip = strtok_r(line, " \t", &save);
+        struct sockaddr_any addr;
+        if (!ip || !ipPortToSockaddr(ip, 0, &addr)) { continue; }
+
+        char* name;
+        while ((name = strtok_r(NULL, " \t", &save))) {
+            ResolveHost* temp = realloc(hosts, (hostCount + 1) * sizeof(ResolveHost));
+            if (!temp) { break; }
+            hosts = temp;
+            hosts[hostCount].addr = addr;
+            snprintf(hosts[hostCount].name, RESOLVE_NAME_LEN, "%s", name);
+            hostCount++;
+        }
+    }
+
+    fclose(fp);
+}
+
+bool Resolve_init(const char* resolvConf)
+{
+    serverCount = 0;
+    searchCount = 0;
+    free(hosts);
+    hosts = NULL;
+    hostCount = 0;
+
+    if (!Resolve_loadConf(resolvConf ? resolvConf : RESOLVE_CONF) && resolvConf) {
+        perror(resolvConf);
+        return false;
+    }
+
+    // the same fallback libc uses when resolv.conf names no servers
+    if (serverCount == 0) { Resolve_addServer("127.0.0.1"); }
+
+    Resolve_loadHosts(RESOLVE_HOSTS);
+    return true;
+}
+
+static unsigned int Resolve_hash(unsigned char type, const char* key)
+{
+    unsigned int hash = 2166136261u ^ type;
+    for (; *key; ++key) {
+        hash = (hash ^ (unsigned char) tolower(*key)) * 16777619u;
+    }
+    return hash % RESOLVE_CACHE_SETS;
+}
+
+static ResolveEntry* Resolve_find(unsigned char type, const char* key)
+{
+    ResolveEntry* set = cache[Resolve_hash(type, key)];
+    unsigned int i;
+    for (i = 0; i < RESOLVE_CACHE_WAYS; ++i) {
+        if (set[i].type == type && !strcasecmp(set[i].key, key)) { return &set[i]; }
+    }
+    return NULL;
+}
+
+static ResolveEntry* Resolve_evict(unsigned char type, const char* key)
+{
+    ResolveEntry* set = cache[Resolve_hash(type, key)];
+    ResolveEntry* victim = NULL;
+    unsigned int i;
+    for (i = 0; i < RESOLVE_CACHE_WAYS; ++i) {
+        if (!set[i].pending && (!victim || set[i].expiresUs < victim->expiresUs)) {
+            victim = &set[i];
+        }
+    }
+
+    if (victim) {
+        snprintf(victim->key, sizeof(victim->key), "%s", key);
+        victim->type = type;
+        victim->expiresUs = 0;
+    }
+    return victim;
+}
+
+// true with the answer if it is cached, otherwise the caller has to ask,
+// waiting first for an identical query another session has in flight
+static bool Resolve_cached(unsigned char type, const char* key, ResolveEntry* answer)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (long) timeoutMs * attempts * serverCount / 1000 + 1;
+
+    pthread_mutex_lock(&cacheMutex);
+    ResolveEntry* entry;
+    while ((entry = Resolve_find(type, key)) && entry->pending) {
+        if (Coro_active()) {
+            // a coroutine must not hold up its engine on the condvar
+            pthread_mutex_unlock(&cacheMutex);
+            Coro_sleep(RESOLVE_PENDING_MS);
+            pthread_mutex_lock(&cacheMutex);
+
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (now.tv_sec > until.tv_sec) { break; }
+        }
+        else if (pthread_cond_timedwait(&cacheCond, &cacheMutex, &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (entry && !entry->pending && entry->expiresUs > monotonicUs()) {
+        *answer = *entry;
+        pthread_mutex_unlock(&cacheMutex);
+        return true;
+    }
+
+    if (!entry || !entry->pending) {
+        entry = entry ? entry : Resolve_evict(type, key);
+        if (entry) { entry->pending = true; }
+    }
+    pthread_mutex_unlock(&cacheMutex);
+    return false;
+}
+
+static void Resolve_store(unsigned char type, const char* key, const ResolveEntry* answer,
+                          long ttl, bool cacheable)
+{
+    pthread_mutex_lock(&cacheMutex);
+    ResolveEntry* entry = Resolve_find(type, key);
+    if (!entry && cacheable) { entry = Resolve_evict(type, key); }
+    if (entry) {
+        entry->pending = false;
+        entry->found = answer->found;
+        entry->addr = answer->addr;
+        memcpy(entry->name, answer->name, sizeof(entry->name));
+        entry->expiresUs = cacheable ? monotonicUs() + ttl * 1000000L : 0;
+    }
+    pthread_cond_broadcast(&cacheCond);
+    pthread_mutex_unlock(&cacheMutex);
+}
+
+static size_t Resolve_encode(const char* name, unsigned char* buf, size_t size)
+{
+    size_t len = 0;
+    while (*name) {
+        size_t label = strcspn(name, ".");
+        if (label == 0 || label > 63 || len + label + 2 > size) { return 0; }
+        buf[len++] = label;
+        memcpy(buf + len, name, label);
+        len += label;
+        name += label;
+        if (*name == '.') { ++name; }
+    }
+    if (len + 1 > size) { return 0; }
+    buf[len++] = 0;
+    return len;
+}
+
+// expands a possibly compressed name at *pos, out may be NULL to skip it
+static bool Resolve_expand(const unsigned char* msg, size_t msgLen, size_t* pos,
+                           char* out, size_t outLen)
+{
+    size_t at = *pos;
+    size_t written = 0;
+    bool jumped = false;
+    unsigned int hops = 0;
+
+    while (at < msgLen) {
+        unsigned char label = msg[at];
+        if (label == 0) {
+            if (!jumped) { *pos = at + 1; }
+            if (out) { out[written] = '\0'; }
+            return true;
+        }
+
+        if ((label & 0xc0) == 0xc0) {
+            if (at + 1 >= msgLen || ++hops > 32) { return false; }
+            if (!jumped) { *pos = at + 2; }
+            jumped = true;
+            at = ((label & 0x3f) << 8) | msg[at + 1];
+            continue;
+        }
+
+        if (label > 63 || at + 1 + label > msgLen) { return false; }
+        if (out) {
+            if (written + label + 2 > outLen) { return false; }
+            if (written > 0) { out[written++] = '.'; }
+            memcpy(out + written, msg + at + 1, label);
+            written += label;
+        }
+        at += 1 + label;
+    }
+    return false;
+}
+
+// names end up in the idnt line, so only what a hostname may contain
+static bool Resolve_validName(const char* name)
+{
+    if (*name == '\0') { return false; }
+    for (; *name; ++name) {
+        if (!isalnum((unsigned char) *name) && !strchr("-_.", *name)) { return false; }
+    }
+    return true;
+}
+
+static unsigned short Resolve_id()
+{
+    unsigned short id;
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id)) {
+        id = monotonicUs() ^ (long) pthread_self();
+    }
+    return id;
+}
+
+// the only place a query blocks, so it is where an event loop takes over
+static bool Resolve_wait(int sock, long deadlineUs)
+{
+    long remainingMs;
+    while ((remainingMs = (deadlineUs - monotonicUs()) / 1000) > 0) {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        int ret = Coro_poll(&pfd, 1, remainingMs);
+        if (ret > 0) { return true; }
+        if (ret == 0 || errno != EINTR) { return false; }
+    }
+    return false;
+}
+
+// 1 with the record in answer, 0 if the name has no such record and -1
+// if no server gave an answer. a truncated reply without the record isn't
+// proof there is none, so the next server gets asked.
+static int Resolve_parse(const unsigned char* msg, size_t len, size_t pos,
+                         unsigned int qtype, ResolveEntry* answer, long* ttl)
+{
+    unsigned int rcode = msg[3] & 0x0f;
+    bool truncated = msg[2] & 0x02;
+    if (rcode == 3) {
+        *ttl = RESOLVE_NEGATIVE_TTL;
+        return 0;
+    }
+    if (rcode != 0) { return -1; }
+
+    unsigned int count = (msg[6] << 8) | msg[7];
+    while (count-- > 0) {
+        if (!Resolve_expand(msg, len, &pos, NULL, 0) || pos + 10 > len) { return -1; }
+
+        unsigned int type = (msg[pos] << 8) | msg[pos + 1];
+        long recordTtl = ((long) msg[pos + 4] << 24) | (msg[pos + 5] << 16) |
+                         (msg[pos + 6] << 8) | msg[pos + 7];
+        size_t rdLen = (msg[pos + 8] << 8) | msg[pos + 9];
+        pos += 10;
+        if (pos + rdLen > len) { return -1; }
+
+        // a cname chain expires with its shortest link
+        if (recordTtl < *ttl) { *ttl = recordTtl; }
+
+        if (type == qtype) {
+            if (type == RESOLVE_TYPE_A && rdLen == 4) {
+                answer->addr.san_family = AF_INET;
+                memcpy(&answer->addr.s4.sin_addr, msg + pos, 4);
+                return 1;
+            }
+            if (type == RESOLVE_TYPE_AAAA && rdLen == 16) {
+                answer->addr.san_family = AF_INET6;
+                memcpy(&answer->addr.s6.sin6_addr, msg + pos, 16);
+                return 1;
+            }
+            if (type == RESOLVE_TYPE_PTR) {
+                size_t at = pos;
+                if (Resolve_expand(msg, len, &at, answer->name, sizeof(answer->name)) &&
+                    Resolve_validName(answer->name)) {
+                    return 1;
+                }
+            }
+        }
+        pos += rdLen;
+    }
+
+    if (truncated) { return -1; }
+    *ttl = RESOLVE_NEGATIVE_TTL;
+    return 0;
+}
+
+// asks each server in turn, attempts times round, for one record
+static int Resolve_ask(const char* qname, unsigned int qtype, ResolveEntry* answer, long* ttl)
+{
+    unsigned char query[RESOLVE_PACKET_SIZE];
+    memset(query, 0, 12);
+    query[2] = 0x01;    // recursion desired
+    query[5] = 1;
+
+    size_t nameLen = Resolve_encode(qname, query + 12, sizeof(query) - 16);
+    if (nameLen == 0) { return 0; }
+    size_t len = 12 + nameLen;
+    query[len++] = qtype >> 8;
+    query[len++] = qtype & 0xff;
+    query[len++] = 0;
+    query[len++] = 1;
+
+    unsigned char reply[RESOLVE_PACKET_SIZE];
+    int result = -1;
+    int attempt;
+    for (attempt = 0; attempt < attempts && result < 0; ++attempt) {
+        unsigned int i;
+        for (i = 0; i < serverCount && result < 0; ++i) {
+            int sock = socket(servers[i].san_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (sock < 0) { continue; }
+
+            unsigned short id = Resolve_id();
+            query[0] = id >> 8;
+            query[1] = id & 0xff;
+
+            long deadlineUs = monotonicUs() + timeoutMs * 1000L;
+            if (connect(sock, &servers[i].sa, sockaddrLen(&servers[i])) < 0 ||
+                send(sock, query, len, 0) != (ssize_t) len) {
+                close(sock);
+                continue;
+            }
+
+            // anything not answering our question is dropped, and the wait goes on
+            while (result < 0 && Resolve_wait(sock, deadlineUs)) {
+                ssize_t ret = recv(sock, reply, sizeof(reply), 0);
+                if (ret < 0 && errno != EAGAIN) { break; }
+                if (ret < (ssize_t) len || memcmp(reply, query, 2) || !(reply[2] & 0x80) ||
+                    reply[4] != 0 || reply[5] != 1 ||
+                    strncasecmp((char*) reply + 12, (char*) query + 12, nameLen) ||
+                    memcmp(reply + 12 + nameLen, query + 12 + nameLen, 4)) {
+                    continue;
+                }
+
+                *ttl = RESOLVE_MAX_TTL;
+                result = Resolve_parse(reply, ret, len, qtype, answer, ttl);
+                break;
+            }
+            close(sock);
+        }
+    }
+
+    return result;
+}
+
+static const ResolveHost* Resolve_hostByName(const char* name)
+{
+    size_t i;
+    for (i = 0; i < hostCount; ++i) {
+        if (!strcasecmp(hosts[i].name, name)) { return &hosts[i]; }
+    }
+    return NULL;
+}
+
+static const ResolveHost* Resolve_hostByAddr(const struct sockaddr_any* addr)
+{
+    size_t i;
+    for (i = 0; i < hostCount; ++i) {
+        const struct sockaddr_any* host = &hosts[i].addr;
+        if (host->san_family != addr->san_family) { continue; }
+        if (addr->san_family == AF_INET &&
+            !memcmp(&host->s4.sin_addr, &addr->s4.sin_addr, 4)) {
+            return &hosts[i];
+        }
+        if (addr->san_family == AF_INET6 &&
+            !memcmp(&host->s6.sin6_addr, &addr->s6.sin6_addr, 16)) {
+            return &hosts[i];
+        }
+    }
+    return NULL;
+}
+
+static void Resolve_setPort(struct sockaddr_any* addr, int port)
+{
+    if (addr->san_family == AF_INET) {
+        addr->s4.sin_port = htons(port);
+    }
+    else {
+        addr->s6.sin6_port = htons(port);
+    }
+}
+
+// tries the name as given and with each search domain, in the order
+// ndots calls for, v4 before v6 for each
+static int Resolve_forward(const char* host, ResolveEntry* answer, long* ttl)
+{
+    size_t hostLen = strlen(host);
+    unsigned int dots = 0;
+    const char* p;
+    for (p = host; *p; ++p) { dots += *p == '.'; }
+
+    bool absolute = hostLen > 0 && host[hostLen - 1] == '.';
+    unsigned int tries = absolute ? 1 : searchCount + 1;
+    unsigned int asIs = absolute || dots >= (unsigned int) ndots ? 0 : searchCount;
+    int result = 0;
+    bool failed = false;
+
+    unsigned int i;
+    for (i = 0; i < tries; ++i) {
+        char qname[RESOLVE_NAME_LEN];
+        if (i == asIs) {
+            snprintf(qname, sizeof(qname), "%.*s", (int) (absolute ? hostLen - 1 : hostLen), host);
+        }
+        else {
+            unsigned int domain = i < asIs ? i : i - 1;
+            snprintf(qname, sizeof(qname), "%s.%s", host, search[domain]);
+        }
+
+        result = Resolve_ask(qname, RESOLVE_TYPE_A, answer, ttl);
+        if (result == 0) { result = Resolve_ask(qname, RESOLVE_TYPE_AAAA, answer, ttl); }
+        if (result > 0) { return 1; }
+        if (result < 0) { failed = true; }
+    }
+
+    return failed ? -1 : 0;
+}
+
+bool Resolve_address(const char* host, int port, struct sockaddr_any* addr, const char** errmsg)
+{
+    // numeric hosts need no resolver at all
+    if (ipPortToSockaddr(host, port, addr)) { return true; }
+
+    const ResolveHost* entry = Resolve_hostByName(host);
+    if (entry) {
+        *addr = entry->addr;
+        Resolve_setPort(addr, port);
+        return true;
+    }
+
+    ResolveEntry answer;
+    if (!Resolve_cached(RESOLVE_TYPE_A, host, &answer)) {
+        memset(&answer, 0, sizeof(answer));
+        long ttl = 0;
+        int result = Resolve_forward(host, &answer, &ttl);
+        answer.found = result > 0;
+        Resolve_store(RESOLVE_TYPE_A, host, &answer, ttl, result >= 0);
+        if (result < 0) {
+            if (errmsg) { *errmsg = gai_strerror(EAI_AGAIN); }
+            return false;
+        }
+    }
+
+    if (!answer.found) {
+        if (errmsg) { *errmsg = gai_strerror(EAI_NONAME); }
+        return false;
+    }
+
+    *addr = answer.addr;
+    Resolve_setPort(addr, port);
+    return true;
+}
+
+static bool Resolve_ptrName(const struct sockaddr_any* addr, char* qname, size_t len)
+{
+    static const unsigned char v4Mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    const unsigned char* ip;
+    if (addr->san_family == AF_INET) {
+        ip = (const unsigned char*) &addr->s4.sin_addr;
+    }
+    else if (addr->san_family == AF_INET6 &&
+             !memcmp(&addr->s6.sin6_addr, v4Mapped, sizeof(v4Mapped))) {
+        ip = (const unsigned char*) &addr->s6.sin6_addr + sizeof(v4Mapped);
+    }
+    else if (addr->san_family == AF_INET6) {
+        ip = (const unsigned char*) &addr->s6.sin6_addr;
+        size_t written = 0;
+        int i;
+        for (i = 15; i >= 0; --i) {
+            written += snprintf(qname + written, len - written, "%x.%x.",
+                                ip[i] & 0x0f, ip[i] >> 4);
+        }
+        snprintf(qname + written, len - written, "ip6.arpa");
+        return true;
+    }
+    else {
+        return false;
+    }
+
+    snprintf(qname, len, "%u.%u.%u.%u.in-addr.arpa", ip[3], ip[2], ip[1], ip[0]);
+    return true;
+}
+
+bool Resolve_name(const struct sockaddr_any* addr, char* name, size_t len)
+{
+    const ResolveHost* entry = Resolve_hostByAddr(addr);
+    if (entry) {
+        snprintf(name, len, "%s", entry->name);
+        return true;
+    }
+
+    char qname[RESOLVE_NAME_LEN];
+    if (!Resolve_ptrName(addr, qname, sizeof(qname))) { return false; }
+
+    ResolveEntry answer;
+    if (!Resolve_cached(RESOLVE_TYPE_PTR, qname, &answer)) {
+        memset(&answer, 0, sizeof(answer));
+        long ttl = 0;
+        int result = Resolve_ask(qname, RESOLVE_TYPE_PTR, &answer, &ttl);
+        answer.found = result > 0;
+        Resolve_store(RESOLVE_TYPE_PTR, qname, &answer, ttl, result >= 0);
+    }
+
+    if (!answer.found) { return false; }
+    snprintf(name, len, "%s", answer.name);
+    return true;
+}
@@ -0,0 +1,33 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_RESOLVE_H
+#define EBBNC_RESOLVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "misc.h"
+
+#define RESOLVE_CONF        "/etc/resolv.conf"
+#define RESOLVE_HOSTS       "/etc/hosts"
+#define RESOLVE_NAME_LEN    256
+
+bool Resolve_init(const char* resolvConf);
+bool Resolve_address(const char* host, int port, struct sockaddr_any* addr, const char** errmsg);
+bool Resolve_name(const struct sockaddr_any* addr, char* name, size_t len);
+
+#endif
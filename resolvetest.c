@@ -0,0 +1,224 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// checks the stub resolver against a fake server on a loopback port. the
+// resolver is included whole so the test can point it at that port and
+// look at what it caches. each name asks the fake server for a different
+// reply, see Fake_reply.
+
+#include <sys/socket.h>
+#include "resolve.c"
+
+#define FAKE_TIMEOUT_MS     200
+
+static int fakeSock = -1;
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static size_t Fake_record(unsigned char* buf, size_t len, unsigned int type, long ttl,
+                          const void* data, size_t dataLen)
+{
+    unsigned char record[] = {
+        0xc0, 12, type >> 8, type & 0xff, 0, 1,
+        ttl >> 24, (ttl >> 16) & 0xff, (ttl >> 8) & 0xff, ttl & 0xff,
+        dataLen >> 8, dataLen & 0xff
+    };
+    memcpy(buf + len, record, sizeof(record));
+    memcpy(buf + len + sizeof(record), data, dataLen);
+    return len + sizeof(record) + dataLen;
+}
+
+// the first label of the question picks the reply
+static ssize_t Fake_reply(const unsigned char* query, size_t queryLen, unsigned char* reply)
+{
+    static const unsigned char addr[4] = { 10, 0, 0, 1 };
+    static const unsigned char target[] = { 1, 'a', 4, 't', 'e', 's', 't', 0 };
+
+    const char* label = (const char*) query + 13;
+    size_t labelLen = query[12];
+    unsigned int qtype = (query[queryLen - 4] << 8) | query[queryLen - 3];
+
+    memcpy(reply, query, queryLen);
+    reply[2] |= 0x80;
+    reply[3] = 0x80;
+    size_t len = queryLen;
+    unsigned int answers = 0;
+
+    if (labelLen == 4 && !memcmp(label, "slow", 4)) {
+        return -1;
+    }
+    else if (labelLen == 2 && !memcmp(label, "nx", 2)) {
+        reply[3] |= 3;
+    }
+    else if (labelLen == 2 && !memcmp(label, "tc", 2)) {
+        reply[2] |= 0x02;
+    }
+    else if (labelLen == 5 && !memcmp(label, "badid", 5)) {
+        reply[0] ^= 0xff;
+        len = Fake_record(reply, len, RESOLVE_TYPE_A, 300, addr, sizeof(addr));
+        answers = 1;
+    }
+    else if (labelLen == 5 && !memcmp(label, "cname", 5)) {
+        len = Fake_record(reply, len, 5, 30, target, sizeof(target));
+        len = Fake_record(reply, len, RESOLVE_TYPE_A, 300, addr, sizeof(addr));
+        answers = 2;
+    }
+    else if (labelLen == 1 && label[0] == 'a' && qtype == RESOLVE_TYPE_A) {
+        len = Fake_record(reply, len, RESOLVE_TYPE_A, 300, addr, sizeof(addr));
+        answers = 1;
+    }
+
+    reply[6] = answers >> 8;
+    reply[7] = answers & 0xff;
+    return len;
+}
+
+static void* Fake_main(void* unused)
+{
+    (void) unused;
+    unsigned char query[RESOLVE_PACKET_SIZE];
+    unsigned char reply[RESOLVE_PACKET_SIZE];
+    while (true) {
+        struct sockaddr_any from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom(fakeSock, query, sizeof(query), 0, &from.sa, &fromLen);
+        if (len < 17) { continue; }
+
+        ssize_t replyLen = Fake_reply(query, len, reply);
+        if (replyLen > 0) { sendto(fakeSock, reply, replyLen, 0, &from.sa, fromLen); }
+    }
+    return NULL;
+}
+
+static bool Fake_start()
+{
+    fakeSock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_any addr;
+    socklen_t len = sizeof(addr);
+    if (fakeSock < 0 || !ipPortToSockaddr("127.0.0.1", 0, &addr) ||
+        bind(fakeSock, &addr.sa, sockaddrLen(&addr)) < 0 ||
+        getsockname(fakeSock, &addr.sa, &len) < 0) {
+        perror("fake server");
+        return false;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, Fake_main, NULL) != 0) { return false; }
+    pthread_detach(thread);
+
+    servers[0] = addr;
+    serverCount = 1;
+    timeoutMs = FAKE_TIMEOUT_MS;
+    attempts = 1;
+    return true;
+}
+
+static int Test_ask(const char* name, unsigned int qtype, ResolveEntry* answer, long* ttl)
+{
+    memset(answer, 0, sizeof(*answer));
+    *ttl = 0;
+    return Resolve_ask(name, qtype, answer, ttl);
+}
+
+static void Test_parse()
+{
+    ResolveEntry answer;
+    long ttl;
+
+    CHECK(Test_ask("a.test", RESOLVE_TYPE_A, &answer, &ttl) == 1);
+    CHECK(answer.addr.san_family == AF_INET);
+    CHECK(!memcmp(&answer.addr.s4.sin_addr, "\x0a\x00\x00\x01", 4));
+    CHECK(ttl == 300);
+
+    // a cname chain expires with its shortest link
+    CHECK(Test_ask("cname.test", RESOLVE_TYPE_A, &answer, &ttl) == 1);
+    CHECK(ttl == 30);
+}
+
+static void Test_negative()
+{
+    ResolveEntry answer;
+    long ttl;
+
+    CHECK(Test_ask("nx.test", RESOLVE_TYPE_A, &answer, &ttl) == 0);
+    CHECK(ttl == RESOLVE_NEGATIVE_TTL);
+
+    CHECK(Test_ask("a.test", RESOLVE_TYPE_AAAA, &answer, &ttl) == 0);
+    CHECK(ttl == RESOLVE_NEGATIVE_TTL);
+
+    // what gets cached for a missing name goes with the negative ttl
+    const char* errmsg = NULL;
+    struct sockaddr_any addr;
+    CHECK(!Resolve_address("nx.test", 21, &addr, &errmsg));
+    CHECK(errmsg && !strcmp(errmsg, gai_strerror(EAI_NONAME)));
+    ResolveEntry* entry = Resolve_find(RESOLVE_TYPE_A, "nx.test");
+    CHECK(entry && !entry->found);
+    CHECK(entry && entry->expiresUs <= monotonicUs() + RESOLVE_NEGATIVE_TTL * 1000000L);
+}
+
+static void Test_truncated()
+{
+    ResolveEntry answer;
+    long ttl;
+    CHECK(Test_ask("tc.test", RESOLVE_TYPE_A, &answer, &ttl) == -1);
+}
+
+static void Test_timeout()
+{
+    ResolveEntry answer;
+    long ttl;
+
+    long startMs = monotonicMs();
+    CHECK(Test_ask("slow.test", RESOLVE_TYPE_A, &answer, &ttl) == -1);
+    CHECK(monotonicMs() - startMs >= FAKE_TIMEOUT_MS - 10);
+
+    // a reply to some other query is dropped and the wait goes on
+    CHECK(Test_ask("badid.test", RESOLVE_TYPE_A, &answer, &ttl) == -1);
+
+    // failures are not cached
+    const char* errmsg = NULL;
+    struct sockaddr_any addr;
+    CHECK(!Resolve_address("slow.test", 21, &addr, &errmsg));
+    CHECK(errmsg && !strcmp(errmsg, gai_strerror(EAI_AGAIN)));
+    ResolveEntry* entry = Resolve_find(RESOLVE_TYPE_A, "slow.test");
+    CHECK(!entry || entry->expiresUs == 0);
+}
+
+int main()
+{
+    if (!Fake_start()) { return 1; }
+
+    Test_parse();
+    Test_negative();
+    Test_truncated();
+    Test_timeout();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d resolver checks failed\n", failures);
+        return 1;
+    }
+    printf("resolver checks passed\n");
+    return 0;
+}
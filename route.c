@@ -0,0 +1,229 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "route.h"
+
+// tables are swapped in whole on reload like the acl, sessions only hold
+// the lock long enough to take a reference
+static pthread_mutex_t routeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void RouteTable_unref(RouteTable* table)
+{
+    if (!table) { return; }
+
+    pthread_mutex_lock(&routeMutex);
+    bool last = --table->refs == 0;
+    pthread_mutex_unlock(&routeMutex);
+
+    if (last) {
+        munmap(table->map, table->size);
+        free(table->upstreams);
+        free(table);
+    }
+}
+
+static RouteTable* RouteTable_map(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open route file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(RouteHeader)) {
+        fprintf(stderr, "Invalid route file: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map route file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    RouteTable* table = calloc(1, sizeof(RouteTable));
+    if (!table) {
+        perror("calloc");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    table->map = map;
+    table->size = st.st_size;
+    table->refs = 1;
+    return table;
+}
+
+static RouteTable* RouteTable_load(const char* path)
+{
+    RouteTable* table = RouteTable_map(path);
+    if (!table) { return NULL; }
+
+    const RouteHeader* header = table->map;
+    size_t size = table->size;
+    size_t rangesEnd = sizeof(RouteHeader) +
+                       (size_t) header->rangeCount * sizeof(RouteRange);
+    size_t offsetsEnd = rangesEnd +
+                        (size_t) header->upstreamCount * sizeof(uint32_t);
+
+    if (memcmp(header->magic, ROUTE_MAGIC, sizeof(header->magic)) ||
+        header->version != ROUTE_VERSION || offsetsEnd > size) {
+        fprintf(stderr, "Invalid route file: %s\n", path);
+        RouteTable_unref(table);
+        return NULL;
+    }
+
+    table->ranges = (const RouteRange*)(header + 1);
+    table->rangeCount = header->rangeCount;
+
+    table->upstreams = calloc(header->upstreamCount + 1, sizeof(Upstream*));
+    if (!table->upstreams) {
+        perror("calloc");
+        RouteTable_unref(table);
+        return NULL;
+    }
+
+    const uint32_t* offsets = (const uint32_t*)((const char*) table->map + rangesEnd);
+    const char* strings = (const char*) table->map + offsetsEnd;
+    size_t stringsSize = size - offsetsEnd;
+    uint32_t i;
+    for (i = 0; i < header->upstreamCount; ++i) {
+        if (offsets[i] >= stringsSize ||
+            !memchr(strings + offsets[i], '\0', stringsSize - offsets[i]) ||
+            !(table->upstreams[i] = Upstream_parse(strings + offsets[i]))) {
+            fprintf(stderr, "Invalid upstream in route file: %s\n", path);
+            RouteTable_unref(table);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < table->rangeCount; ++i) {
+        if (table->ranges[i].upstream >= header->upstreamCount) {
+            fprintf(stderr, "Invalid range in route file: %s\n", path);
+            RouteTable_unref(table);
+            return NULL;
+        }
+    }
+
+    return table;
+}
+
+// maps the route file of every bouncer and makes them active, all tables
+// are left as they were if any one fails
+bool Route_load(Config* config)
+{
+    size_t count = 0;
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        count++;
+    }
+
+    RouteTable** tables = calloc(count + 1, sizeof(RouteTable*));
+    if (!tables) {
+        perror("calloc");
+        return false;
+    }
+
+    bool okay = true;
+    size_t i = 0;
+    for (bouncer = config->bouncers; bouncer && okay; bouncer = bouncer->next, ++i) {
+        if (!bouncer->upstream) {
+            bouncer->upstream = Upstream_get(bouncer->remoteHost, bouncer->remotePort);
+            if (!bouncer->upstream) {
+                perror("Upstream_get");
+                okay = false;
+            }
+        }
+
+        if (okay && bouncer->routeFile) {
+            tables[i] = RouteTable_load(bouncer->routeFile);
+            okay = tables[i] != NULL;
+        }
+    }
+
+    i = 0;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next, ++i) {
+        RouteTable* old = tables[i];
+        if (okay) {
+            pthread_mutex_lock(&routeMutex);
+            old = bouncer->routes;
+            bouncer->routes = tables[i];
+            pthread_mutex_unlock(&routeMutex);
+        }
+        RouteTable_unref(old);
+    }
+
+    free(tables);
+    return okay;
+}
+
+static Upstream* RouteTable_match(const RouteTable* table,
+                                  const unsigned char key[RADIX_KEY_SIZE])
+{
+    // last range starting at or below the key
+    uint32_t lo = 0;
+    uint32_t hi = table->rangeCount;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(table->ranges[mid].lo, key, RADIX_KEY_SIZE) <= 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) { return NULL; }
+
+    const RouteRange* range = &table->ranges[lo - 1];
+    if (memcmp(key, range->hi, RADIX_KEY_SIZE) > 0) { return NULL; }
+
+    return table->upstreams[range->upstream];
+}
+
+// picks the upstream for a client by longest prefix match on its address,
+// falling back to the bouncer's own remote host
+Upstream* Route_select(Bouncer* bouncer, const struct sockaddr_any* addr)
+{
+    pthread_mutex_lock(&routeMutex);
+    RouteTable* table = bouncer->routes;
+    if (table) { table->refs++; }
+    pthread_mutex_unlock(&routeMutex);
+
+    Upstream* upstream = NULL;
+    if (table) {
+        unsigned char key[RADIX_KEY_SIZE];
+        if (radixKeyFromSockaddr(addr, key)) {
+            upstream = RouteTable_match(table, key);
+        }
+        RouteTable_unref(table);
+    }
+
+    return upstream ? upstream : bouncer->upstream;
+}
@@ -0,0 +1,65 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_ROUTE_H
+#define EBBNC_ROUTE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+#include "upstream.h"
+#include "radix.h"
+#include "misc.h"
+
+#define ROUTE_MAGIC     "EBRT"
+#define ROUTE_VERSION   1
+
+// compiled route file as written by makeroute, all integers are in host
+// byte order. the prefixes are flattened into sorted disjoint address
+// ranges so longest prefix match is a binary search over the mapping:
+//
+//   RouteHeader
+//   RouteRange     ranges[rangeCount]
+//   uint32_t       upstreamOffsets[upstreamCount]
+//   char           strings[]           "host:port\0" ...
+
+typedef struct {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    rangeCount;
+    uint32_t    upstreamCount;
+} RouteHeader;
+
+typedef struct {
+    unsigned char   lo[RADIX_KEY_SIZE];
+    unsigned char   hi[RADIX_KEY_SIZE];
+    uint32_t        upstream;
+} RouteRange;
+
+typedef struct RouteTable {
+    void*               map;
+    size_t              size;
+    const RouteRange*   ranges;
+    uint32_t            rangeCount;
+    Upstream**          upstreams;
+    unsigned int        refs;
+} RouteTable;
+
+bool Route_load(Config* config);
+Upstream* Route_select(Bouncer* bouncer, const struct sockaddr_any* addr);
+
+#endif
@@ -0,0 +1,113 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <string.h>
+#include "sched.h"
+
+void Sched_init(Sched* sched, long quantum)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->quantum = quantum;
+}
+
+static void Sched_append(SchedFlow** head, SchedFlow** tail, SchedFlow* flow)
+{
+    flow->next = NULL;
+    if (*tail) { (*tail)->next = flow; }
+    else { *head = flow; }
+    *tail = flow;
+}
+
+static SchedFlow* Sched_unlink(SchedFlow** head, SchedFlow** tail)
+{
+    SchedFlow* flow = *head;
+    *head = flow->next;
+    if (!*head) { *tail = NULL; }
+    flow->next = NULL;
+    return flow;
+}
+
+void Sched_push(Sched* sched, SchedFlow* flow, size_t bytes)
+{
+    flow->pending = bytes;
+    if (flow->listed) { return; }
+
+    flow->listed = true;
+    flow->fresh = true;
+    flow->deficit = sched->quantum;
+    Sched_append(&sched->newHead, &sched->newTail, flow);
+}
+
+// the returned flow's unit is taken off it, NULL when nothing is queued
+SchedFlow* Sched_pop(Sched* sched)
+{
+    while (sched->newHead || sched->oldHead) {
+        bool fresh = sched->newHead != NULL;
+        SchedFlow** head = fresh ? &sched->newHead : &sched->oldHead;
+        SchedFlow** tail = fresh ? &sched->newTail : &sched->oldTail;
+        SchedFlow* flow = *head;
+
+        if (flow->deficit <= 0) {
+            flow->deficit += sched->quantum;
+            flow->fresh = false;
+            Sched_append(&sched->oldHead, &sched->oldTail, Sched_unlink(head, tail));
+            continue;
+        }
+
+        if (flow->pending == 0) {
+            Sched_unlink(head, tail);
+            // a new flow that went idle still owes the backlogged ones a
+            // turn, or alternating sends could keep it on the new list
+            if (fresh && sched->oldHead) {
+                flow->fresh = false;
+                Sched_append(&sched->oldHead, &sched->oldTail, flow);
+            }
+            else {
+                flow->listed = false;
+            }
+            continue;
+        }
+
+        flow->deficit -= flow->pending;
+        flow->pending = 0;
+        return flow;
+    }
+
+    return NULL;
+}
+
+void Sched_remove(Sched* sched, SchedFlow* flow)
+{
+    if (!flow->listed) { return; }
+
+    SchedFlow** head = flow->fresh ? &sched->newHead : &sched->oldHead;
+    SchedFlow** tail = flow->fresh ? &sched->newTail : &sched->oldTail;
+    SchedFlow* prev = NULL;
+    SchedFlow* p = *head;
+    while (p && p != flow) {
+        prev = p;
+        p = p->next;
+    }
+    if (!p) { return; }
+
+    if (prev) { prev->next = flow->next; }
+    else { *head = flow->next; }
+    if (*tail == flow) { *tail = prev; }
+    flow->next = NULL;
+    flow->listed = false;
+    flow->pending = 0;
+}
@@ -0,0 +1,51 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_SCHED_H
+#define EBBNC_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// deficit round robin over flows sharing one writer. a flow that turns up
+// with nothing queued goes on the new list and is served ahead of the
+// flows already backlogged, so a short control reply never waits behind
+// bulk data for more than the frame being written. once a flow has spent
+// its quantum it joins the old list and takes its turn with the rest.
+
+typedef struct SchedFlow {
+    struct SchedFlow*   next;
+    long                deficit;
+    size_t              pending;    // bytes of the queued unit, 0 if none
+    bool                listed;
+    bool                fresh;      // on the new list
+} SchedFlow;
+
+typedef struct {
+    SchedFlow*  newHead;
+    SchedFlow*  newTail;
+    SchedFlow*  oldHead;
+    SchedFlow*  oldTail;
+    long        quantum;
+} Sched;
+
+void Sched_init(Sched* sched, long quantum);
+void Sched_push(Sched* sched, SchedFlow* flow, size_t bytes);
+SchedFlow* Sched_pop(Sched* sched);
+void Sched_remove(Sched* sched, SchedFlow* flow);
+
+#endif
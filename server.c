@@ -22,9 +22,17 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <errno.h>
 #include "misc.h"
 #include "server.h"
 #include "client.h"
+#include "parallel.h"
+#include "acl.h"
+#include "tunnel.h"
+#include "stats.h"
+
+static bool stopping = false;
+static int stopPipe[2] = { -1, -1 };
 
 Server* Server_new()
 {
@@ -91,7 +99,7 @@ bool Server_listen2(Server* server, const char* ip, int port)
     return true;
 }
 
-Server* Server_listen(Config* config, Bouncer* bouncer)
+Server* Server_new2(Config* config, Bouncer* bouncer)
 {
     printf("Bouncing from %s:%li to %s:%li!\n", bouncer->listenIP, bouncer->listenPort,
                                                 bouncer->remoteHost, bouncer->remotePort);
@@ -104,38 +112,73 @@ Server* Server_listen(Config* config, Bouncer* bouncer)
 
     server->config = config;
     server->bouncer = bouncer;
-    if (!Server_listen2(server, bouncer->listenIP, bouncer->listenPort)) {
-        Server_free(&server);
-        return NULL;
-    }
-
     return server;
 }
 
+void Server_listenRun(void* serverv)
+{
+    Server* server = serverv;
+    if (!Server_listen2(server, server->bouncer->listenIP, server->bouncer->listenPort)) {
+        close(server->sock);
+        server->sock = -1;
+    }
+}
+
 Server* Server_listenAll(Config* config)
 {
+    size_t count = 0;
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        count++;
+    }
+
+    Server** array = calloc(count, sizeof(Server*));
+    bool* done = calloc(count, sizeof(bool));
+    if (!array || !done) {
+        perror("calloc");
+        free(array);
+        free(done);
+        return NULL;
+    }
+
     Server* servers = NULL;
-    Bouncer* bouncer = config->bouncers;
-    while (bouncer) {
-        Server* server = Server_listen(config, bouncer);
+    size_t i = 0;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        Server* server = Server_new2(config, bouncer);
         if (!server) {
             Server_freeList(&servers);
+            free(array);
+            free(done);
             return NULL;
         }
 
         server->next = servers;
         servers = server;
+        array[i++] = server;
+    }
 
-        bouncer = bouncer->next;
+    bool okay = runParallel((void**) array, count, Server_listenRun, NULL, 0, done);
+    for (i = 0; i < count && okay; ++i) {
+        okay = array[i]->sock >= 0;
     }
+
+    free(array);
+    free(done);
+
+    if (!okay) {
+        Server_freeList(&servers);
+        return NULL;
+    }
+
     return servers;
 }
 
 void Server_accept(Server* servers)
 {
-    int max = 0;
+    int max = stopPipe[0];
     fd_set set;
     FD_ZERO(&set);
+    if (stopPipe[0] >= 0) { FD_SET(stopPipe[0], &set); }
     Server* server = servers;
     while (server) {
         FD_SET(server->sock, &set);
@@ -157,11 +200,24 @@ void Server_accept(Server* servers)
             socklen_t len = sizeof(addr);
             int sock = accept(server->sock, &addr.sa, &len);
             if (sock < 0) {
-                perror("accept");
+                // another bouncer process got there first
+                if (errno != EAGAIN && errno != EWOULDBLOCK) { perror("accept"); }
                 return;
             }
 
-            Client_launch(server, sock, &addr);
+            StatsBouncer* counters = Stats_bouncer(server->bouncer);
+            STATS_ADD(counters->accepts, 1);
+
+            if (!Acl_allowed(&addr, server->bouncer)) {
+                STATS_ADD(counters->denied, 1);
+                close(sock);
+            }
+            else if (server->bouncer->tunnelMode == TUNNEL_CORE) {
+                Tunnel_accept(server, sock);
+            }
+            else {
+                Client_launch(server, sock, &addr);
+            }
         }
         server = server->next;
     }
@@ -169,7 +225,21 @@ void Server_accept(Server* servers)
 
 void Server_loop(Server* servers)
 {
-    while (true) {
-      Server_accept(servers);
+    if (pipe(stopPipe) < 0) { perror("pipe"); }
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        Server_accept(servers);
+    }
+}
+
+// Server_loop returns after its current pass, safe from any thread
+void Server_stop()
+{
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+
+    int fd = __atomic_load_n(&stopPipe[1], __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+        char c = 0;
+        IGNORE_RESULT(write(fd, &c, 1));
     }
 }
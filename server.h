@@ -34,5 +34,6 @@ Server* Server_listenAll(Config* config);
 void Server_free(Server** serverp);
 void Server_freeList(Server** serverp);
 void Server_loop(Server* servers);
+void Server_stop();
 
 #endif
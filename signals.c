@@ -0,0 +1,112 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "signals.h"
+#include "acl.h"
+#include "route.h"
+#include "server.h"
+#include "client.h"
+#include "stats.h"
+
+// signals are blocked in every thread and taken synchronously by one
+// thread, so the work they trigger never runs in a signal handler
+
+static void Signals_set(sigset_t* set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGUSR1);
+}
+
+bool Signals_block()
+{
+    sigset_t set;
+    Signals_set(&set);
+
+    int ret = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_sigmask: %s\n", strerror(ret));
+        return false;
+    }
+
+    return true;
+}
+
+void Signals_reload(Config* config)
+{
+    if (!Acl_load(config)) {
+        fprintf(stderr, "Failed to reload acl, keeping the old one.\n");
+    }
+
+    if (!Route_load(config)) {
+        fprintf(stderr, "Failed to reload routes, keeping the old ones.\n");
+    }
+}
+
+static void* Signals_threadMain(void* configv)
+{
+    Config* config = configv;
+    sigset_t set;
+    Signals_set(&set);
+
+    while (true) {
+        int signo;
+        if (sigwait(&set, &signo) != 0) { continue; }
+
+        switch (signo) {
+            case SIGHUP :
+                Signals_reload(config);
+                break;
+            // a prefork worker drains, a single bouncer just goes
+            case SIGTERM :
+                if (config->processes > 0) {
+                    Server_stop();
+                    break;
+                }
+                Stats_close();
+                exit(0);
+            case SIGUSR1 :
+                Client_dump(config);
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+bool Signals_start(Config* config)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, &attr, Signals_threadMain, config);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,109 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "slab.h"
+
+static size_t Slab_stride(Slab* slab)
+{
+    size_t align = sizeof(void*) * 2;
+    return (sizeof(SlabObject) + slab->objSize + align - 1) & ~(align - 1);
+}
+
+Slab* Slab_new(size_t objSize)
+{
+    Slab* slab = calloc(1, sizeof(Slab));
+    if (!slab) { return NULL; }
+
+    slab->objSize = objSize;
+    slab->refs = 1;
+    return slab;
+}
+
+static bool Slab_grow(Slab* slab)
+{
+    size_t stride = Slab_stride(slab);
+    size_t header = (sizeof(SlabChunk) + stride - 1) / stride * stride;
+    SlabChunk* chunk = malloc(header + stride * SLAB_CHUNK_OBJECTS);
+    if (!chunk) { return false; }
+
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    char* p = (char*) chunk + header;
+    unsigned int i;
+    for (i = 0; i < SLAB_CHUNK_OBJECTS; ++i) {
+        SlabObject* obj = (SlabObject*) p;
+        obj->slab = slab;
+        obj->next = slab->freeList;
+        slab->freeList = obj;
+        p += stride;
+    }
+
+    return true;
+}
+
+void* Slab_alloc(Slab* slab)
+{
+    if (!slab->freeList) {
+        slab->freeList = __atomic_exchange_n(&slab->remoteFree, NULL,
+                                             __ATOMIC_ACQUIRE);
+        if (!slab->freeList && !Slab_grow(slab)) { return NULL; }
+    }
+
+    SlabObject* obj = slab->freeList;
+    slab->freeList = obj->next;
+    obj->next = NULL;
+    __atomic_add_fetch(&slab->refs, 1, __ATOMIC_RELAXED);
+
+    void* p = obj + 1;
+    memset(p, 0, slab->objSize);
+    return p;
+}
+
+void Slab_free(void* p)
+{
+    if (!p) { return; }
+
+    SlabObject* obj = (SlabObject*) p - 1;
+    Slab* slab = obj->slab;
+
+    SlabObject* head = __atomic_load_n(&slab->remoteFree, __ATOMIC_RELAXED);
+    do {
+        obj->next = head;
+    }
+    while (!__atomic_compare_exchange_n(&slab->remoteFree, &head, obj, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    Slab_release(slab);
+}
+
+// drops a reference, the owner's when its thread exits
+void Slab_release(void* slabv)
+{
+    Slab* slab = slabv;
+    if (__atomic_sub_fetch(&slab->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+
+    while (slab->chunks) {
+        SlabChunk* next = slab->chunks->next;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    free(slab);
+}
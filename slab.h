@@ -0,0 +1,53 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_SLAB_H
+#define EBBNC_SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_CHUNK_OBJECTS 64
+
+// objects are allocated only by the thread owning the slab, but may be
+// freed by any thread, frees are pushed onto a lock-free stack that the
+// owner reclaims in one go when its local free list runs dry. the owner
+// and each object out hold a reference, so a slab whose thread has gone
+// is freed with the last of its objects
+
+typedef struct SlabObject {
+    struct Slab*        slab;
+    struct SlabObject*  next;
+} SlabObject;
+
+typedef struct SlabChunk {
+    struct SlabChunk*   next;
+} SlabChunk;
+
+typedef struct Slab {
+    size_t              objSize;
+    SlabObject*         freeList;
+    SlabObject*         remoteFree;
+    SlabChunk*          chunks;
+    unsigned long       refs;
+} Slab;
+
+Slab* Slab_new(size_t objSize);
+void* Slab_alloc(Slab* slab);
+void Slab_free(void* obj);
+void Slab_release(void* slab);
+
+#endif
@@ -0,0 +1,223 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+#include "sockmap.h"
+#include "misc.h"
+
+// the key is the receiving socket as the verdict program sees it, the
+// value the socket its data is sent out of
+typedef struct
+{
+    uint32_t    remoteIP;
+    uint32_t    localIP;
+    uint32_t    remotePort;
+    uint32_t    localPort;
+} SockmapKey;
+
+// tcp states from the kernel, netinet/tcp.h has them but can't be
+// included alongside the linux tcp_info
+#define SOCKMAP_TIME_WAIT       6
+#define SOCKMAP_CLOSE_WAIT      8
+#define SOCKMAP_LAST_ACK        9
+#define SOCKMAP_CLOSING         11
+
+#define INSN(code, dst, src, off, imm) \
+    ((struct bpf_insn) { (code), (dst), (src), (off), (imm) })
+
+static int mapFd = -1;
+
+static long Sockmap_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int Sockmap_load(const struct bpf_insn* insns, unsigned int count)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insn_cnt = count;
+    attr.insns = (uintptr_t) insns;
+    attr.license = (uintptr_t) "GPL";
+    return Sockmap_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static bool Sockmap_attach(int progFd, enum bpf_attach_type type)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = mapFd;
+    attr.attach_bpf_fd = progFd;
+    attr.attach_type = type;
+    return Sockmap_bpf(BPF_PROG_ATTACH, &attr) == 0;
+}
+
+bool Sockmap_init()
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size = sizeof(SockmapKey);
+    attr.value_size = sizeof(int);
+    attr.max_entries = SOCKMAP_MAX_SOCKETS;
+    mapFd = Sockmap_bpf(BPF_MAP_CREATE, &attr);
+    if (mapFd < 0) { return false; }
+
+    // every message is a whole skb
+    const struct bpf_insn parser[] = {
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, offsetof(struct __sk_buff, len), 0),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+
+    // looks up the peer by the receiving socket's addresses, passing the
+    // data up to user space when there is none yet
+    const struct bpf_insn verdict[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, remote_ip4), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -16, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, local_ip4), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -12, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, remote_port), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -8, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, local_port), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, mapFd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+
+    int parserFd = Sockmap_load(parser, sizeof(parser) / sizeof(parser[0]));
+    int verdictFd = parserFd < 0 ? -1 : Sockmap_load(verdict, sizeof(verdict) / sizeof(verdict[0]));
+    bool okay = verdictFd >= 0 &&
+                Sockmap_attach(parserFd, BPF_SK_SKB_STREAM_PARSER) &&
+                Sockmap_attach(verdictFd, BPF_SK_SKB_STREAM_VERDICT);
+
+    // the map keeps the attached programs alive
+    int errno_ = errno;
+    if (parserFd >= 0) { close(parserFd); }
+    if (verdictFd >= 0) { close(verdictFd); }
+    if (!okay) {
+        close(mapFd);
+        mapFd = -1;
+    }
+    errno = errno_;
+    return okay;
+}
+
+static bool Sockmap_key(int sock, SockmapKey* key)
+{
+    struct sockaddr_any local;
+    struct sockaddr_any remote;
+    socklen_t len = sizeof(local);
+    if (getsockname(sock, &local.sa, &len) < 0 || local.san_family != AF_INET) { return false; }
+    len = sizeof(remote);
+    if (getpeername(sock, &remote.sa, &len) < 0 || remote.san_family != AF_INET) { return false; }
+
+    key->remoteIP = remote.s4.sin_addr.s_addr;
+    key->localIP = local.s4.sin_addr.s_addr;
+    // the program sees the remote port as it is on the wire, but loaded
+    // as a 32 bit word, and the local port in host order
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    key->remotePort = (uint32_t) remote.s4.sin_port << 16;
+#else
+    key->remotePort = remote.s4.sin_port;
+#endif
+    key->localPort = ntohs(local.s4.sin_port);
+    return true;
+}
+
+static bool Sockmap_update(const SockmapKey* key, int sock)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFd;
+    attr.key = (uintptr_t) key;
+    attr.value = (uintptr_t) &sock;
+    attr.flags = BPF_ANY;
+    return Sockmap_bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+static void Sockmap_delete(const SockmapKey* key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFd;
+    attr.key = (uintptr_t) key;
+    Sockmap_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+bool Sockmap_add(int cSock, int rSock)
+{
+    SockmapKey cKey;
+    SockmapKey rKey;
+    if (mapFd < 0 || !Sockmap_key(cSock, &cKey) || !Sockmap_key(rSock, &rKey)) {
+        return false;
+    }
+
+    if (!Sockmap_update(&cKey, rSock)) { return false; }
+    if (!Sockmap_update(&rKey, cSock)) {
+        Sockmap_delete(&cKey);
+        return false;
+    }
+
+    return true;
+}
+
+static bool Sockmap_info(int sock, struct tcp_info* info)
+{
+    socklen_t len = sizeof(*info);
+    memset(info, 0, sizeof(*info));
+    return getsockopt(sock, IPPROTO_TCP, TCP_INFO, info, &len) == 0;
+}
+
+// the count includes the sequence number taken by the peer's fin
+uint64_t Sockmap_received(int sock)
+{
+    struct tcp_info info;
+    if (!Sockmap_info(sock, &info)) { return 0; }
+
+    bool fin = info.tcpi_state == SOCKMAP_CLOSE_WAIT || info.tcpi_state == SOCKMAP_LAST_ACK ||
+               info.tcpi_state == SOCKMAP_CLOSING || info.tcpi_state == SOCKMAP_TIME_WAIT;
+    return info.tcpi_bytes_received - (fin && info.tcpi_bytes_received > 0);
+}
+
+// everything ever queued to send, acked or not
+uint64_t Sockmap_queued(int sock)
+{
+    struct tcp_info info;
+    int outq = 0;
+    if (!Sockmap_info(sock, &info) || ioctl(sock, SIOCOUTQ, &outq) < 0) { return 0; }
+    return info.tcpi_bytes_acked + outq;
+}
@@ -0,0 +1,36 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_SOCKMAP_H
+#define EBBNC_SOCKMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// plain tcp sessions can be handed to the kernel once set up, a verdict
+// program redirects what each socket receives straight out of its peer
+// and user space only sees anything the redirect missed and the close,
+// closing a socket takes it out of the map
+
+#define SOCKMAP_MAX_SOCKETS     65536
+
+bool Sockmap_init();
+bool Sockmap_add(int cSock, int rSock);
+uint64_t Sockmap_received(int sock);
+uint64_t Sockmap_queued(int sock);
+
+#endif
@@ -0,0 +1,461 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+#include "radix.h"
+#include "upstream.h"
+
+#define STATS_SNAPSHOT_TRIES 1000
+
+StatsSegment* stats = NULL;
+StatsProcess* statsProcess = NULL;
+
+static int slowLogFd = -1;
+static char statsPath[NAME_MAX] = "";
+
+static const char* commandNames[STATS_COMMANDS] = {
+    "other", "USER", "PASS", "ACCT", "CWD", "CDUP", "PWD", "LIST", "NLST",
+    "MLSD", "MLST", "STAT", "RETR", "STOR", "APPE", "REST", "ABOR", "PASV",
+    "EPSV", "PORT", "EPRT", "TYPE", "SIZE", "MDTM", "DELE", "MKD", "RMD",
+    "RNFR", "RNTO", "SITE", "FEAT", "SYST", "NOOP", "AUTH", "PBSZ", "PROT",
+    "QUIT"
+};
+
+static const char* phaseNames[STATS_PHASES] = {
+    "start", "resolve", "connect", "ident", "dns", "welcome", "firstbyte", "setup"
+};
+
+// the segment mutex is shared by every bouncer process, and one that dies
+// holding it must not stop the others. dying mid write leaves the seqlock
+// odd, which readers would wait on for ever, so it is closed here.
+static void Stats_lock()
+{
+    if (pthread_mutex_lock(&stats->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&stats->mutex);
+        uint32_t seq = __atomic_load_n(&stats->seq, __ATOMIC_RELAXED);
+        if (seq & 1) { __atomic_store_n(&stats->seq, seq + 1, __ATOMIC_RELEASE); }
+    }
+}
+
+static void Stats_unlock()
+{
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+// must hold the segment mutex
+static void Stats_writeBegin()
+{
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void Stats_writeEnd()
+{
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+// the pid of a bouncer still publishing under name, 0 if there is none or
+// the segment isn't ours to trust
+static pid_t Stats_owner(const char* name)
+{
+    StatsSegment* segment = Stats_map(name);
+    if (!segment) { return 0; }
+
+    pid_t owner = segment->owner;
+    munmap(segment, sizeof(StatsSegment));
+    return owner > 0 && (kill(owner, 0) == 0 || errno == EPERM) ? owner : 0;
+}
+
+// one left by a bouncer that is gone is unlinked rather than truncated,
+// an ebbnc-top still watching it keeps the old one and remaps
+static StatsSegment* Stats_create(const char* path)
+{
+    if (shm_unlink(path) < 0 && errno != ENOENT) {
+        perror("shm_unlink");
+        return NULL;
+    }
+
+    // top talkers are client addresses, so only the bouncer's user reads them
+    int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(StatsSegment)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    void* p = mmap(NULL, sizeof(StatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    return p;
+}
+
+// mapped before the fork so the daemon keeps the same segment
+bool Stats_init(Config* config, unsigned int workers)
+{
+    const char* name = config->statsName ? config->statsName : STATS_NAME;
+    pid_t owner = Stats_owner(name);
+    if (owner > 0) {
+        fprintf(stderr, "Stats segment %s is in use by PID #%i, set statsname to "
+                "run another bouncer.\n", name, owner);
+        return false;
+    }
+
+    snprintf(statsPath, sizeof(statsPath), "/%s", name);
+    stats = Stats_create(statsPath);
+    if (!stats) {
+        statsPath[0] = '\0';
+        fprintf(stderr, "Unable to create stats segment, ebbnc-top will not work.\n");
+        stats = calloc(1, sizeof(StatsSegment));
+        if (!stats) {
+            perror("calloc");
+            return false;
+        }
+    }
+
+    if (config->slowLog) {
+        slowLogFd = open(config->slowLog, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (slowLogFd < 0) {
+            perror(config->slowLog);
+            return false;
+        }
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&stats->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    Stats_lock();
+    Stats_writeBegin();
+
+    stats->magic = STATS_MAGIC;
+    stats->version = STATS_VERSION;
+    stats->size = sizeof(StatsSegment);
+    stats->started = time(NULL);
+    stats->owner = getpid();
+    stats->workerCount = workers < STATS_MAX_WORKERS ? workers : STATS_MAX_WORKERS;
+
+    unsigned int i = 0;
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        // any past the limit are counted together in the last slot
+        bouncer->statsIndex = i < STATS_MAX_BOUNCERS ? i++ : STATS_MAX_BOUNCERS - 1;
+        snprintf(stats->bouncers[bouncer->statsIndex].name,
+                 sizeof(stats->bouncers[0].name), "%s:%li -> %s:%li",
+                 bouncer->listenIP, bouncer->listenPort,
+                 bouncer->remoteHost, bouncer->remotePort);
+    }
+    stats->bouncerCount = i;
+
+    stats->processCount = config->processes > 0 ? (unsigned int) config->processes : 1;
+    if (stats->processCount > STATS_MAX_PROCESSES) { stats->processCount = STATS_MAX_PROCESSES; }
+    statsProcess = &stats->processes[0];
+
+    Stats_writeEnd();
+    Stats_unlock();
+
+    return true;
+}
+
+// the process that stays after daemonising, the one that removes it
+void Stats_setOwner()
+{
+    __atomic_store_n(&stats->owner, getpid(), __ATOMIC_RELAXED);
+}
+
+// on a clean shutdown, workers still draining keep their mapping
+void Stats_close()
+{
+    if (statsPath[0] && stats->owner == getpid()) { shm_unlink(statsPath); }
+}
+
+// called again after the fork by whichever process relays
+void Stats_setProcess(unsigned int process)
+{
+    statsProcess = &stats->processes[process % STATS_MAX_PROCESSES];
+    statsProcess->pid = getpid();
+}
+
+StatsBouncer* Stats_bouncer(Bouncer* bouncer)
+{
+    return &stats->bouncers[bouncer->statsIndex];
+}
+
+StatsWorker* Stats_worker(unsigned int worker)
+{
+    return &stats->workers[worker % STATS_MAX_WORKERS];
+}
+
+// space saving, a new address takes over the smallest entry and
+// inherits its count so heavy hitters can't be pushed out by a crowd
+void Stats_talker(const struct sockaddr_any* addr, uint64_t bytes)
+{
+    unsigned char key[RADIX_KEY_SIZE];
+    if (bytes == 0 || !radixKeyFromSockaddr(addr, key)) { return; }
+
+    Stats_lock();
+    Stats_writeBegin();
+
+    StatsTalker* min = &stats->talkers[0];
+    unsigned int i;
+    for (i = 0; i < STATS_TALKERS; ++i) {
+        StatsTalker* talker = &stats->talkers[i];
+        if (!memcmp(talker->addr, key, sizeof(key))) {
+            min = NULL;
+            talker->bytes += bytes;
+            break;
+        }
+        if (talker->bytes < min->bytes) { min = talker; }
+    }
+
+    if (min) {
+        memcpy(min->addr, key, sizeof(key));
+        min->bytes += bytes;
+    }
+
+    Stats_writeEnd();
+    Stats_unlock();
+}
+
+void Stats_pool(unsigned int threads, unsigned int idle, unsigned long saturated)
+{
+    __atomic_store_n(&statsProcess->poolThreads, threads, __ATOMIC_RELAXED);
+    __atomic_store_n(&statsProcess->poolIdle, idle, __ATOMIC_RELAXED);
+    __atomic_store_n(&statsProcess->poolSaturated, saturated, __ATOMIC_RELAXED);
+}
+
+// one write per line, appends from different sessions don't interleave
+void Stats_slowLog(const char* line, size_t len)
+{
+    if (slowLogFd >= 0) { IGNORE_RESULT(write(slowLogFd, line, len)); }
+}
+
+const char* Stats_phaseName(unsigned int phase)
+{
+    return phase < STATS_PHASES ? phaseNames[phase] : "?";
+}
+
+// sessions look their pair up once, after the upstream is chosen, by name
+// as every bouncer process adds to the same table. when the table fills
+// up the rest share the last pair.
+StatsCommands* Stats_commands(Bouncer* bouncer, Upstream* upstream)
+{
+    char name[sizeof(stats->pairs[0].name)];
+    snprintf(name, sizeof(name), "%s:%li -> %s:%li",
+             bouncer->listenIP, bouncer->listenPort, upstream->host, upstream->port);
+
+    Stats_lock();
+
+    unsigned int i;
+    for (i = 0; i < stats->pairCount; ++i) {
+        if (!strcmp(stats->pairs[i].name, name)) {
+            Stats_unlock();
+            return &stats->pairs[i];
+        }
+    }
+
+    if (stats->pairCount == STATS_MAX_PAIRS) {
+        Stats_unlock();
+        return &stats->pairs[STATS_MAX_PAIRS - 1];
+    }
+
+    Stats_writeBegin();
+    i = stats->pairCount;
+    memcpy(stats->pairs[i].name, name, sizeof(name));
+    stats->pairCount++;
+    Stats_writeEnd();
+
+    Stats_unlock();
+    return &stats->pairs[i];
+}
+
+StatsUpstream* Stats_upstream(Upstream* upstream)
+{
+    char name[sizeof(stats->upstreams[0].name)];
+    snprintf(name, sizeof(name), "%s:%li", upstream->host, upstream->port);
+
+    Stats_lock();
+
+    unsigned int i;
+    for (i = 0; i < stats->upstreamCount; ++i) {
+        if (!strcmp(stats->upstreams[i].name, name)) {
+            Stats_unlock();
+            return &stats->upstreams[i];
+        }
+    }
+
+    if (stats->upstreamCount == STATS_MAX_UPSTREAMS) {
+        Stats_unlock();
+        return &stats->upstreams[STATS_MAX_UPSTREAMS - 1];
+    }
+
+    Stats_writeBegin();
+    i = stats->upstreamCount;
+    memcpy(stats->upstreams[i].name, name, sizeof(name));
+    stats->upstreams[i].score = UPSTREAM_MAX_SCORE;
+    stats->upstreamCount++;
+    Stats_writeEnd();
+
+    Stats_unlock();
+    return &stats->upstreams[i];
+}
+
+void Stats_quality(StatsUpstream* entry, const UpstreamQuality* quality)
+{
+    Stats_lock();
+    Stats_writeBegin();
+    entry->samples = quality->samples;
+    entry->rttUs = quality->rttUs;
+    entry->rttVarUs = quality->rttVarUs;
+    entry->minRttUs = quality->minRttUs;
+    entry->deliveryRate = quality->deliveryRate;
+    entry->lossPermille = quality->lossPermille;
+    entry->cwnd = quality->cwnd;
+    entry->score = quality->score;
+    Stats_writeEnd();
+    Stats_unlock();
+}
+
+unsigned int Stats_commandIndex(const char* verb, size_t len)
+{
+    unsigned int i;
+    for (i = 1; i < STATS_COMMANDS; ++i) {
+        if (strlen(commandNames[i]) == len && !strncasecmp(verb, commandNames[i], len)) {
+            return i;
+        }
+    }
+    return STATS_COMMAND_OTHER;
+}
+
+const char* Stats_commandName(unsigned int command)
+{
+    return command < STATS_COMMANDS ? commandNames[command] : "?";
+}
+
+unsigned int StatsHistogram_bucket(uint64_t value)
+{
+    if (value < STATS_HIST_LINEAR) { return value; }
+
+    unsigned int e = 63 - __builtin_clzll(value);
+    unsigned int bucket = STATS_HIST_LINEAR + (e - 4) * 4 + ((value >> (e - 2)) & 3);
+    return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+uint64_t StatsHistogram_lowerBound(unsigned int bucket)
+{
+    if (bucket < STATS_HIST_LINEAR) { return bucket; }
+
+    unsigned int e = (bucket - STATS_HIST_LINEAR) / 4 + 4;
+    unsigned int sub = (bucket - STATS_HIST_LINEAR) % 4;
+    return ((uint64_t) 1 << e) + sub * ((uint64_t) 1 << (e - 2));
+}
+
+void StatsHistogram_add(StatsHistogram* hist, uint64_t value)
+{
+    STATS_ADD(hist->buckets[StatsHistogram_bucket(value)], 1);
+    STATS_ADD(hist->count, 1);
+}
+
+uint64_t StatsHistogram_percentile(const StatsHistogram* hist, double pct)
+{
+    uint64_t total = 0;
+    unsigned int i;
+    for (i = 0; i < STATS_HIST_BUCKETS; ++i) { total += hist->buckets[i]; }
+    if (total == 0) { return 0; }
+
+    uint64_t target = (uint64_t)(total * pct / 100.0);
+    if (target == 0) { target = 1; }
+
+    uint64_t seen = 0;
+    for (i = 0; i < STATS_HIST_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= target) { break; }
+    }
+
+    return StatsHistogram_lowerBound(i < STATS_HIST_BUCKETS ? i : STATS_HIST_BUCKETS - 1);
+}
+
+StatsSegment* Stats_map(const char* name)
+{
+    char path[NAME_MAX];
+    snprintf(path, sizeof(path), "/%s", name);
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) { return NULL; }
+
+    // anyone can put a file in /dev/shm, one that isn't ours could name
+    // any pid as its owner
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid() ||
+        (size_t) st.st_size < sizeof(StatsSegment)) {
+        close(fd);
+        return NULL;
+    }
+
+    StatsSegment* segment = mmap(NULL, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) { return NULL; }
+
+    if (segment->magic != STATS_MAGIC || segment->version != STATS_VERSION ||
+        segment->size != sizeof(StatsSegment)) {
+        munmap(segment, sizeof(StatsSegment));
+        return NULL;
+    }
+
+    return segment;
+}
+
+bool Stats_snapshot(const StatsSegment* segment, StatsSegment* copy)
+{
+    unsigned int tries;
+    for (tries = 0; tries < STATS_SNAPSHOT_TRIES; ++tries) {
+        uint32_t seq = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) { continue; }
+
+        memcpy(copy, segment, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&segment->seq, __ATOMIC_RELAXED) == seq) { return true; }
+    }
+
+    return false;
+}
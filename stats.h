@@ -0,0 +1,187 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_STATS_H
+#define EBBNC_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "config.h"
+#include "misc.h"
+#include "upstream.h"
+
+// counters are published in a shared memory segment for ebbnc-top to map
+// read only. the relay updates them with relaxed atomics, anything that
+// has to be read as a whole (names, top talkers) is written under a
+// seqlock the reader retries on.
+
+#define STATS_MAGIC         0x45425354
+#define STATS_VERSION       9
+#define STATS_NAME          "ebbnc"
+#define STATS_MAX_BOUNCERS  64
+#define STATS_MAX_WORKERS   16
+#define STATS_TALKERS       16
+#define STATS_HIST_LINEAR   16
+#define STATS_HIST_BUCKETS  128
+#define STATS_REPORT_BYTES  (1024 * 1024)
+#define STATS_MAX_PAIRS     64
+#define STATS_MAX_PROCESSES 64
+#define STATS_MAX_UPSTREAMS 64
+
+// session setup, each phase is timed in microseconds
+enum StatsPhase {
+    STATS_PHASE_START,          // accept until the session thread runs
+    STATS_PHASE_RESOLVE,
+    STATS_PHASE_CONNECT,
+    STATS_PHASE_IDENT,
+    STATS_PHASE_DNS,            // reverse lookup for the idnt
+    STATS_PHASE_WELCOME,
+    STATS_PHASE_FIRST_BYTE,     // idnt sent until the server's first byte
+    STATS_PHASE_SETUP,          // accept until the server's first byte
+    STATS_PHASES
+};
+
+// commands timed by the ftp scanner, anything else counts as other
+enum StatsCommand {
+    STATS_COMMAND_OTHER,
+    STATS_COMMAND_USER, STATS_COMMAND_PASS, STATS_COMMAND_ACCT,
+    STATS_COMMAND_CWD, STATS_COMMAND_CDUP, STATS_COMMAND_PWD,
+    STATS_COMMAND_LIST, STATS_COMMAND_NLST, STATS_COMMAND_MLSD,
+    STATS_COMMAND_MLST, STATS_COMMAND_STAT, STATS_COMMAND_RETR,
+    STATS_COMMAND_STOR, STATS_COMMAND_APPE, STATS_COMMAND_REST,
+    STATS_COMMAND_ABOR, STATS_COMMAND_PASV, STATS_COMMAND_EPSV,
+    STATS_COMMAND_PORT, STATS_COMMAND_EPRT, STATS_COMMAND_TYPE,
+    STATS_COMMAND_SIZE, STATS_COMMAND_MDTM, STATS_COMMAND_DELE,
+    STATS_COMMAND_MKD, STATS_COMMAND_RMD, STATS_COMMAND_RNFR,
+    STATS_COMMAND_RNTO, STATS_COMMAND_SITE, STATS_COMMAND_FEAT,
+    STATS_COMMAND_SYST, STATS_COMMAND_NOOP, STATS_COMMAND_AUTH,
+    STATS_COMMAND_PBSZ, STATS_COMMAND_PROT, STATS_COMMAND_QUIT,
+    STATS_COMMANDS
+};
+
+// log linear, exact below 16 then four buckets per power of two
+typedef struct {
+    uint64_t        count;
+    uint64_t        buckets[STATS_HIST_BUCKETS];
+} StatsHistogram;
+
+typedef struct {
+    char            name[128];
+    uint64_t        accepts;
+    uint64_t        denied;
+    uint64_t        sessions;
+    uint64_t        sessionsTotal;
+    uint64_t        connectFailures;
+    uint64_t        noopsAbsorbed;
+    uint64_t        bytesIn;
+    uint64_t        bytesOut;
+    StatsHistogram  phaseUs[STATS_PHASES];
+} StatsBouncer;
+
+typedef struct {
+    uint64_t        sessions;
+    uint64_t        bytes;
+} StatsWorker;
+
+// one per bouncer and upstream pair, round trip per command in microseconds
+typedef struct {
+    char            name[128];
+    StatsHistogram  latencyUs[STATS_COMMANDS];
+} StatsCommands;
+
+// path quality of an upstream as its sampled sessions see it, written
+// whole by whichever process sampled it last
+typedef struct {
+    char            name[128];
+    uint64_t        samples;
+    uint64_t        rttUs;
+    uint64_t        rttVarUs;
+    uint64_t        minRttUs;
+    uint64_t        deliveryRate;
+    uint32_t        lossPermille;
+    uint32_t        cwnd;
+    uint32_t        score;
+} StatsUpstream;
+
+typedef struct {
+    unsigned char   addr[16];
+    uint64_t        bytes;
+} StatsTalker;
+
+// one per bouncer process, the first when there is only the one
+typedef struct {
+    int32_t         pid;
+    uint32_t        restarts;
+    uint64_t        sessions;
+    uint32_t        poolThreads;
+    uint32_t        poolIdle;
+    uint64_t        poolSaturated;
+} StatsProcess;
+
+typedef struct {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        size;
+    uint32_t        seq;
+    int64_t         started;
+    uint32_t        bouncerCount;
+    uint32_t        workerCount;
+    uint32_t        pairCount;
+    uint32_t        processCount;
+    uint32_t        upstreamCount;
+    int32_t         owner;          // the bouncer, the master under prefork
+    pthread_mutex_t mutex;          // shared by the bouncer processes
+    StatsProcess    processes[STATS_MAX_PROCESSES];
+    StatsBouncer    bouncers[STATS_MAX_BOUNCERS];
+    StatsWorker     workers[STATS_MAX_WORKERS];
+    StatsTalker     talkers[STATS_TALKERS];
+    StatsCommands   pairs[STATS_MAX_PAIRS];
+    StatsUpstream   upstreams[STATS_MAX_UPSTREAMS];
+} StatsSegment;
+
+#define STATS_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STATS_SUB(field, n) __atomic_fetch_sub(&(field), (n), __ATOMIC_RELAXED)
+
+extern StatsSegment* stats;
+extern StatsProcess* statsProcess;
+
+bool Stats_init(Config* config, unsigned int workers);
+void Stats_setOwner();
+void Stats_close();
+void Stats_setProcess(unsigned int process);
+StatsBouncer* Stats_bouncer(Bouncer* bouncer);
+StatsWorker* Stats_worker(unsigned int worker);
+void Stats_talker(const struct sockaddr_any* addr, uint64_t bytes);
+void Stats_pool(unsigned int threads, unsigned int idle, unsigned long saturated);
+void Stats_slowLog(const char* line, size_t len);
+const char* Stats_phaseName(unsigned int phase);
+StatsCommands* Stats_commands(Bouncer* bouncer, Upstream* upstream);
+StatsUpstream* Stats_upstream(Upstream* upstream);
+void Stats_quality(StatsUpstream* entry, const UpstreamQuality* quality);
+unsigned int Stats_commandIndex(const char* verb, size_t len);
+const char* Stats_commandName(unsigned int command);
+
+unsigned int StatsHistogram_bucket(uint64_t value);
+uint64_t StatsHistogram_lowerBound(unsigned int bucket);
+void StatsHistogram_add(StatsHistogram* hist, uint64_t value);
+uint64_t StatsHistogram_percentile(const StatsHistogram* hist, double pct);
+
+StatsSegment* Stats_map(const char* name);
+bool Stats_snapshot(const StatsSegment* segment, StatsSegment* copy);
+
+#endif
@@ -0,0 +1,204 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "timer.h"
+
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_MAX_TICKS     ((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static TimerWheel wheels[TIMER_MAX_WHEELS];
+static unsigned int wheelCount = 0;
+static unsigned int nextWheel = 0;
+
+long Timer_nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t Timer_nowTicks()
+{
+    return Timer_nowMs() / TIMER_TICK_MS;
+}
+
+// must hold the wheel mutex
+static void TimerWheel_add(TimerWheel* wheel, Timer* timer)
+{
+    if (timer->expires <= wheel->now) { timer->expires = wheel->now + 1; }
+
+    uint64_t delta = timer->expires - wheel->now;
+    if (delta >= TIMER_MAX_TICKS) {
+        timer->expires = wheel->now + TIMER_MAX_TICKS - 1;
+        delta = TIMER_MAX_TICKS - 1;
+    }
+
+    unsigned int level = 0;
+    while (delta >= (uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1))) { ++level; }
+
+    unsigned int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    Timer** head = &wheel->slots[level][slot];
+    timer->next = *head;
+    timer->pprev = head;
+    if (*head) { (*head)->pprev = &timer->next; }
+    *head = timer;
+}
+
+// must hold the wheel mutex
+static void TimerWheel_remove(Timer* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) { timer->next->pprev = timer->pprev; }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static Timer* TimerWheel_take(TimerWheel* wheel, unsigned int level, unsigned int slot)
+{
+    Timer* list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    return list;
+}
+
+// must hold the wheel mutex
+static void TimerWheel_tick(TimerWheel* wheel)
+{
+    wheel->now++;
+
+    // each time a level wraps the next slot up is spread over the levels below
+    unsigned int level;
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if ((wheel->now & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0) { break; }
+
+        unsigned int slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        Timer* timer = TimerWheel_take(wheel, level, slot);
+        while (timer) {
+            Timer* next = timer->next;
+            TimerWheel_add(wheel, timer);
+            timer = next;
+        }
+    }
+
+    Timer* timer = TimerWheel_take(wheel, 0, wheel->now & TIMER_WHEEL_MASK);
+    while (timer) {
+        Timer* next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+
+        long ms = timer->expire(timer);
+        if (ms > 0) {
+            timer->expires = wheel->now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+            TimerWheel_add(wheel, timer);
+        }
+
+        timer = next;
+    }
+}
+
+static void* TimerWheel_threadMain(void* wheelv)
+{
+    TimerWheel* wheel = wheelv;
+    struct timespec delay = { 0, TIMER_TICK_MS * 1000000L };
+
+    while (true) {
+        nanosleep(&delay, NULL);
+
+        uint64_t now = Timer_nowTicks();
+        pthread_mutex_lock(&wheel->mutex);
+        while (wheel->now < now) { TimerWheel_tick(wheel); }
+        pthread_mutex_unlock(&wheel->mutex);
+    }
+
+    return NULL;
+}
+
+// one per cpu
+unsigned int Timer_wheels()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > TIMER_MAX_WHEELS ? TIMER_MAX_WHEELS : cpus;
+}
+
+bool Timer_startAll()
+{
+    wheelCount = Timer_wheels();
+
+    uint64_t now = Timer_nowTicks();
+    unsigned int i;
+    for (i = 0; i < wheelCount; ++i) {
+        TimerWheel* wheel = &wheels[i];
+        pthread_mutex_init(&wheel->mutex, NULL);
+        wheel->now = now;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_t thread;
+        int ret = pthread_create(&thread, &attr, TimerWheel_threadMain, wheel);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+            errno = ret;
+            perror("pthread_create");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Timer_init(Timer* timer, TimerFunc expire)
+{
+    unsigned int n = __atomic_fetch_add(&nextWheel, 1, __ATOMIC_RELAXED);
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expire = expire;
+    timer->wheel = &wheels[n % wheelCount];
+}
+
+void Timer_arm(Timer* timer, long ms)
+{
+    TimerWheel* wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->mutex);
+    if (timer->pprev) { TimerWheel_remove(timer); }
+    timer->expires = wheel->now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    TimerWheel_add(wheel, timer);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+// once this returns the callback is neither running nor going to run
+void Timer_cancel(Timer* timer)
+{
+    TimerWheel* wheel = timer->wheel;
+    if (!wheel) { return; }
+
+    pthread_mutex_lock(&wheel->mutex);
+    if (timer->pprev) { TimerWheel_remove(timer); }
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+unsigned int Timer_wheelIndex(const Timer* timer)
+{
+    return timer->wheel - wheels;
+}
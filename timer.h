@@ -0,0 +1,65 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_TIMER_H
+#define EBBNC_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// session deadlines live in a few hierarchical timing wheels, each turned
+// by its own thread off the coarse monotonic clock. arming and cancelling
+// are O(1) under the wheel's mutex. a deadline doesn't interrupt the
+// session itself, the expire callback shuts down whatever socket the
+// session is blocked on.
+
+#define TIMER_TICK_MS       50
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_MAX_WHEELS    16
+
+struct Timer;
+
+// runs on the wheel thread with the wheel locked, so it must be quick and
+// must not arm or cancel timers. returns ms to re-arm the timer, or 0.
+typedef long (*TimerFunc)(struct Timer* timer);
+
+typedef struct Timer {
+    struct Timer*       next;
+    struct Timer**      pprev;
+    uint64_t            expires;
+    TimerFunc           expire;
+    struct TimerWheel*  wheel;
+} Timer;
+
+typedef struct TimerWheel {
+    pthread_mutex_t     mutex;
+    uint64_t            now;
+    Timer*              slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+unsigned int Timer_wheels();
+bool Timer_startAll();
+long Timer_nowMs();
+void Timer_init(Timer* timer, TimerFunc expire);
+void Timer_arm(Timer* timer, long ms);
+void Timer_cancel(Timer* timer);
+unsigned int Timer_wheelIndex(const Timer* timer);
+
+#endif
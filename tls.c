@@ -0,0 +1,250 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifdef EBBNC_TLS
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+#define TLS_SESSION_TIMEOUT     3600
+
+static SSL_CTX* serverCtx = NULL;
+static SSL_CTX* clientCtx = NULL;
+
+// the last session from each upstream, offered again on the next connect
+static pthread_mutex_t sessionMutex = PTHREAD_MUTEX_INITIALIZER;
+static int upstreamIndex = -1;
+
+static void Tls_error(const char* func)
+{
+    char buf[256];
+    unsigned long err = ERR_get_error();
+    if (err) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        fprintf(stderr, "%s: %s\n", func, buf);
+    }
+    else {
+        fprintf(stderr, "%s: failed\n", func);
+    }
+    ERR_clear_error();
+}
+
+static int Tls_newSession(SSL* ssl, SSL_SESSION* session)
+{
+    Upstream* upstream = SSL_get_ex_data(ssl, upstreamIndex);
+    if (!upstream) { return 0; }
+
+    pthread_mutex_lock(&sessionMutex);
+    SSL_SESSION* old = upstream->tlsSession;
+    upstream->tlsSession = session;
+    pthread_mutex_unlock(&sessionMutex);
+
+    if (old) { SSL_SESSION_free(old); }
+    return 1;
+}
+
+// clients resume by ticket only, sealed with a key made before the fork
+// so any worker can open it. a session id cache would be private to each
+// worker and miss whenever a client lands on another one.
+// no auto retry, a session ticket arriving must not block the relay.
+static SSL_CTX* Tls_newCtx(const SSL_METHOD* method)
+{
+    SSL_CTX* ctx = SSL_CTX_new(method);
+    if (!ctx) { return NULL; }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    return ctx;
+}
+
+bool Tls_init(Config* config)
+{
+    bool needed = false;
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        if (bouncer->tlsMode != TLS_NONE) { needed = true; }
+    }
+
+    if (!needed) { return true; }
+
+    if (!config->tlsCert) {
+        fprintf(stderr, "Config option tlscert is required for tls bouncers.\n");
+        return false;
+    }
+
+    serverCtx = Tls_newCtx(TLS_server_method());
+    clientCtx = Tls_newCtx(TLS_client_method());
+    if (!serverCtx || !clientCtx) {
+        Tls_error("SSL_CTX_new");
+        return false;
+    }
+
+    const char* key = config->tlsKey ? config->tlsKey : config->tlsCert;
+    if (SSL_CTX_use_certificate_chain_file(serverCtx, config->tlsCert) != 1) {
+        Tls_error(config->tlsCert);
+        return false;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(serverCtx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(serverCtx) != 1) {
+        Tls_error(key);
+        return false;
+    }
+
+    SSL_CTX_set_session_cache_mode(serverCtx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(serverCtx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(serverCtx, (const unsigned char*) "ebbnc", 5);
+
+    // servers behind a bouncer rarely have a certificate worth checking
+    SSL_CTX_set_verify(clientCtx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(clientCtx, SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(clientCtx, Tls_newSession);
+
+    upstreamIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    if (upstreamIndex < 0) {
+        Tls_error("SSL_get_ex_new_index");
+        return false;
+    }
+
+    return true;
+}
+
+static SSL* Tls_new(SSL_CTX* ctx, int sock)
+{
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl) {
+        Tls_error("SSL_new");
+        return NULL;
+    }
+
+    if (SSL_set_fd(ssl, sock) != 1) {
+        Tls_error("SSL_set_fd");
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    return ssl;
+}
+
+struct ssl_st* Tls_accept(int sock)
+{
+    SSL* ssl = Tls_new(serverCtx, sock);
+    if (!ssl) { return NULL; }
+
+    if (SSL_accept(ssl) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    return ssl;
+}
+
+struct ssl_st* Tls_connect(int sock, Upstream* upstream)
+{
+    SSL* ssl = Tls_new(clientCtx, sock);
+    if (!ssl) { return NULL; }
+
+    SSL_set_ex_data(ssl, upstreamIndex, upstream);
+
+    pthread_mutex_lock(&sessionMutex);
+    if (upstream->tlsSession) { SSL_set_session(ssl, upstream->tlsSession); }
+    pthread_mutex_unlock(&sessionMutex);
+
+    if (SSL_connect(ssl) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    return ssl;
+}
+
+// -1 with EAGAIN when a record carried no data, eg. a session ticket
+ssize_t Tls_read(struct ssl_st* ssl, void* buf, size_t len)
+{
+    int ret = SSL_read(ssl, buf, len);
+    if (ret > 0) { return ret; }
+
+    int err = SSL_get_error(ssl, ret);
+    ERR_clear_error();
+    switch (err) {
+        case SSL_ERROR_ZERO_RETURN :
+            return 0;
+        case SSL_ERROR_WANT_READ :
+        case SSL_ERROR_WANT_WRITE :
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL :
+            if (ret == 0 || errno == 0) { return 0; }
+            return -1;
+        default :
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+// once the kernel has the keys a plain write is encrypted on the way out
+ssize_t Tls_write(struct ssl_st* ssl, const void* buf, size_t len)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        return write(SSL_get_fd(ssl), buf, len);
+    }
+#endif
+
+    int ret = SSL_write(ssl, buf, len);
+    if (ret > 0) { return ret; }
+
+    int err = SSL_get_error(ssl, ret);
+    ERR_clear_error();
+    if (err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+    }
+    else if (err != SSL_ERROR_SYSCALL) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+bool Tls_pending(struct ssl_st* ssl)
+{
+    return SSL_pending(ssl) > 0;
+}
+
+void Tls_free(struct ssl_st** sslp)
+{
+    if (*sslp) {
+        SSL_shutdown(*sslp);
+        ERR_clear_error();
+        SSL_free(*sslp);
+        *sslp = NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,51 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_TLS_H
+#define EBBNC_TLS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "config.h"
+#include "upstream.h"
+
+// a bouncer with tls set answers the client's AUTH TLS itself, so the
+// handshake ends here instead of at the server. terminate relays the
+// session to the server in plaintext, reoriginate sends its own AUTH TLS
+// upstream first. only built with 'make TLS=1'.
+
+enum TlsMode {
+    TLS_NONE,
+    TLS_TERMINATE,
+    TLS_REORIGINATE
+};
+
+struct ssl_st;
+
+#ifdef EBBNC_TLS
+
+bool Tls_init(Config* config);
+struct ssl_st* Tls_accept(int sock);
+struct ssl_st* Tls_connect(int sock, Upstream* upstream);
+ssize_t Tls_read(struct ssl_st* ssl, void* buf, size_t len);
+ssize_t Tls_write(struct ssl_st* ssl, const void* buf, size_t len);
+bool Tls_pending(struct ssl_st* ssl);
+void Tls_free(struct ssl_st** sslp);
+
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+#define TOP_INTERVAL    1
+
+static const unsigned char v4Mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+static void formatAddr(const unsigned char addr[16], char* buf, size_t len)
+{
+    if (!memcmp(addr, v4Mapped, sizeof(v4Mapped))) {
+        inet_ntop(AF_INET, addr + 12, buf, len);
+    }
+    else {
+        inet_ntop(AF_INET6, addr, buf, len);
+    }
+}
+
+static int compareTalkers(const void* a, const void* b)
+{
+    const StatsTalker* ta = a;
+    const StatsTalker* tb = b;
+    return ta->bytes < tb->bytes ? 1 : ta->bytes > tb->bytes ? -1 : 0;
+}
+
+static double rate(uint64_t now, uint64_t prev)
+{
+    return now >= prev ? (double)(now - prev) / TOP_INTERVAL : 0;
+}
+
+static void show(const StatsSegment* cur, const StatsSegment* prev)
+{
+    printf("\033[H\033[2J");
+    printf("ebbnc-top  up %lis\n\n", (long)(time(NULL) - cur->started));
+
+    printf("%-4s %8s %6s %8s %6s %6s %9s\n", "proc", "pid", "sess", "restarts",
+           "pool", "idle", "saturated");
+
+    unsigned int i;
+    for (i = 0; i < cur->processCount && i < STATS_MAX_PROCESSES; ++i) {
+        const StatsProcess* proc = &cur->processes[i];
+        printf("%-4u %8i %6llu %8u %6u %6u %9llu\n", i, proc->pid,
+               (unsigned long long) proc->sessions, proc->restarts, proc->poolThreads,
+               proc->poolIdle, (unsigned long long) proc->poolSaturated);
+    }
+    printf("\n");
+
+    printf("%-3s %-40s %6s %7s %6s %6s %7s %9s %9s\n", "#", "bouncer", "sess",
+           "acc/s", "deny", "cfail", "noop/s", "in KB/s", "out KB/s");
+
+    for (i = 0; i < cur->bouncerCount; ++i) {
+        const StatsBouncer* b = &cur->bouncers[i];
+        const StatsBouncer* p = &prev->bouncers[i];
+        printf("%-3u %-40.40s %6llu %7.1f %6llu %6llu %7.1f %9.1f %9.1f\n",
+               i, b->name, (unsigned long long) b->sessions,
+               rate(b->accepts, p->accepts), (unsigned long long) b->denied,
+               (unsigned long long) b->connectFailures,
+               rate(b->noopsAbsorbed, p->noopsAbsorbed),
+               rate(b->bytesIn, p->bytesIn) / 1024, rate(b->bytesOut, p->bytesOut) / 1024);
+    }
+
+    printf("\n%-3s", "#");
+    unsigned int phase;
+    for (phase = 0; phase < STATS_PHASES; ++phase) {
+        printf(" %12s", Stats_phaseName(phase));
+    }
+    printf("\n");
+
+    for (i = 0; i < cur->bouncerCount; ++i) {
+        const StatsBouncer* b = &cur->bouncers[i];
+        printf("%-3u", i);
+        for (phase = 0; phase < STATS_PHASES; ++phase) {
+            printf(" %6.1f/%-5.1f",
+                   StatsHistogram_percentile(&b->phaseUs[phase], 50) / 1000.0,
+                   StatsHistogram_percentile(&b->phaseUs[phase], 99) / 1000.0);
+        }
+        printf("\n");
+    }
+    printf("%-3s setup phases in ms, p50/p99\n", "");
+
+    printf("\n%-8s %6s %9s\n", "worker", "sess", "KB/s");
+    for (i = 0; i < cur->workerCount; ++i) {
+        printf("%-8u %6llu %9.1f\n", i, (unsigned long long) cur->workers[i].sessions,
+               rate(cur->workers[i].bytes, prev->workers[i].bytes) / 1024);
+    }
+
+    if (cur->pairCount > 0) {
+        printf("\n%-40s %-5s %8s %8s %8s\n", "bouncer > upstream", "cmd", "count", "p50 ms", "p99 ms");
+    }
+    for (i = 0; i < cur->pairCount; ++i) {
+        const StatsCommands* pair = &cur->pairs[i];
+        unsigned int command;
+        for (command = 0; command < STATS_COMMANDS; ++command) {
+            const StatsHistogram* hist = &pair->latencyUs[command];
+            if (hist->count == 0) { continue; }
+            printf("%-40.40s %-5s %8llu %8.1f %8.1f\n", pair->name,
+                   Stats_commandName(command), (unsigned long long) hist->count,
+                   StatsHistogram_percentile(hist, 50) / 1000.0,
+                   StatsHistogram_percentile(hist, 99) / 1000.0);
+        }
+    }
+
+    if (cur->upstreamCount > 0) {
+        printf("\n%-40s %5s %8s %8s %8s %6s %5s %9s %8s\n", "upstream", "score", "rtt ms",
+               "var ms", "min ms", "loss%", "cwnd", "MB/s", "samples");
+    }
+    for (i = 0; i < cur->upstreamCount; ++i) {
+        const StatsUpstream* up = &cur->upstreams[i];
+        printf("%-40.40s %5u %8.2f %8.2f %8.2f %6.1f %5u %9.1f %8llu\n", up->name, up->score,
+               up->rttUs / 1000.0, up->rttVarUs / 1000.0, up->minRttUs / 1000.0,
+               up->lossPermille / 10.0, up->cwnd, up->deliveryRate / 1048576.0,
+               (unsigned long long) up->samples);
+    }
+
+    StatsTalker talkers[STATS_TALKERS];
+    memcpy(talkers, cur->talkers, sizeof(talkers));
+    qsort(talkers, STATS_TALKERS, sizeof(talkers[0]), compareTalkers);
+
+    printf("\n%-40s %12s\n", "top talkers", "MB");
+    for (i = 0; i < STATS_TALKERS && talkers[i].bytes > 0; ++i) {
+        char addr[INET6_ADDRSTRLEN];
+        formatAddr(talkers[i].addr, addr, sizeof(addr));
+        printf("%-40s %12.1f\n", addr, talkers[i].bytes / 1048576.0);
+    }
+
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [stats name]\n", argv[0]);
+        return 1;
+    }
+
+    const char* name = argc == 2 ? argv[1] : STATS_NAME;
+    StatsSegment* segment = Stats_map(name);
+    if (!segment) {
+        fprintf(stderr, "Unable to map stats segment /%s, is the bouncer running?\n", name);
+        return 1;
+    }
+
+    StatsSegment* cur = malloc(sizeof(StatsSegment));
+    StatsSegment* prev = malloc(sizeof(StatsSegment));
+    if (!cur || !prev) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (!Stats_snapshot(segment, prev)) {
+        fprintf(stderr, "Unable to read stats segment.\n");
+        return 1;
+    }
+
+    while (true) {
+        sleep(TOP_INTERVAL);
+
+        // a restarted bouncer publishes a new segment under the name
+        StatsSegment* fresh = Stats_map(name);
+        if (fresh) {
+            munmap(segment, sizeof(StatsSegment));
+            segment = fresh;
+        }
+
+        if (!Stats_snapshot(segment, cur)) { continue; }
+        if (cur->started != prev->started) { memcpy(prev, cur, sizeof(*prev)); }
+
+        show(cur, prev);
+
+        StatsSegment* temp = prev;
+        prev = cur;
+        cur = temp;
+    }
+
+    return 0;
+}
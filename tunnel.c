@@ -0,0 +1,1038 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include "tunnel.h"
+#include "client.h"
+#include "resolve.h"
+
+#define TUNNEL_RETRY_DELAY  1
+#define TUNNEL_MAC_PRIME    ((1ULL << 61) - 1)
+#define TUNNEL_MAC_R_MASK   ((1ULL << 60) - 1)
+
+typedef struct {
+    uint16_t        family;
+    uint16_t        port;
+    unsigned char   addr[16];
+} TunnelOpen;
+
+static bool launchDetached(void* (*threadMain)(void*), void* arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLIENT_STACKSIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, &attr, threadMain, arg);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        return false;
+    }
+
+    return true;
+}
+
+static bool readAll(int sock, void* buf, size_t len)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t ret = read(sock, p, len);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret <= 0) { return false; }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool writevAll(int sock, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t ret = writev(sock, iov, iovcnt);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret <= 0) { return false; }
+
+        while (iovcnt > 0 && (size_t) ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+// one key from another, cbc-macs under it of a fixed three blocks: what
+// the key is for and its epoch, then the nonces of the edge and the core
+static void TunnelLink_kdf(const unsigned char* from, char purpose, uint32_t epoch,
+                           const unsigned char* edgeNonce, const unsigned char* coreNonce,
+                           unsigned char key[XTEA_KEY_SIZE])
+{
+    unsigned int half;
+    for (half = 0; half < XTEA_KEY_SIZE / XTEA_BLOCK_SIZE; ++half) {
+        unsigned char input[XTEA_BLOCK_SIZE * 3];
+        memset(input, 0, sizeof(input));
+        input[0] = purpose;
+        input[1] = half;
+        uint32_t be = htonl(epoch);
+        memcpy(input + 4, &be, sizeof(be));
+        if (edgeNonce) { memcpy(input + XTEA_BLOCK_SIZE, edgeNonce, XTEA_BLOCK_SIZE); }
+        if (coreNonce) { memcpy(input + XTEA_BLOCK_SIZE * 2, coreNonce, XTEA_BLOCK_SIZE); }
+        XTeaCBCMAC(input, input + XTEA_BLOCK_SIZE, XTEA_BLOCK_SIZE * 2,
+                   key + half * XTEA_BLOCK_SIZE, from);
+    }
+}
+
+static TunnelLink* TunnelLink_new(int sock, Server* server, const char* key)
+{
+    TunnelLink* link = calloc(1, sizeof(TunnelLink));
+    if (!link) { return NULL; }
+
+    // keys longer than a block key are cut short, same as makeconf
+    if (key) {
+        unsigned char tunnelKey[XTEA_KEY_SIZE];
+        size_t len = strlen(key);
+        memset(tunnelKey, 0, sizeof(tunnelKey));
+        memcpy(tunnelKey, key, len < XTEA_KEY_SIZE ? len : XTEA_KEY_SIZE);
+        TunnelLink_kdf(tunnelKey, 'H', 0, NULL, NULL, link->helloKey);
+        TunnelLink_kdf(tunnelKey, 'B', 0, NULL, NULL, link->baseKey);
+        if (XTeaGenerateIVec(link->sendNonce) < 0) {
+            free(link);
+            return NULL;
+        }
+        link->encrypted = true;
+    }
+
+    link->sock = sock;
+    link->server = server;
+    link->refs = 1;
+    pthread_mutex_init(&link->mutex, NULL);
+    pthread_mutex_init(&link->writeMutex, NULL);
+    pthread_cond_init(&link->writeCond, NULL);
+    Sched_init(&link->sched, TUNNEL_QUANTUM);
+
+    int optval = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    return link;
+}
+
+static void TunnelLink_ref(TunnelLink* link)
+{
+    pthread_mutex_lock(&link->mutex);
+    link->refs++;
+    pthread_mutex_unlock(&link->mutex);
+}
+
+static void TunnelLink_unref(TunnelLink* link)
+{
+    pthread_mutex_lock(&link->mutex);
+    bool last = --link->refs == 0;
+    pthread_mutex_unlock(&link->mutex);
+
+    if (last) {
+        close(link->sock);
+        pthread_mutex_destroy(&link->mutex);
+        pthread_mutex_destroy(&link->writeMutex);
+        pthread_cond_destroy(&link->writeCond);
+        free(link);
+    }
+}
+
+// must hold the write mutex, dead is set under both mutexes so either
+// is enough to read it
+static void TunnelLink_markDead(TunnelLink* link)
+{
+    if (link->dead) { return; }
+
+    pthread_mutex_lock(&link->mutex);
+    link->dead = true;
+    pthread_mutex_unlock(&link->mutex);
+    shutdown(link->sock, SHUT_RDWR);
+}
+
+static void TunnelLink_kill(TunnelLink* link)
+{
+    pthread_mutex_lock(&link->writeMutex);
+    TunnelLink_markDead(link);
+    pthread_mutex_unlock(&link->writeMutex);
+}
+
+// carter-wegman: a polynomial hash mod 2^61 - 1 of the ciphertext in 7
+// byte limbs and its length, plus xtea of the sequence number and length
+// so frames can neither be replayed, reordered nor extended. the hash is
+// a multiply per limb where a cbc-mac would be a block cipher call.
+static uint64_t TunnelLink_mulMod(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t) a * b;
+    uint64_t sum = ((uint64_t) product & TUNNEL_MAC_PRIME) + (uint64_t) (product >> 61);
+    return sum >= TUNNEL_MAC_PRIME ? sum - TUNNEL_MAC_PRIME : sum;
+}
+
+static uint64_t TunnelLink_addMod(uint64_t a, uint64_t b)
+{
+    uint64_t sum = a + b;
+    return sum >= TUNNEL_MAC_PRIME ? sum - TUNNEL_MAC_PRIME : sum;
+}
+
+static void TunnelLink_mac(uint32_t seq, const unsigned char* frame, size_t len,
+                           unsigned char mac[TUNNEL_MAC_SIZE], const unsigned char* key,
+                           uint64_t r)
+{
+    uint64_t hash = 0;
+    size_t i;
+    for (i = 0; i < len; i += 7) {
+        uint64_t limb = 0;
+        memcpy(&limb, frame + i, len - i < 7 ? len - i : 7);
+        hash = TunnelLink_mulMod(TunnelLink_addMod(hash, le64toh(limb)), r);
+    }
+    hash = TunnelLink_mulMod(TunnelLink_addMod(hash, len), r);
+
+    uint32_t first[2] = { htonl(seq), htonl(len) };
+    uint64_t pad;
+    XTeaCBCMAC((const unsigned char*) first, NULL, 0, (unsigned char*) &pad, key);
+    hash = htole64(TunnelLink_addMod(hash, le64toh(pad) & TUNNEL_MAC_PRIME));
+    memcpy(mac, &hash, TUNNEL_MAC_SIZE);
+}
+
+// the keys of one direction for its current epoch, the purposes differ
+// by direction so a link can't be fed back its own frames
+static void TunnelLink_rekey(TunnelLink* link, bool send)
+{
+    bool core = link->server != NULL;
+    const unsigned char* edgeNonce = core ? link->recvNonce : link->sendNonce;
+    const unsigned char* coreNonce = core ? link->sendNonce : link->recvNonce;
+    bool edgeToCore = core != send;
+    uint32_t epoch = send ? link->sendEpoch : link->recvEpoch;
+    unsigned char* key = send ? link->sendKey : link->recvKey;
+    unsigned char* macKey = send ? link->sendMacKey : link->recvMacKey;
+    uint64_t* r = send ? &link->sendMacR : &link->recvMacR;
+
+    TunnelLink_kdf(link->baseKey, edgeToCore ? 'E' : 'C', epoch, edgeNonce, coreNonce, key);
+    TunnelLink_kdf(link->baseKey, edgeToCore ? 'e' : 'c', epoch, edgeNonce, coreNonce, macKey);
+
+    // the hash key comes from a block no frame's pad can be made of
+    static const unsigned char rBlock[XTEA_BLOCK_SIZE] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+    XTeaCBCMAC(rBlock, NULL, 0, (unsigned char*) r, macKey);
+    *r = le64toh(*r) & TUNNEL_MAC_R_MASK;
+
+    if (send) {
+        link->sendOffset = 0;
+        link->sendSeq = 0;
+    }
+    else {
+        link->recvOffset = 0;
+        link->recvSeq = 0;
+    }
+}
+
+// once both hellos are through
+static void TunnelLink_deriveKeys(TunnelLink* link)
+{
+    if (!link->encrypted) { return; }
+
+    TunnelLink_rekey(link, true);
+    TunnelLink_rekey(link, false);
+}
+
+static bool TunnelLink_write(TunnelLink* link, TunnelFrame* frame)
+{
+    const void* payload = frame->payload;
+    uint16_t len = frame->len;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &frame->header;
+    iov[0].iov_len = sizeof(frame->header);
+    iov[1].iov_base = (void*) payload;
+    iov[1].iov_len = len;
+
+    if (link->encrypted) {
+        unsigned char* p = link->sendBuf;
+        size_t size = sizeof(frame->header) + len;
+        XTeaCTR((unsigned char*) &frame->header, p, sizeof(frame->header), link->sendNonce,
+                link->sendOffset, link->sendKey);
+        XTeaCTR(payload, p + sizeof(frame->header), len, link->sendNonce,
+                link->sendOffset + sizeof(frame->header), link->sendKey);
+        link->sendOffset += size;
+
+        TunnelLink_mac(link->sendSeq++, p, size, p + size, link->sendMacKey, link->sendMacR);
+
+        // both ends count the same bytes, so they move to the next keys
+        // after the same frame without saying so
+        if (link->sendOffset >= TUNNEL_REKEY_BYTES) {
+            link->sendEpoch++;
+            TunnelLink_rekey(link, true);
+        }
+
+        iov[0].iov_base = p;
+        iov[0].iov_len = size + TUNNEL_MAC_SIZE;
+        len = 0;
+    }
+
+    return writevAll(link->sock, iov, len > 0 ? 2 : 1);
+}
+
+// frames are queued per flow and written in deficit round robin order by
+// whichever sender finds the link idle, the others wait for their frame
+// to be written. a stream with a reply to send gets ahead of streams that
+// are pushing full frames back to back.
+static bool TunnelLink_send(TunnelLink* link, TunnelFlow* flow, uint32_t stream,
+                            uint8_t type, uint8_t flags, const void* payload, uint16_t len)
+{
+    TunnelFrame frame;
+    frame.header.stream = htonl(stream);
+    frame.header.type = type;
+    frame.header.flags = flags;
+    frame.header.length = htons(len);
+    frame.payload = payload;
+    frame.len = len;
+    frame.done = false;
+    frame.okay = false;
+
+    pthread_mutex_lock(&link->writeMutex);
+    while (flow->frame) { pthread_cond_wait(&link->writeCond, &link->writeMutex); }
+    flow->frame = &frame;
+    Sched_push(&link->sched, &flow->sched, sizeof(frame.header) + len);
+
+    while (!frame.done) {
+        if (link->writing) {
+            pthread_cond_wait(&link->writeCond, &link->writeMutex);
+            continue;
+        }
+
+        link->writing = true;
+        SchedFlow* next;
+        while ((next = Sched_pop(&link->sched))) {
+            TunnelFlow* owner = (TunnelFlow*) next;
+            TunnelFrame* queued = owner->frame;
+            owner->frame = NULL;
+
+            bool dead = link->dead;
+            pthread_mutex_unlock(&link->writeMutex);
+            bool okay = !dead && TunnelLink_write(link, queued);
+            pthread_mutex_lock(&link->writeMutex);
+
+            if (!okay) { TunnelLink_markDead(link); }
+            queued->okay = okay;
+            queued->done = true;
+        }
+        link->writing = false;
+        pthread_cond_broadcast(&link->writeCond);
+    }
+
+    pthread_mutex_unlock(&link->writeMutex);
+    return frame.okay;
+}
+
+// must hold the link mutex
+static TunnelStream* TunnelLink_find(TunnelLink* link, uint32_t id)
+{
+    TunnelStream* stream = link->streams[id % TUNNEL_BUCKETS];
+    while (stream && stream->id != id) { stream = stream->next; }
+    return stream;
+}
+
+static void TunnelStream_wake(TunnelStream* stream)
+{
+    char c = 0;
+    IGNORE_RESULT(write(stream->wake[1], &c, 1));
+}
+
+static TunnelStream* TunnelStream_new(TunnelLink* link, uint32_t id, int fd)
+{
+    TunnelStream* stream = calloc(1, sizeof(TunnelStream));
+    if (!stream) { return NULL; }
+
+    stream->recvBuf = malloc(TUNNEL_WINDOW);
+    if (!stream->recvBuf) {
+        free(stream);
+        return NULL;
+    }
+
+    if (pipe(stream->wake) < 0) {
+        free(stream->recvBuf);
+        free(stream);
+        return NULL;
+    }
+
+    fcntl(stream->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(stream->wake[1], F_SETFL, O_NONBLOCK);
+
+    stream->id = id;
+    stream->fd = fd;
+    stream->link = link;
+    stream->sendWindow = TUNNEL_WINDOW;
+    return stream;
+}
+
+static void TunnelStream_free(TunnelStream* stream)
+{
+    TunnelLink* link = stream->link;
+    pthread_mutex_lock(&link->writeMutex);
+    Sched_remove(&link->sched, &stream->flow.sched);
+    pthread_mutex_unlock(&link->writeMutex);
+
+    close(stream->fd);
+    close(stream->wake[0]);
+    close(stream->wake[1]);
+    free(stream->recvBuf);
+    free(stream);
+}
+
+// must hold the link mutex
+static bool TunnelLink_insert(TunnelLink* link, TunnelStream* stream)
+{
+    if (link->dead || TunnelLink_find(link, stream->id)) { return false; }
+
+    TunnelStream** bucket = &link->streams[stream->id % TUNNEL_BUCKETS];
+    stream->next = *bucket;
+    *bucket = stream;
+    link->streamCount++;
+    link->refs++;
+    return true;
+}
+
+static void TunnelLink_remove(TunnelLink* link, TunnelStream* stream)
+{
+    pthread_mutex_lock(&link->mutex);
+    TunnelStream** p = &link->streams[stream->id % TUNNEL_BUCKETS];
+    while (*p && *p != stream) { p = &(*p)->next; }
+    if (*p) {
+        *p = stream->next;
+        link->streamCount--;
+    }
+    pthread_mutex_unlock(&link->mutex);
+}
+
+// moves bytes between the session's socketpair and the link, the link
+// reader fills recvBuf and the window stops it from ever overflowing
+static void* TunnelStream_threadMain(void* streamv)
+{
+    TunnelStream* stream = streamv;
+    TunnelLink* link = stream->link;
+    unsigned char buf[TUNNEL_MAX_FRAME];
+    size_t unacked = 0;
+    bool shutdownSent = false;
+
+    while (true) {
+        pthread_mutex_lock(&link->mutex);
+        bool reset = stream->reset;
+        bool wantRead = !stream->localClosed && stream->sendWindow > 0;
+        size_t recvLen = stream->recvLen;
+        bool drained = stream->remoteClosed && recvLen == 0;
+        bool done = stream->localClosed && drained;
+        size_t window = stream->sendWindow;
+        pthread_mutex_unlock(&link->mutex);
+
+        if (reset || done) { break; }
+
+        if (drained && !shutdownSent) {
+            shutdown(stream->fd, SHUT_WR);
+            shutdownSent = true;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = stream->fd;
+        fds[0].events = (wantRead ? POLLIN : 0) | (recvLen > 0 ? POLLOUT : 0);
+        fds[0].revents = 0;
+        if (fds[0].events == 0) { fds[0].fd = -1; }
+        fds[1].fd = stream->wake[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (read(stream->wake[0], buf, sizeof(buf)) > 0) { }
+        }
+
+        if (wantRead && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            size_t max = window < sizeof(buf) ? window : sizeof(buf);
+            ssize_t len = read(stream->fd, buf, max);
+            if (len <= 0) {
+                pthread_mutex_lock(&link->mutex);
+                stream->localClosed = true;
+                pthread_mutex_unlock(&link->mutex);
+                if (!TunnelLink_send(link, &stream->flow, stream->id, TUNNEL_CLOSE, 0, NULL, 0)) { break; }
+            }
+            else {
+                pthread_mutex_lock(&link->mutex);
+                stream->sendWindow -= len;
+                pthread_mutex_unlock(&link->mutex);
+                if (!TunnelLink_send(link, &stream->flow, stream->id, TUNNEL_DATA, 0, buf, len)) { break; }
+            }
+        }
+
+        if (recvLen > 0 && (fds[0].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            pthread_mutex_lock(&link->mutex);
+            size_t chunk = stream->recvLen;
+            if (chunk > TUNNEL_WINDOW - stream->recvHead) {
+                chunk = TUNNEL_WINDOW - stream->recvHead;
+            }
+            const unsigned char* p = stream->recvBuf + stream->recvHead;
+            pthread_mutex_unlock(&link->mutex);
+
+            ssize_t len = send(stream->fd, p, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+
+            if (len <= 0) {
+                TunnelLink_send(link, &stream->flow, stream->id, TUNNEL_CLOSE, TUNNEL_FLAG_RESET, NULL, 0);
+                break;
+            }
+
+            pthread_mutex_lock(&link->mutex);
+            stream->recvHead = (stream->recvHead + len) % TUNNEL_WINDOW;
+            stream->recvLen -= len;
+            bool empty = stream->recvLen == 0;
+            pthread_mutex_unlock(&link->mutex);
+
+            // credit in batches to keep window updates off the wire
+            unacked += len;
+            if (empty || unacked >= TUNNEL_WINDOW / 4) {
+                uint32_t credit = htonl(unacked);
+                unacked = 0;
+                if (!TunnelLink_send(link, &stream->flow, stream->id, TUNNEL_WINDOW_UPDATE, 0,
+                                     &credit, sizeof(credit))) {
+                    break;
+                }
+            }
+        }
+    }
+
+    TunnelLink_remove(link, stream);
+    TunnelStream_free(stream);
+    TunnelLink_unref(link);
+    return NULL;
+}
+
+static bool TunnelStream_launch(TunnelStream* stream)
+{
+    if (!launchDetached(TunnelStream_threadMain, stream)) {
+        perror("pthread_create");
+        TunnelLink_remove(stream->link, stream);
+        TunnelLink* link = stream->link;
+        TunnelStream_free(stream);
+        TunnelLink_unref(link);
+        return false;
+    }
+    return true;
+}
+
+// core side, a new session arrives over the link
+static bool TunnelLink_open(TunnelLink* link, uint32_t id,
+                            const unsigned char* payload, uint16_t len)
+{
+    TunnelOpen open;
+    if (len != sizeof(open)) { return false; }
+    memcpy(&open, payload, sizeof(open));
+
+    struct sockaddr_any addr;
+    memset(&addr, 0, sizeof(addr));
+    switch (ntohs(open.family)) {
+        case 4 :
+            addr.san_family = AF_INET;
+            addr.s4.sin_port = open.port;
+            memcpy(&addr.s4.sin_addr, open.addr, 4);
+            break;
+        case 6 :
+            addr.san_family = AF_INET6;
+            addr.s6.sin6_port = open.port;
+            memcpy(&addr.s6.sin6_addr, open.addr, 16);
+            break;
+        default :
+            return false;
+    }
+
+    // each stream is a thread and a socketpair here, so one link can't
+    // have more than its share
+    pthread_mutex_lock(&link->mutex);
+    bool full = link->streamCount >= TUNNEL_MAX_STREAMS;
+    pthread_mutex_unlock(&link->mutex);
+    if (full) {
+        return TunnelLink_send(link, &link->control, id, TUNNEL_CLOSE, TUNNEL_FLAG_RESET, NULL, 0);
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return TunnelLink_send(link, &link->control, id, TUNNEL_CLOSE, TUNNEL_FLAG_RESET, NULL, 0);
+    }
+
+    TunnelStream* stream = TunnelStream_new(link, id, sv[0]);
+    if (!stream) {
+        close(sv[0]);
+        close(sv[1]);
+        return TunnelLink_send(link, &link->control, id, TUNNEL_CLOSE, TUNNEL_FLAG_RESET, NULL, 0);
+    }
+
+    pthread_mutex_lock(&link->mutex);
+    bool okay = TunnelLink_insert(link, stream);
+    pthread_mutex_unlock(&link->mutex);
+    if (!okay) {
+        TunnelStream_free(stream);
+        close(sv[1]);
+        return false;
+    }
+
+    if (TunnelStream_launch(stream)) {
+        Client_launch(link->server, sv[1], &addr);
+    }
+    else {
+        close(sv[1]);
+    }
+
+    return true;
+}
+
+static bool TunnelLink_dispatch(TunnelLink* link, const TunnelFrameHeader* header,
+                                const unsigned char* payload)
+{
+    uint32_t id = ntohl(header->stream);
+    uint16_t len = ntohs(header->length);
+
+    if (header->type == TUNNEL_OPEN) {
+        return link->server && TunnelLink_open(link, id, payload, len);
+    }
+
+    pthread_mutex_lock(&link->mutex);
+    TunnelStream* stream = TunnelLink_find(link, id);
+    bool okay = true;
+    if (stream) {
+        switch (header->type) {
+            case TUNNEL_DATA : {
+                if (len > TUNNEL_WINDOW - stream->recvLen) {
+                    okay = false;
+                    break;
+                }
+
+                size_t tail = (stream->recvHead + stream->recvLen) % TUNNEL_WINDOW;
+                size_t first = len < TUNNEL_WINDOW - tail ? len : TUNNEL_WINDOW - tail;
+                memcpy(stream->recvBuf + tail, payload, first);
+                memcpy(stream->recvBuf, payload + first, len - first);
+                stream->recvLen += len;
+                break;
+            }
+            case TUNNEL_WINDOW_UPDATE : {
+                uint32_t credit;
+                if (len != sizeof(credit)) {
+                    okay = false;
+                    break;
+                }
+                memcpy(&credit, payload, sizeof(credit));
+                stream->sendWindow += ntohl(credit);
+                break;
+            }
+            case TUNNEL_CLOSE : {
+                stream->remoteClosed = true;
+                if (header->flags & TUNNEL_FLAG_RESET) { stream->reset = true; }
+                break;
+            }
+            default : {
+                okay = false;
+                break;
+            }
+        }
+        TunnelStream_wake(stream);
+    }
+    pthread_mutex_unlock(&link->mutex);
+
+    // frames for streams already gone are dropped
+    return okay;
+}
+
+// the header is decrypted first for the length, but nothing of the frame
+// is used before its mac is checked
+static bool TunnelLink_read(TunnelLink* link, TunnelFrameHeader* header, unsigned char* payload)
+{
+    if (!link->encrypted) {
+        return readAll(link->sock, header, sizeof(*header)) &&
+               ntohs(header->length) <= TUNNEL_MAX_FRAME &&
+               readAll(link->sock, payload, ntohs(header->length));
+    }
+
+    unsigned char* frame = link->recvBuf;
+    if (!readAll(link->sock, frame, sizeof(*header))) { return false; }
+    XTeaCTR(frame, (unsigned char*) header, sizeof(*header), link->recvNonce,
+            link->recvOffset, link->recvKey);
+
+    size_t len = ntohs(header->length);
+    if (len > TUNNEL_MAX_FRAME ||
+        !readAll(link->sock, frame + sizeof(*header), len + TUNNEL_MAC_SIZE)) {
+        return false;
+    }
+
+    size_t size = sizeof(*header) + len;
+    unsigned char mac[TUNNEL_MAC_SIZE];
+    TunnelLink_mac(link->recvSeq++, frame, size, mac, link->recvMacKey, link->recvMacR);
+
+    unsigned char diff = 0;
+    unsigned int i;
+    for (i = 0; i < TUNNEL_MAC_SIZE; ++i) { diff |= mac[i] ^ frame[size + i]; }
+    if (diff != 0) {
+        fprintf(stderr, "Tunnel frame failed authentication\n");
+        return false;
+    }
+
+    XTeaCTR(frame + sizeof(*header), payload, len, link->recvNonce,
+            link->recvOffset + sizeof(*header), link->recvKey);
+    link->recvOffset += size;
+
+    if (link->recvOffset >= TUNNEL_REKEY_BYTES) {
+        link->recvEpoch++;
+        TunnelLink_rekey(link, false);
+    }
+    return true;
+}
+
+static void TunnelLink_readLoop(TunnelLink* link)
+{
+    unsigned char payload[TUNNEL_MAX_FRAME];
+    TunnelFrameHeader header;
+    while (TunnelLink_read(link, &header, payload) &&
+           TunnelLink_dispatch(link, &header, payload)) { }
+
+    TunnelLink_kill(link);
+
+    pthread_mutex_lock(&link->mutex);
+    unsigned int i;
+    for (i = 0; i < TUNNEL_BUCKETS; ++i) {
+        TunnelStream* stream;
+        for (stream = link->streams[i]; stream; stream = stream->next) {
+            stream->reset = true;
+            TunnelStream_wake(stream);
+        }
+    }
+    pthread_mutex_unlock(&link->mutex);
+}
+
+// must be sent before any other frame, it is the only one in the clear
+static bool TunnelLink_hello(TunnelLink* link)
+{
+    TunnelHello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, TUNNEL_MAGIC, sizeof(hello.magic));
+    hello.version = TUNNEL_VERSION;
+
+    TunnelFrameHeader header;
+    header.stream = 0;
+    header.type = TUNNEL_HELLO;
+    header.flags = 0;
+    header.length = htons(sizeof(hello));
+
+    pthread_mutex_lock(&link->writeMutex);
+    if (link->encrypted) {
+        hello.encrypted = 1;
+        memcpy(hello.nonce, link->sendNonce, sizeof(hello.nonce));
+        XTeaCTR((unsigned char*) TUNNEL_MAGIC, hello.check, sizeof(hello.check),
+                link->sendNonce, 0, link->helloKey);
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = &hello;
+    iov[1].iov_len = sizeof(hello);
+
+    bool okay = !link->dead && writevAll(link->sock, iov, 2);
+    if (!okay) { TunnelLink_markDead(link); }
+    pthread_mutex_unlock(&link->writeMutex);
+
+    return okay;
+}
+
+static bool TunnelLink_checkHello(TunnelLink* link)
+{
+    TunnelFrameHeader header;
+    TunnelHello hello;
+    if (!readAll(link->sock, &header, sizeof(header)) ||
+        header.type != TUNNEL_HELLO ||
+        ntohs(header.length) != sizeof(hello) ||
+        !readAll(link->sock, &hello, sizeof(hello)) ||
+        memcmp(hello.magic, TUNNEL_MAGIC, sizeof(hello.magic)) ||
+        hello.version != TUNNEL_VERSION) {
+        return false;
+    }
+
+    if (hello.encrypted != link->encrypted) {
+        fprintf(stderr, "Tunnel peer %s a tunnel key\n",
+                link->encrypted ? "does not have" : "requires");
+        return false;
+    }
+
+    if (link->encrypted) {
+        unsigned char check[sizeof(hello.check)];
+        memcpy(link->recvNonce, hello.nonce, sizeof(link->recvNonce));
+        XTeaCTR(hello.check, check, sizeof(check), link->recvNonce, 0, link->helloKey);
+        if (memcmp(check, TUNNEL_MAGIC, sizeof(check))) {
+            fprintf(stderr, "Tunnel peer has a different tunnel key\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void* TunnelLink_coreMain(void* linkv)
+{
+    TunnelLink* link = linkv;
+    if (TunnelLink_checkHello(link) && TunnelLink_hello(link)) {
+        TunnelLink_deriveKeys(link);
+        TunnelLink_readLoop(link);
+    }
+    TunnelLink_unref(link);
+    return NULL;
+}
+
+void Tunnel_accept(Server* server, int sock)
+{
+    TunnelLink* link = TunnelLink_new(sock, server, server->bouncer->tunnelKey);
+    if (!link) {
+        perror("TunnelLink_new");
+        close(sock);
+        return;
+    }
+
+    if (!launchDetached(TunnelLink_coreMain, link)) {
+        perror("pthread_create");
+        TunnelLink_unref(link);
+    }
+}
+
+typedef struct {
+    Tunnel*         tunnel;
+    unsigned int    slot;
+} TunnelSlot;
+
+static TunnelLink* Tunnel_connect(Tunnel* tunnel)
+{
+    struct sockaddr_any addr;
+    if (!Resolve_address(tunnel->bouncer->remoteHost, tunnel->bouncer->remotePort,
+                         &addr, NULL)) {
+        return NULL;
+    }
+
+    int sock = socket(addr.san_family, SOCK_STREAM, 0);
+    if (sock < 0) { return NULL; }
+
+    if (tunnel->bouncer->localIP) {
+        struct sockaddr_any lAddr;
+        if (ipPortToSockaddr(tunnel->bouncer->localIP, 0, &lAddr) &&
+            lAddr.san_family == addr.san_family) {
+            IGNORE_RESULT(bind(sock, &lAddr.sa, sockaddrLen(&lAddr)));
+        }
+    }
+
+    if (connect(sock, &addr.sa, sockaddrLen(&addr)) < 0) {
+        close(sock);
+        return NULL;
+    }
+
+    TunnelLink* link = TunnelLink_new(sock, NULL, tunnel->bouncer->tunnelKey);
+    if (!link) {
+        close(sock);
+        return NULL;
+    }
+
+    if (!TunnelLink_hello(link) || !TunnelLink_checkHello(link)) {
+        TunnelLink_unref(link);
+        return NULL;
+    }
+    TunnelLink_deriveKeys(link);
+
+    return link;
+}
+
+// edge side, keeps one link slot connected for the life of the process
+static void* Tunnel_linkMain(void* slotv)
+{
+    TunnelSlot* slot = slotv;
+    Tunnel* tunnel = slot->tunnel;
+
+    while (true) {
+        TunnelLink* link = Tunnel_connect(tunnel);
+        if (!link) {
+            sleep(TUNNEL_RETRY_DELAY);
+            continue;
+        }
+
+        TunnelLink_ref(link);
+        pthread_mutex_lock(&tunnel->mutex);
+        tunnel->links[slot->slot] = link;
+        pthread_mutex_unlock(&tunnel->mutex);
+
+        TunnelLink_readLoop(link);
+
+        pthread_mutex_lock(&tunnel->mutex);
+        tunnel->links[slot->slot] = NULL;
+        pthread_mutex_unlock(&tunnel->mutex);
+
+        TunnelLink_unref(link);
+        TunnelLink_unref(link);
+        sleep(TUNNEL_RETRY_DELAY);
+    }
+
+    return NULL;
+}
+
+bool Tunnel_startAll(Config* config)
+{
+    Bouncer* bouncer;
+    for (bouncer = config->bouncers; bouncer; bouncer = bouncer->next) {
+        if (bouncer->tunnelMode != TUNNEL_EDGE) { continue; }
+
+        Tunnel* tunnel = calloc(1, sizeof(Tunnel));
+        if (!tunnel) {
+            perror("calloc");
+            return false;
+        }
+
+        tunnel->config = config;
+        tunnel->bouncer = bouncer;
+        pthread_mutex_init(&tunnel->mutex, NULL);
+        bouncer->tunnel = tunnel;
+
+        unsigned int i;
+        for (i = 0; i < (unsigned int) bouncer->tunnelLinks; ++i) {
+            TunnelSlot* slot = calloc(1, sizeof(TunnelSlot));
+            if (!slot) {
+                perror("calloc");
+                return false;
+            }
+
+            slot->tunnel = tunnel;
+            slot->slot = i;
+            if (!launchDetached(Tunnel_linkMain, slot)) {
+                perror("pthread_create");
+                free(slot);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// edge side, returns the session's end of a new stream
+int Tunnel_open(Bouncer* bouncer, const struct sockaddr_any* addr)
+{
+    Tunnel* tunnel = bouncer->tunnel;
+    TunnelLink* link = NULL;
+    uint32_t id = 0;
+
+    pthread_mutex_lock(&tunnel->mutex);
+    unsigned int i;
+    for (i = 0; i < (unsigned int) bouncer->tunnelLinks && !link; ++i) {
+        link = tunnel->links[tunnel->nextLink++ % bouncer->tunnelLinks];
+    }
+    if (link) {
+        TunnelLink_ref(link);
+        id = ++tunnel->nextStream;
+    }
+    pthread_mutex_unlock(&tunnel->mutex);
+
+    if (!link) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    TunnelOpen open;
+    memset(&open, 0, sizeof(open));
+    switch (addr->san_family) {
+        case AF_INET :
+            open.family = htons(4);
+            open.port = addr->s4.sin_port;
+            memcpy(open.addr, &addr->s4.sin_addr, 4);
+            break;
+        case AF_INET6 :
+            open.family = htons(6);
+            open.port = addr->s6.sin6_port;
+            memcpy(open.addr, &addr->s6.sin6_addr, 16);
+            break;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        TunnelLink_unref(link);
+        return -1;
+    }
+
+    TunnelStream* stream = TunnelStream_new(link, id, sv[0]);
+    if (!stream) {
+        close(sv[0]);
+        close(sv[1]);
+        TunnelLink_unref(link);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&link->mutex);
+    bool okay = TunnelLink_insert(link, stream);
+    pthread_mutex_unlock(&link->mutex);
+
+    // the stream holds its own reference from here on
+    TunnelLink_unref(link);
+
+    if (!okay) {
+        TunnelStream_free(stream);
+        close(sv[1]);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    // the open frame goes out before the stream thread can send any data,
+    // the session itself can start writing straight away
+    if (!TunnelLink_send(link, &stream->flow, id, TUNNEL_OPEN, 0, &open, sizeof(open))) {
+        TunnelLink_remove(link, stream);
+        TunnelStream_free(stream);
+        TunnelLink_unref(link);
+        close(sv[1]);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (!TunnelStream_launch(stream)) {
+        close(sv[1]);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    return sv[1];
+}
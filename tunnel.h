@@ -0,0 +1,171 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_TUNNEL_H
+#define EBBNC_TUNNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "config.h"
+#include "server.h"
+#include "misc.h"
+#include "xtea.h"
+#include "sched.h"
+
+// an edge bouncer keeps a few persistent links to a core bouncer and
+// carries each client session over them as a stream of frames. each
+// stream is handed to the session as one end of a socketpair, so the
+// client code relays over it exactly as it would over a tcp socket.
+
+#define TUNNEL_MAGIC        "EBTN"
+#define TUNNEL_VERSION      4
+#define TUNNEL_MAX_FRAME    16384
+#define TUNNEL_WINDOW       65536
+#define TUNNEL_BUCKETS      256
+#define TUNNEL_MAX_LINKS    16
+#define TUNNEL_MAX_STREAMS  1024        // open on one link at once
+#define TUNNEL_QUANTUM      4096
+#define TUNNEL_MAC_SIZE     XTEA_BLOCK_SIZE
+#define TUNNEL_REKEY_BYTES  (256ULL << 20)  // per direction, well short of
+                                            // a 64 bit block's birthday bound
+
+enum TunnelMode {
+    TUNNEL_NONE,
+    TUNNEL_EDGE,
+    TUNNEL_CORE
+};
+
+enum TunnelFrameType {
+    TUNNEL_HELLO,
+    TUNNEL_OPEN,
+    TUNNEL_DATA,
+    TUNNEL_WINDOW_UPDATE,
+    TUNNEL_CLOSE
+};
+
+#define TUNNEL_FLAG_RESET   0x01
+
+// sent in the clear by both ends, with a key each end picks a fresh nonce
+// and check is the magic encrypted under the tunnel key and that nonce, so
+// a peer with another key is told so. the keys for the rest of the link
+// are derived from the tunnel key and both nonces, one pair per direction:
+// frames are encrypted with xtea in counter mode and followed by a mac of
+// their sequence number, length and ciphertext. a replayed hello gets a
+// new nonce back, so frames recorded from an earlier link never verify.
+typedef struct {
+    char            magic[4];
+    uint8_t         version;
+    uint8_t         encrypted;
+    unsigned char   nonce[XTEA_BLOCK_SIZE];
+    unsigned char   check[4];
+} TunnelHello;
+
+// all fields in network byte order
+typedef struct {
+    uint32_t    stream;
+    uint8_t     type;
+    uint8_t     flags;
+    uint16_t    length;
+} TunnelFrameHeader;
+
+// one frame waiting for its turn on the link, owned by the sender
+typedef struct {
+    TunnelFrameHeader   header;
+    const void*         payload;
+    uint16_t            len;
+    bool                done;
+    bool                okay;
+} TunnelFrame;
+
+// sched must come first, the link casts back from it
+typedef struct {
+    SchedFlow           sched;
+    TunnelFrame*        frame;
+} TunnelFlow;
+
+typedef struct TunnelStream {
+    uint32_t                id;
+    struct TunnelLink*      link;
+    int                     fd;
+    int                     wake[2];
+
+    // guarded by the link mutex
+    uint32_t                sendWindow;
+    unsigned char*          recvBuf;
+    size_t                  recvHead;
+    size_t                  recvLen;
+    bool                    localClosed;
+    bool                    remoteClosed;
+    bool                    reset;
+    struct TunnelStream*    next;
+
+    TunnelFlow              flow;               // guarded by the write mutex
+} TunnelStream;
+
+typedef struct TunnelLink {
+    int                     sock;
+    pthread_mutex_t         mutex;
+    pthread_mutex_t         writeMutex;
+    pthread_cond_t          writeCond;
+    Sched                   sched;              // guarded by the write mutex
+    TunnelFlow              control;            // frames without a stream
+    bool                    writing;            // a sender is draining sched
+    TunnelStream*           streams[TUNNEL_BUCKETS];
+    unsigned int            streamCount;
+    unsigned int            refs;
+    bool                    dead;
+    Server*                 server;
+
+    bool                    encrypted;
+    unsigned char           helloKey[XTEA_KEY_SIZE];        // both from the tunnel key
+    unsigned char           baseKey[XTEA_KEY_SIZE];
+    unsigned char           sendNonce[XTEA_BLOCK_SIZE];
+    unsigned char           recvNonce[XTEA_BLOCK_SIZE];
+    unsigned char           sendKey[XTEA_KEY_SIZE];
+    unsigned char           sendMacKey[XTEA_KEY_SIZE];
+    unsigned char           recvKey[XTEA_KEY_SIZE];
+    unsigned char           recvMacKey[XTEA_KEY_SIZE];
+    uint64_t                sendMacR;
+    uint64_t                recvMacR;
+    uint64_t                sendOffset;         // only used by the writing sender
+    uint64_t                recvOffset;         // only used by the reader
+    uint32_t                sendSeq;
+    uint32_t                recvSeq;
+    uint32_t                sendEpoch;          // keys in use, one more per rekey
+    uint32_t                recvEpoch;
+    unsigned char           sendBuf[sizeof(TunnelFrameHeader) + TUNNEL_MAX_FRAME +
+                                    TUNNEL_MAC_SIZE];
+    unsigned char           recvBuf[sizeof(TunnelFrameHeader) + TUNNEL_MAX_FRAME +
+                                    TUNNEL_MAC_SIZE];   // only used by the reader
+} TunnelLink;
+
+typedef struct Tunnel {
+    Config*             config;
+    Bouncer*            bouncer;
+    pthread_mutex_t     mutex;
+    TunnelLink*         links[TUNNEL_MAX_LINKS];
+    uint32_t            nextStream;
+    unsigned int        nextLink;
+    struct Tunnel*      next;
+} Tunnel;
+
+bool Tunnel_startAll(Config* config);
+int Tunnel_open(Bouncer* bouncer, const struct sockaddr_any* addr);
+void Tunnel_accept(Server* server, int sock);
+
+#endif
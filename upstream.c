@@ -0,0 +1,253 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "upstream.h"
+#include "misc.h"
+
+static pthread_mutex_t upstreamMutex = PTHREAD_MUTEX_INITIALIZER;
+static Upstream* upstreams = NULL;
+
+Upstream* Upstream_get(const char* host, long port)
+{
+    pthread_mutex_lock(&upstreamMutex);
+
+    Upstream* upstream;
+    for (upstream = upstreams; upstream; upstream = upstream->next) {
+        if (upstream->port == port && !strcasecmp(upstream->host, host)) {
+            break;
+        }
+    }
+
+    if (!upstream) {
+        upstream = calloc(1, sizeof(Upstream));
+        if (upstream) {
+            upstream->host = strdup(host);
+            if (!upstream->host) {
+                free(upstream);
+                upstream = NULL;
+            }
+        }
+
+        if (upstream) {
+            pthread_mutex_init(&upstream->mutex, NULL);
+            upstream->port = port;
+            upstream->quality.score = UPSTREAM_MAX_SCORE;
+            upstream->next = upstreams;
+            upstreams = upstream;
+        }
+    }
+
+    pthread_mutex_unlock(&upstreamMutex);
+    return upstream;
+}
+
+// host:port, the port follows the last colon so ipv6 hosts need no brackets
+Upstream* Upstream_parse(const char* hostPort)
+{
+    const char* colon = strrchr(hostPort, ':');
+    if (!colon || colon == hostPort || colon[1] == '\0') { return NULL; }
+
+    long port;
+    if (!strToLong(colon + 1, &port) || !isValidPort(port)) { return NULL; }
+
+    char* host = strndup(hostPort, colon - hostPort);
+    if (!host) { return NULL; }
+
+    Upstream* upstream = Upstream_get(host, port);
+    free(host);
+    return upstream;
+}
+
+// half the backoff plus a random part of the other half, so the sessions
+// of many bouncers don't all come back to probe at the same moment
+static long Upstream_backoff(Upstream* upstream)
+{
+    long backoff = UPSTREAM_BACKOFF_MS << (upstream->backoffs < 6 ? upstream->backoffs : 6);
+    if (backoff > UPSTREAM_MAX_BACKOFF_MS) { backoff = UPSTREAM_MAX_BACKOFF_MS; }
+    if (upstream->backoffs < 31) { upstream->backoffs++; }
+
+    unsigned int jitter;
+    if (getrandom(&jitter, sizeof(jitter), GRND_NONBLOCK) != sizeof(jitter)) {
+        jitter = monotonicUs();
+    }
+    return backoff / 2 + jitter % (backoff / 2 + 1);
+}
+
+// false while the breaker is open, once it is due the first session to
+// ask becomes the probe and the rest are still turned away, a probe that
+// never reports back loses its turn after the longest backoff
+bool Upstream_allow(Upstream* upstream)
+{
+    bool allow = true;
+    long now = monotonicMs();
+    pthread_mutex_lock(&upstream->mutex);
+    if (upstream->state != UPSTREAM_CLOSED && now >= upstream->retryMs) {
+        upstream->state = UPSTREAM_HALF_OPEN;
+        upstream->retryMs = now + UPSTREAM_MAX_BACKOFF_MS;
+    }
+    else if (upstream->state != UPSTREAM_CLOSED) {
+        allow = false;
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+    return allow;
+}
+
+void Upstream_success(Upstream* upstream, long connectUs)
+{
+    // a connect that only just made it is as good as a failure for tripping
+    if (connectUs >= UPSTREAM_SLOW_US) {
+        Upstream_failure(upstream);
+        return;
+    }
+
+    pthread_mutex_lock(&upstream->mutex);
+    upstream->state = UPSTREAM_CLOSED;
+    upstream->failures = 0;
+    upstream->backoffs = 0;
+    upstream->connectUs = upstream->connectUs == 0 ? connectUs :
+                          upstream->connectUs + (connectUs - upstream->connectUs) / 8;
+    pthread_mutex_unlock(&upstream->mutex);
+}
+
+void Upstream_failure(Upstream* upstream)
+{
+    pthread_mutex_lock(&upstream->mutex);
+    upstream->failures++;
+    if (upstream->state == UPSTREAM_HALF_OPEN ||
+        (upstream->state == UPSTREAM_CLOSED && upstream->failures >= UPSTREAM_TRIP_FAILURES)) {
+        upstream->state = UPSTREAM_OPEN;
+        upstream->retryMs = monotonicMs() + Upstream_backoff(upstream);
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+}
+
+// every nth session to the upstream is sampled, 0 samples none
+bool Upstream_pickSample(Upstream* upstream, unsigned int every)
+{
+    if (every == 0) { return false; }
+    return __atomic_fetch_add(&upstream->sessions, 1, __ATOMIC_RELAXED) % every == 0;
+}
+
+// rounded away from the average so small values can still reach zero
+static long Upstream_average(long average, long sample, bool first)
+{
+    if (first) { return sample; }
+    return average + (sample - average + (sample > average ? 7 : -7)) / 8;
+}
+
+// each factor is a fraction the score is multiplied by, the slack keeps
+// microsecond wobbles on short paths from counting as queueing
+static unsigned int Upstream_rate(const UpstreamQuality* quality)
+{
+    double score = UPSTREAM_MAX_SCORE;
+    double rtt = quality->rttUs + UPSTREAM_RTT_SLACK_US;
+
+    score *= (quality->minRttUs + UPSTREAM_RTT_SLACK_US) / rtt;
+    if (quality->rttVarUs > quality->rttUs / 2) {
+        score *= rtt / (rtt + quality->rttVarUs - quality->rttUs / 2);
+    }
+
+    score *= quality->lossPermille >= 100 ? 0 : 1 - quality->lossPermille / 100.0;
+    if (quality->cwnd < UPSTREAM_LOW_CWND) {
+        score *= (double) quality->cwnd / UPSTREAM_LOW_CWND;
+    }
+
+    return score + 0.5;
+}
+
+// folds the socket's TCP_INFO into the upstream's averages and copies
+// them out for the stats, false if the socket had nothing to say
+bool Upstream_sample(Upstream* upstream, int sock, UpstreamSample* last,
+                     UpstreamQuality* quality)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_rtt == 0) {
+        return false;
+    }
+
+    // a few segments say nothing about loss, a retransmitted syn against
+    // the handshake alone would read as half of them lost. they add up
+    // until there are enough.
+    uint32_t retrans = info.tcpi_total_retrans - last->retrans;
+    uint32_t segsOut = info.tcpi_segs_out - last->segsOut;
+    bool lossKnown = segsOut >= UPSTREAM_MIN_SEGS;
+    if (lossKnown) {
+        last->retrans = info.tcpi_total_retrans;
+        last->segsOut = info.tcpi_segs_out;
+    }
+
+    // older kernels fill in less of the struct
+    uint64_t deliveryRate = 0;
+    if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate)) {
+        deliveryRate = info.tcpi_delivery_rate;
+    }
+    long minRttUs = info.tcpi_rtt;
+    if (len >= offsetof(struct tcp_info, tcpi_min_rtt) + sizeof(info.tcpi_min_rtt) &&
+        info.tcpi_min_rtt != 0 && info.tcpi_min_rtt < info.tcpi_rtt) {
+        minRttUs = info.tcpi_min_rtt;
+    }
+
+    pthread_mutex_lock(&upstream->mutex);
+    UpstreamQuality* q = &upstream->quality;
+    bool first = q->samples++ == 0;
+    q->rttUs = Upstream_average(q->rttUs, info.tcpi_rtt, first);
+    q->rttVarUs = Upstream_average(q->rttVarUs, info.tcpi_rttvar, first);
+
+    if (first || q->samples % UPSTREAM_MIN_RTT_WINDOW == 1) {
+        q->lastMinRttUs = first ? minRttUs : q->windowMinRttUs;
+        q->windowMinRttUs = minRttUs;
+    }
+    if (minRttUs < q->windowMinRttUs) { q->windowMinRttUs = minRttUs; }
+    q->minRttUs = q->windowMinRttUs < q->lastMinRttUs ? q->windowMinRttUs : q->lastMinRttUs;
+
+    if (lossKnown) {
+        q->lossPermille = Upstream_average(q->lossPermille, retrans * 1000L / segsOut,
+                                           q->lossSamples++ == 0);
+    }
+    q->cwnd = Upstream_average(q->cwnd, info.tcpi_snd_cwnd, first);
+    if (deliveryRate > 0) {
+        q->deliveryRate = Upstream_average(q->deliveryRate, deliveryRate, q->deliveryRate == 0);
+    }
+    __atomic_store_n(&q->score, Upstream_rate(q), __ATOMIC_RELAXED);
+    *quality = *q;
+    pthread_mutex_unlock(&upstream->mutex);
+    return true;
+}
+
+unsigned int Upstream_score(Upstream* upstream)
+{
+    return __atomic_load_n(&upstream->quality.score, __ATOMIC_RELAXED);
+}
+
+// scoring below minScore, bar every so often a session that goes anyway
+// so the score has something to recover from
+bool Upstream_degraded(Upstream* upstream, unsigned int minScore)
+{
+    if (Upstream_score(upstream) >= minScore) { return false; }
+    return __atomic_fetch_add(&upstream->passedOver, 1, __ATOMIC_RELAXED) %
+           UPSTREAM_PROBE_EVERY != 0;
+}
@@ -0,0 +1,102 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EBBNC_UPSTREAM_H
+#define EBBNC_UPSTREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define UPSTREAM_TRIP_FAILURES  5
+#define UPSTREAM_SLOW_US        2000000L
+#define UPSTREAM_BACKOFF_MS     1000L
+#define UPSTREAM_MAX_BACKOFF_MS 60000L
+#define UPSTREAM_SAMPLE_MS      5000L
+#define UPSTREAM_MAX_SCORE      100
+#define UPSTREAM_RTT_SLACK_US   1000L
+#define UPSTREAM_LOW_CWND       4
+#define UPSTREAM_PROBE_EVERY    16
+#define UPSTREAM_MIN_RTT_WINDOW 64          // samples
+#define UPSTREAM_MIN_SEGS       32
+
+// upstreams are interned for the life of the process, so sessions can
+// hold on to them without reference counting across reloads
+
+enum UpstreamState
+{
+    UPSTREAM_CLOSED,        // connecting normally
+    UPSTREAM_OPEN,          // failing, nobody connects until retryMs
+    UPSTREAM_HALF_OPEN      // one session is probing until retryMs
+};
+
+// moving averages of TCP_INFO taken from a sample of the sessions, the
+// score starts at UPSTREAM_MAX_SCORE and falls with queueing over the
+// best rtt seen, jitter, retransmits and a collapsed window. the best rtt
+// is the least over this window of samples and the one before, so a path
+// that gets longer for good stops counting as queueing.
+typedef struct {
+    unsigned long       samples;
+    long                rttUs;
+    long                rttVarUs;
+    long                minRttUs;
+    long                windowMinRttUs;     // so far in this window
+    long                lastMinRttUs;       // of the window before
+    long                lossPermille;       // segments retransmitted
+    unsigned long       lossSamples;
+    long                cwnd;
+    uint64_t            deliveryRate;       // bytes per second
+    unsigned int        score;
+} UpstreamQuality;
+
+// what a session's socket showed when its loss was last taken, its
+// counters are cumulative
+typedef struct {
+    uint32_t            retrans;
+    uint32_t            segsOut;
+} UpstreamSample;
+
+typedef struct Upstream {
+    char*               host;
+    long                port;
+    struct ssl_session_st* tlsSession;     // guarded in tls.c
+
+    pthread_mutex_t     mutex;
+    enum UpstreamState  state;
+    unsigned int        failures;
+    unsigned int        backoffs;
+    long                retryMs;
+    long                connectUs;          // moving average of good connects
+    unsigned int        sessions;
+    unsigned int        passedOver;
+    UpstreamQuality     quality;
+
+    struct Upstream*    next;
+} Upstream;
+
+Upstream* Upstream_get(const char* host, long port);
+Upstream* Upstream_parse(const char* hostPort);
+bool Upstream_allow(Upstream* upstream);
+void Upstream_success(Upstream* upstream, long connectUs);
+void Upstream_failure(Upstream* upstream);
+bool Upstream_pickSample(Upstream* upstream, unsigned int every);
+bool Upstream_sample(Upstream* upstream, int sock, UpstreamSample* last,
+                     UpstreamQuality* quality);
+unsigned int Upstream_score(Upstream* upstream);
+bool Upstream_degraded(Upstream* upstream, unsigned int minScore);
+
+#endif
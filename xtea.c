@@ -225,3 +225,237 @@ int XTeaGenerateIVec(unsigned char ivec[XTEA_BLOCK_SIZE])
 
     return ret == XTEA_BLOCK_SIZE ? 0 : -1;
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XTEA_X86
+#endif
+
+#define XTEA_CTR_CHUNK      64
+
+// per round sums with the key word already added, the same for every
+// block so the vector kernels broadcast them
+typedef struct {
+    uint32_t    k0[XTEA_NUM_ROUNDS];
+    uint32_t    k1[XTEA_NUM_ROUNDS];
+} XTeaSchedule;
+
+static void XTeaScheduleKey(XTeaSchedule* sched, const unsigned char ckey[XTEA_KEY_SIZE])
+{
+    uint32_t key[4];
+    memcpy(key, ckey, sizeof(key));
+
+    uint32_t sum = 0;
+    unsigned int i;
+    for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+        sched->k0[i] = sum + key[sum & 3];
+        sum += XTEA_DELTA;
+        sched->k1[i] = sum + key[(sum >> 11) & 3];
+    }
+}
+
+static void XTeaKeystreamScalar(uint64_t counter, size_t blocks, uint32_t* out,
+                                const XTeaSchedule* sched)
+{
+    size_t b;
+    for (b = 0; b < blocks; ++b, ++counter) {
+        uint32_t s0 = (uint32_t) counter;
+        uint32_t s1 = (uint32_t)(counter >> 32);
+
+        unsigned int i;
+        for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+            s0 += (((s1 << 4) ^ (s1 >> 5)) + s1) ^ sched->k0[i];
+            s1 += (((s0 << 4) ^ (s0 >> 5)) + s0) ^ sched->k1[i];
+        }
+
+        out[b * 2] = s0;
+        out[b * 2 + 1] = s1;
+    }
+}
+
+#ifdef XTEA_X86
+
+static void XTeaKeystreamSSE2(uint64_t counter, size_t blocks, uint32_t* out,
+                              const XTeaSchedule* sched)
+{
+    while (blocks >= 4) {
+        __m128i s0 = _mm_set_epi32((uint32_t)(counter + 3), (uint32_t)(counter + 2),
+                                   (uint32_t)(counter + 1), (uint32_t) counter);
+        __m128i s1 = _mm_set_epi32((uint32_t)((counter + 3) >> 32),
+                                   (uint32_t)((counter + 2) >> 32),
+                                   (uint32_t)((counter + 1) >> 32),
+                                   (uint32_t)(counter >> 32));
+
+        unsigned int i;
+        for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+            __m128i t = _mm_xor_si128(_mm_slli_epi32(s1, 4), _mm_srli_epi32(s1, 5));
+            t = _mm_xor_si128(_mm_add_epi32(t, s1), _mm_set1_epi32(sched->k0[i]));
+            s0 = _mm_add_epi32(s0, t);
+
+            t = _mm_xor_si128(_mm_slli_epi32(s0, 4), _mm_srli_epi32(s0, 5));
+            t = _mm_xor_si128(_mm_add_epi32(t, s0), _mm_set1_epi32(sched->k1[i]));
+            s1 = _mm_add_epi32(s1, t);
+        }
+
+        _mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi32(s0, s1));
+        _mm_storeu_si128((__m128i*)(out + 4), _mm_unpackhi_epi32(s0, s1));
+
+        out += 8;
+        counter += 4;
+        blocks -= 4;
+    }
+
+    XTeaKeystreamScalar(counter, blocks, out, sched);
+}
+
+__attribute__((target("avx2")))
+static void XTeaKeystreamAVX2(uint64_t counter, size_t blocks, uint32_t* out,
+                              const XTeaSchedule* sched)
+{
+    while (blocks >= 8) {
+        uint32_t lo[8];
+        uint32_t hi[8];
+        unsigned int i;
+        for (i = 0; i < 8; ++i) {
+            lo[i] = (uint32_t)(counter + i);
+            hi[i] = (uint32_t)((counter + i) >> 32);
+        }
+
+        __m256i s0 = _mm256_loadu_si256((const __m256i*) lo);
+        __m256i s1 = _mm256_loadu_si256((const __m256i*) hi);
+
+        for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+            __m256i t = _mm256_xor_si256(_mm256_slli_epi32(s1, 4), _mm256_srli_epi32(s1, 5));
+            t = _mm256_xor_si256(_mm256_add_epi32(t, s1), _mm256_set1_epi32(sched->k0[i]));
+            s0 = _mm256_add_epi32(s0, t);
+
+            t = _mm256_xor_si256(_mm256_slli_epi32(s0, 4), _mm256_srli_epi32(s0, 5));
+            t = _mm256_xor_si256(_mm256_add_epi32(t, s0), _mm256_set1_epi32(sched->k1[i]));
+            s1 = _mm256_add_epi32(s1, t);
+        }
+
+        // unpack works within each 128 bit half, put the blocks back in order
+        __m256i a = _mm256_unpacklo_epi32(s0, s1);
+        __m256i b = _mm256_unpackhi_epi32(s0, s1);
+        _mm256_storeu_si256((__m256i*) out, _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 8), _mm256_permute2x128_si256(a, b, 0x31));
+
+        out += 16;
+        counter += 8;
+        blocks -= 8;
+    }
+
+    XTeaKeystreamSSE2(counter, blocks, out, sched);
+}
+
+#endif
+
+typedef void (*XTeaKeystreamFunc)(uint64_t, size_t, uint32_t*, const XTeaSchedule*);
+
+static XTeaKeystreamFunc keystreamFunc = NULL;
+static enum XTeaKernel keystreamKernel = XTEA_KERNEL_SCALAR;
+
+bool XTeaUseKernel(enum XTeaKernel kernel)
+{
+    switch (kernel) {
+        case XTEA_KERNEL_SCALAR :
+            keystreamFunc = XTeaKeystreamScalar;
+            break;
+#ifdef XTEA_X86
+        case XTEA_KERNEL_SSE2 :
+            if (!__builtin_cpu_supports("sse2")) { return false; }
+            keystreamFunc = XTeaKeystreamSSE2;
+            break;
+        case XTEA_KERNEL_AVX2 :
+            if (!__builtin_cpu_supports("avx2")) { return false; }
+            keystreamFunc = XTeaKeystreamAVX2;
+            break;
+#endif
+        default :
+            return false;
+    }
+
+    keystreamKernel = kernel;
+    return true;
+}
+
+static void XTeaSelectKernel()
+{
+    if (keystreamFunc) { return; }
+
+    __builtin_cpu_init();
+    if (!XTeaUseKernel(XTEA_KERNEL_AVX2) && !XTeaUseKernel(XTEA_KERNEL_SSE2)) {
+        XTeaUseKernel(XTEA_KERNEL_SCALAR);
+    }
+}
+
+const char* XTeaKernelName()
+{
+    XTeaSelectKernel();
+    switch (keystreamKernel) {
+        case XTEA_KERNEL_SSE2 : return "sse2";
+        case XTEA_KERNEL_AVX2 : return "avx2";
+        default : return "scalar";
+    }
+}
+
+void XTeaCTR(const unsigned char* src, unsigned char* dst, size_t len,
+             const unsigned char ivec[XTEA_BLOCK_SIZE], uint64_t offset,
+             const unsigned char key[XTEA_KEY_SIZE])
+{
+    XTeaSelectKernel();
+
+    XTeaSchedule sched;
+    XTeaScheduleKey(&sched, key);
+
+    uint32_t iv[2];
+    memcpy(iv, ivec, sizeof(iv));
+    uint64_t counter = ((uint64_t) iv[1] << 32 | iv[0]) + offset / XTEA_BLOCK_SIZE;
+    size_t skip = offset % XTEA_BLOCK_SIZE;
+
+    uint32_t stream[XTEA_CTR_CHUNK * 2];
+    while (len > 0) {
+        size_t blocks = (skip + len + XTEA_BLOCK_SIZE - 1) / XTEA_BLOCK_SIZE;
+        if (blocks > XTEA_CTR_CHUNK) { blocks = XTEA_CTR_CHUNK; }
+
+        keystreamFunc(counter, blocks, stream, &sched);
+        counter += blocks;
+
+        const unsigned char* ks = (const unsigned char*) stream + skip;
+        size_t n = blocks * XTEA_BLOCK_SIZE - skip;
+        if (n > len) { n = len; }
+
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            dst[i] = src[i] ^ ks[i];
+        }
+
+        src += n;
+        dst += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
+void XTeaCBCMAC(const unsigned char first[XTEA_BLOCK_SIZE], const unsigned char* src,
+                size_t len, unsigned char mac[XTEA_BLOCK_SIZE],
+                const unsigned char key[XTEA_KEY_SIZE])
+{
+    unsigned char block[XTEA_BLOCK_SIZE];
+    XTeaEncrypt(first, mac, key);
+
+    while (len > 0) {
+        size_t n = len < XTEA_BLOCK_SIZE ? len : XTEA_BLOCK_SIZE;
+        memset(block, 0, sizeof(block));
+        memcpy(block, src, n);
+
+        unsigned int i;
+        for (i = 0; i < XTEA_BLOCK_SIZE; ++i) {
+            block[i] ^= mac[i];
+        }
+        XTeaEncrypt(block, mac, key);
+
+        src += n;
+        len -= n;
+    }
+}
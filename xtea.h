@@ -19,6 +19,8 @@
 #define EBBNC_XTEA_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define XTEA_BLOCK_SIZE     8
 #define XTEA_KEY_SIZE       16
@@ -40,4 +42,29 @@ ssize_t XTeaDecryptCBC(const unsigned char* src, size_t srcLen,
                        const unsigned char ivec[XTEA_BLOCK_SIZE],
                        const unsigned char key[XTEA_KEY_SIZE]);
 
+// counter mode, block i of the keystream encrypts ivec + i taken as a
+// 64 bit counter, offset is the position of src in the byte stream so a
+// stream can be processed in pieces of any size. blocks are independent
+// so the keystream is generated several blocks at a time with sse2 or
+// avx2 where the cpu has them.
+
+enum XTeaKernel {
+    XTEA_KERNEL_SCALAR,
+    XTEA_KERNEL_SSE2,
+    XTEA_KERNEL_AVX2
+};
+
+void XTeaCTR(const unsigned char* src, unsigned char* dst, size_t len,
+             const unsigned char ivec[XTEA_BLOCK_SIZE], uint64_t offset,
+             const unsigned char key[XTEA_KEY_SIZE]);
+bool XTeaUseKernel(enum XTeaKernel kernel);
+const char* XTeaKernelName();
+
+// cbc-mac of first followed by src, the last block zero padded. it is
+// only sound where no message can be a prefix of another, so first has
+// to fix the length of what follows.
+void XTeaCBCMAC(const unsigned char first[XTEA_BLOCK_SIZE], const unsigned char* src,
+                size_t len, unsigned char mac[XTEA_BLOCK_SIZE],
+                const unsigned char key[XTEA_KEY_SIZE]);
+
 #endif
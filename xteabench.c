@@ -0,0 +1,118 @@
+//
+//  Copyright (C) 2013 ebftpd team
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "xtea.h"
+
+#define BENCH_SIZE      (1024 * 1024)
+#define BENCH_ROUNDS    64
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double secs)
+{
+    printf("%-8s %8.1f MB/s\n", name, (double) BENCH_SIZE * BENCH_ROUNDS / secs / 1e6);
+}
+
+int main()
+{
+    unsigned char key[XTEA_KEY_SIZE] = "0123456789abcdef";
+    unsigned char ivec[XTEA_BLOCK_SIZE];
+    if (XTeaGenerateIVec(ivec) < 0) {
+        perror("XTeaGenerateIVec");
+        return 1;
+    }
+
+    unsigned char* src = malloc(BENCH_SIZE);
+    unsigned char* dst = malloc(BENCH_SIZE + XTEA_BLOCK_SIZE);
+    unsigned char* ref = malloc(BENCH_SIZE);
+    if (!src || !dst || !ref) {
+        perror("malloc");
+        return 1;
+    }
+
+    size_t i;
+    for (i = 0; i < BENCH_SIZE; ++i) {
+        src[i] = rand();
+    }
+
+    double start = now();
+    for (i = 0; i < BENCH_ROUNDS; ++i) {
+        unsigned char iv[XTEA_BLOCK_SIZE];
+        memcpy(iv, ivec, sizeof(iv));
+        XTeaEncryptCBC(src, BENCH_SIZE, dst, BENCH_SIZE + XTEA_BLOCK_SIZE, iv, key);
+    }
+    report("cbc", now() - start);
+
+    // the first block of the keystream is the iv encrypted on its own
+    XTeaUseKernel(XTEA_KERNEL_SCALAR);
+    XTeaCTR(src, ref, BENCH_SIZE, ivec, 0, key);
+    {
+        unsigned char block[XTEA_BLOCK_SIZE];
+        XTeaEncryptECB(ivec, XTEA_BLOCK_SIZE, block, sizeof(block), key);
+        for (i = 0; i < XTEA_BLOCK_SIZE; ++i) {
+            if ((src[i] ^ block[i]) != ref[i]) {
+                fprintf(stderr, "scalar keystream does not match block cipher\n");
+                return 1;
+            }
+        }
+    }
+
+    static const enum XTeaKernel kernels[] = {
+        XTEA_KERNEL_SCALAR, XTEA_KERNEL_SSE2, XTEA_KERNEL_AVX2
+    };
+
+    size_t k;
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!XTeaUseKernel(kernels[k])) { continue; }
+
+        // odd sized pieces at odd offsets must give the same stream
+        size_t off = 0;
+        size_t piece = 1;
+        while (off < BENCH_SIZE) {
+            size_t len = piece < BENCH_SIZE - off ? piece : BENCH_SIZE - off;
+            XTeaCTR(src + off, dst + off, len, ivec, off, key);
+            off += len;
+            piece = piece * 3 + 1;
+        }
+
+        if (memcmp(dst, ref, BENCH_SIZE)) {
+            fprintf(stderr, "%s keystream does not match scalar\n", XTeaKernelName());
+            return 1;
+        }
+
+        start = now();
+        for (i = 0; i < BENCH_ROUNDS; ++i) {
+            XTeaCTR(src, dst, BENCH_SIZE, ivec, 0, key);
+        }
+        report(XTeaKernelName(), now() - start);
+    }
+
+    free(src);
+    free(dst);
+    free(ref);
+    return 0;
+}